@@ -0,0 +1,107 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <time.h>
+
+// 单调时钟 微秒
+inline long long monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 单调时钟 毫秒 连接定时器和事件循环的截止时间都用它，不受系统时间调整的影响
+inline long long monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// CoDel(Controlled Delay)：按请求在队列中的排队时延而不是队列长度来判断过载
+// 排队时延在一个interval内始终高于target，说明队列是"坏队列"，开始丢弃(这里是直接回503)
+// 进入丢弃状态后按 interval/sqrt(count) 的间隔逐渐加快丢弃，直到排队时延回落到target以下
+// 不是线程安全的，由调用方(threadpool)在队列锁内调用
+class codel
+{
+public:
+    codel(long long target_us = 5000, long long interval_us = 100000)
+        : m_target(target_us), m_interval(interval_us), m_first_above_time(0),
+          m_drop_next(0), m_count(0), m_dropping(false) {}
+
+    // now:出队时刻 sojourn:该请求的排队时延 返回true表示该请求应当被丢弃
+    bool should_drop(long long now, long long sojourn)
+    {
+        bool ok_to_drop = false;
+        if (sojourn < m_target)
+        {
+            // 排队时延恢复正常
+            m_first_above_time = 0;
+        }
+        else if (m_first_above_time == 0)
+        {
+            // 第一次超过target 再观察一个interval
+            m_first_above_time = now + m_interval;
+        }
+        else if (now >= m_first_above_time)
+        {
+            ok_to_drop = true;
+        }
+
+        if (m_dropping)
+        {
+            if (!ok_to_drop)
+            {
+                m_dropping = false; // 离开丢弃状态
+                return false;
+            }
+            if (now >= m_drop_next)
+            {
+                ++m_count;
+                m_drop_next = control_law(m_drop_next);
+                return true;
+            }
+            return false;
+        }
+
+        if (ok_to_drop)
+        {
+            // 进入丢弃状态 如果距离上次丢弃不久 则沿用之前的丢弃速率
+            m_dropping = true;
+            if (m_count > 2 && now - m_drop_next < 8 * m_interval)
+            {
+                m_count -= 2;
+            }
+            else
+            {
+                m_count = 1;
+            }
+            m_drop_next = control_law(now);
+            return true;
+        }
+        return false;
+    }
+
+private:
+    long long control_law(long long t)
+    {
+        // interval / sqrt(count) 用整数牛顿迭代求平方根 避免引入浮点
+        long long x = m_count > 0 ? m_count : 1;
+        while (x * x > m_count)
+        {
+            x = (x + m_count / x) / 2;
+        }
+        return t + m_interval / (x > 0 ? x : 1);
+    }
+
+private:
+    long long m_target;           // 可接受的排队时延
+    long long m_interval;         // 观察窗口
+    long long m_first_above_time; // 排队时延持续高于target的截止观察时刻
+    long long m_drop_next;        // 下一次丢弃的时刻
+    long long m_count;            // 本轮丢弃状态中已丢弃的请求数
+    bool m_dropping;              // 是否处于丢弃状态
+};
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef CLIENT_LIMITS_H
+#define CLIENT_LIMITS_H
+
+#include <string.h>
+#include <netinet/in.h>
+#include "locker.h"
+#include "admission.h"
+
+// 按客户端IP限制同时打开的连接数和请求速率
+// 每个IP一个表项：当前连接数和一个令牌桶。令牌桶不用定时器补充，每次访问时按距上次访问的时间一次补足(惰性补充)
+// 表按IP的哈希分成若干段，每段一把锁和一个开放寻址(线性探测)的数组，accept、请求和关闭分别落在不同段上时互不争用
+// 没有连接且令牌已补满的表项与空槽等价，插入时直接复用，不需要删除和墓碑；探测范围内都被占用时放行(不限制)
+// 两项限制都为0时不分配表，也不加锁
+// 多进程模式下每个工作进程各有一张表，限制按工作进程计
+class client_limits
+{
+public:
+    static const int SHARDS = 64;       // 段数
+    static const int SHARD_SLOTS = 256; // 每段的槽数 必须是2的幂
+    static const int MAX_PROBE = 16;    // 查找和插入时最多探测的槽数
+    static const long long TOKEN = 1000000; // 一个令牌 按微秒补充，rate个/秒即每微秒rate个单位
+
+    client_limits() : m_shards(NULL), m_max_connections(0), m_rate(0), m_burst(0),
+                      m_rejected_connections(0), m_limited_requests(0) {}
+    ~client_limits()
+    {
+        delete[] m_shards;
+    }
+
+    // 设置限制 启动和重新加载配置时在事件循环中调用；max_connections和rate为0表示不限
+    // 已经打开的连接在启用之前没有计入，关闭时也不会扣减(见connect的counted)
+    void configure(int max_connections, int rate, int burst)
+    {
+        if (!m_shards && (max_connections > 0 || rate > 0))
+        {
+            m_shards = new shard[SHARDS];
+        }
+        __atomic_store_n(&m_burst, burst > 0 ? burst : 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&m_rate, rate, __ATOMIC_RELAXED);
+        __atomic_store_n(&m_max_connections, max_connections, __ATOMIC_RELEASE);
+    }
+
+    bool enabled() const
+    {
+        return __atomic_load_n(&m_max_connections, __ATOMIC_ACQUIRE) > 0 || __atomic_load_n(&m_rate, __ATOMIC_ACQUIRE) > 0;
+    }
+
+    // 新连接 该IP的连接数已达上限时返回false，调用者直接关闭连接
+    // counted表示是否计入了连接数(未启用限制或探测范围已满时放行但不计入) 调用者随连接保存，关闭时只有计入的才调用disconnect
+    bool connect(in_addr_t addr, bool &counted)
+    {
+        counted = false;
+        int max = __atomic_load_n(&m_max_connections, __ATOMIC_ACQUIRE);
+        if (max <= 0)
+        {
+            return true;
+        }
+        shard &s = shard_of(addr);
+        bool ok = true;
+        s.lock.lock();
+        entry *e = find(s, addr, monotonic_us(), true);
+        if (e)
+        {
+            ok = e->connections < max;
+            e->connections += ok ? 1 : 0;
+            counted = ok;
+        }
+        s.lock.unlock();
+        if (!ok)
+        {
+            __atomic_add_fetch(&m_rejected_connections, 1, __ATOMIC_RELAXED);
+        }
+        return ok;
+    }
+
+    // connect计入了的连接关闭 此后限制被关闭了也要扣减，再次启用时计数仍然准确
+    void disconnect(in_addr_t addr)
+    {
+        shard &s = shard_of(addr);
+        s.lock.lock();
+        entry *e = find(s, addr, monotonic_us(), false);
+        if (e && e->connections > 0)
+        {
+            --e->connections;
+        }
+        s.lock.unlock();
+    }
+
+    // 一个请求 取走一个令牌；桶已空时返回false，调用者回429
+    bool request(in_addr_t addr)
+    {
+        if (__atomic_load_n(&m_rate, __ATOMIC_ACQUIRE) <= 0)
+        {
+            return true;
+        }
+        shard &s = shard_of(addr);
+        bool ok = true;
+        s.lock.lock();
+        entry *e = find(s, addr, monotonic_us(), true);
+        if (e)
+        {
+            ok = e->tokens >= TOKEN;
+            e->tokens -= ok ? TOKEN : 0;
+        }
+        s.lock.unlock();
+        if (!ok)
+        {
+            __atomic_add_fetch(&m_limited_requests, 1, __ATOMIC_RELAXED);
+        }
+        return ok;
+    }
+
+private:
+    struct entry
+    {
+        in_addr_t addr;
+        bool used;         // 为false表示从未使用过的槽 探测到这里即可停止
+        int connections;   // 当前打开的连接数
+        long long tokens;  // 桶中的令牌 以TOKEN为单位
+        long long refill_us; // 上次补充令牌的时刻
+    };
+
+    struct shard
+    {
+        shard() { memset(slots, 0, sizeof(slots)); }
+        locker lock;
+        entry slots[SHARD_SLOTS];
+    };
+
+    // 充分混合地址的每一位(MurmurHash3的fmix32)：只做一次乘法时结果的低位只取决于地址的低位，
+    // 即网络字节序的第一个字节，同一个/8的客户端会从同一个槽开始探测，探测范围很快被占满
+    static unsigned hash(in_addr_t addr)
+    {
+        unsigned h = (unsigned)addr;
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        return h;
+    }
+
+    // 最高6位选段 第8位起选槽，两者互不重叠
+    shard &shard_of(in_addr_t addr)
+    {
+        return m_shards[(hash(addr) >> 26) % SHARDS];
+    }
+
+    static unsigned slot_of(in_addr_t addr)
+    {
+        return hash(addr) >> 8;
+    }
+
+    // 按经过的时间补充令牌 最多补到burst个
+    void refill(entry &e, long long now)
+    {
+        long long rate = __atomic_load_n(&m_rate, __ATOMIC_RELAXED);
+        long long cap = __atomic_load_n(&m_burst, __ATOMIC_RELAXED) * TOKEN;
+        long long elapsed = now - e.refill_us;
+        e.refill_us = now;
+        if (rate <= 0 || e.tokens >= cap)
+        {
+            e.tokens = cap;
+            return;
+        }
+        // 先比较再相乘 空闲很久的表项不会溢出
+        e.tokens = elapsed >= (cap - e.tokens) / rate + 1 ? cap : e.tokens + elapsed * rate;
+    }
+
+    // 没有连接且令牌已满 和从未出现过的客户端没有区别
+    bool reclaimable(entry &e, long long now)
+    {
+        if (e.connections > 0)
+        {
+            return false;
+        }
+        refill(e, now);
+        return e.tokens >= __atomic_load_n(&m_burst, __ATOMIC_RELAXED) * TOKEN;
+    }
+
+    // 在段内查找addr的表项 create时没有则占用探测到的第一个空槽或可复用的槽；找不到时返回NULL
+    // 返回的表项已补充过令牌
+    entry *find(shard &s, in_addr_t addr, long long now, bool create)
+    {
+        unsigned start = slot_of(addr);
+        entry *free_slot = NULL;
+        for (int i = 0; i < MAX_PROBE; ++i)
+        {
+            entry &e = s.slots[(start + i) & (SHARD_SLOTS - 1)];
+            if (e.used && e.addr == addr)
+            {
+                refill(e, now);
+                return &e;
+            }
+            if (!e.used)
+            {
+                free_slot = free_slot ? free_slot : &e;
+                break; // 从未使用过的槽之后不会再有addr
+            }
+            if (create && !free_slot && reclaimable(e, now))
+            {
+                free_slot = &e;
+            }
+        }
+        if (!create || !free_slot)
+        {
+            return NULL;
+        }
+        free_slot->addr = addr;
+        free_slot->used = true;
+        free_slot->connections = 0;
+        free_slot->tokens = __atomic_load_n(&m_burst, __ATOMIC_RELAXED) * TOKEN;
+        free_slot->refill_us = now;
+        return free_slot;
+    }
+
+private:
+    shard *m_shards;
+    int m_max_connections; // 每个IP同时打开的最大连接数 0表示不限
+    int m_rate;            // 每个IP每秒补充的令牌数(请求数) 0表示不限
+    int m_burst;           // 令牌桶容量 允许的突发请求数
+
+public:
+    long long m_rejected_connections; // 因连接数超限被关闭的连接
+    long long m_limited_requests;     // 因速率超限回429的请求
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef COMPLETION_QUEUE_H
+#define COMPLETION_QUEUE_H
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <exception>
+#include <vector>
+#include "locker.h"
+
+struct h2_stream;
+
+// 工作线程到事件循环的完成队列
+// 工作线程处理完请求后不再直接修改epoll事件表、定时器和连接状态，而是把(连接fd, 后续动作)放进队列，
+// 由拥有这些连接的事件循环取出后统一执行，定时器链表和连接的关闭因此只在事件循环线程中访问
+// 队列由空变为非空时写一次eventfd唤醒事件循环，事件循环一次取走全部完成项
+// 每项带上连接的代数(fd每被一个新连接使用一次加1)，事件循环丢弃代数与当前连接不符的项，
+// 迟到的完成项不会作用到复用了同一fd的新连接上
+class completion_queue
+{
+public:
+    enum action
+    {
+        WANT_READ,  // 请求不完整 重新监听可读
+        WANT_WRITE, // 响应已构造好 由事件循环写出
+        CLOSE       // 构造响应出错 关闭连接
+    };
+
+    struct completion
+    {
+        int fd;
+        unsigned generation; // 投递时连接的代数
+        action act;
+        h2_stream *stream; // HTTP/2连接上的请求 HTTP/1.1连接为NULL
+    };
+
+    completion_queue()
+    {
+        m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_eventfd < 0)
+        {
+            throw std::exception();
+        }
+    }
+    ~completion_queue()
+    {
+        close(m_eventfd);
+    }
+
+    // 注册到事件循环的eventfd 可读表示有完成项
+    int fd() const
+    {
+        return m_eventfd;
+    }
+
+    // 工作线程：投递一个完成项
+    void post(int fd, unsigned generation, action act, h2_stream *stream = NULL)
+    {
+        completion c = {fd, generation, act, stream};
+        m_lock.lock();
+        bool wake = m_items.empty(); // 非空时事件循环已被唤醒且尚未取走 不必再写eventfd
+        m_items.push_back(c);
+        m_lock.unlock();
+        if (wake)
+        {
+            uint64_t one = 1;
+            ssize_t ret = ::write(m_eventfd, &one, sizeof(one));
+            (void)ret;
+        }
+    }
+
+    // 事件循环：先清零eventfd再取走全部完成项 之后投递的项会再次唤醒事件循环
+    void take(std::vector<completion> &out)
+    {
+        uint64_t count;
+        ssize_t ret = ::read(m_eventfd, &count, sizeof(count));
+        (void)ret;
+        out.clear();
+        m_lock.lock();
+        out.swap(m_items);
+        m_lock.unlock();
+    }
+
+private:
+    int m_eventfd;
+    locker m_lock;
+    std::vector<completion> m_items;
+};
+
+#endif
@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include "config.h"
+#include "mime.h"
+
+// 参数表 整数参数给出取值范围，字符串参数的int_value为NULL
+// reloadable的参数可以在运行中重新加载 其余的在启动时确定(线程、预分配的数组、监听地址等)
+struct config_option
+{
+    const char *name;
+    int server_config::*int_value;
+    std::string server_config::*str_value;
+    long min;
+    long max;
+    bool reloadable;
+    const char *help;
+};
+
+static const config_option options[] = {
+    {"ip", NULL, &server_config::ip, 0, 0, false, "listen address"},
+    {"port", &server_config::port, NULL, 1, 65535, false, "listen port"},
+    {"engine", NULL, &server_config::engine, 0, 0, false, "event engine: epoll, uring or coro"},
+    {"doc_root", NULL, &server_config::doc_root, 0, 0, true, "directory served for static requests"},
+    {"charset", NULL, &server_config::charset, 0, 0, false, "default charset of textual types, empty for none"},
+    {"mime_types", NULL, &server_config::mime_types, 0, 0, true, "ext=type pairs overriding the built-in types, comma separated (-t adds one)"},
+    {"threads", &server_config::threads, NULL, 1, 1024, false, "worker threads parsing requests"},
+    {"max_requests", &server_config::max_requests, NULL, 1, 10000000, false, "requests in flight in the worker pool"},
+    {"file_io_threads", &server_config::file_io_threads, NULL, 1, 1024, false, "threads doing blocking file I/O"},
+    {"max_fd", &server_config::max_fd, NULL, 64, 16 * 1024 * 1024, false, "highest connection fd, preallocated connections"},
+    {"max_events", &server_config::max_events, NULL, 1, 1000000, false, "events returned by one epoll_wait"},
+    {"timeslot", &server_config::timeslot, NULL, 1, 3600, true, "housekeeping tick in seconds, connection timeouts fire at their own deadlines"},
+    {"keepalive_timeout", &server_config::keepalive_timeout, NULL, 1, 3600, true, "seconds a kept-alive connection waits for its next request"},
+    {"keepalive_requests", &server_config::keepalive_requests, NULL, 0, 100000000, true, "requests served on one connection before it is closed, 0 for no limit"},
+    {"header_timeout", &server_config::header_timeout, NULL, 1, 3600, true, "seconds to receive a request line and headers, not extended by reads"},
+    {"body_timeout", &server_config::body_timeout, NULL, 1, 3600, true, "seconds allowed between two reads of a request body"},
+    {"send_timeout", &server_config::send_timeout, NULL, 1, 3600, true, "seconds allowed between two writes of a response"},
+    {"send_min_rate", &server_config::send_min_rate, NULL, 0, 1000000000, true, "lowest average bytes per second a response is sent at after send_timeout, 0 for no limit"},
+    {"client_max_connections", &server_config::client_max_connections, NULL, 0, 1000000, true, "open connections per client ip, 0 for no limit"},
+    {"client_request_rate", &server_config::client_request_rate, NULL, 0, 1000000, true, "requests per second per client ip, 0 for no limit"},
+    {"client_request_burst", &server_config::client_request_burst, NULL, 1, 1000000, true, "requests a client ip may send at once above its rate"},
+    {"backlog", &server_config::backlog, NULL, 1, 1000000, true, "listen queue length"},
+    {"defer_accept", &server_config::defer_accept, NULL, 0, 3600, true, "TCP_DEFER_ACCEPT seconds, 0 disables"},
+    {"max_accept_per_loop", &server_config::max_accept_per_loop, NULL, 1, 100000, true, "connections accepted per event loop"},
+    {"fd_reserve", &server_config::fd_reserve, NULL, 0, 1000000, true, "fds kept free for files and logs"},
+    {"read_buffer_size", &server_config::read_buffer_size, NULL, 1024, 1024 * 1024, false, "per-connection read buffer, limits request headers"},
+    {"write_buffer_size", &server_config::write_buffer_size, NULL, 512, 1024 * 1024, false, "per-connection write buffer, limits response headers"},
+    {"listenfd_mode", &server_config::listenfd_mode, NULL, 0, 1, false, "listen socket trigger mode, 0:LT 1:ET"},
+    {"connfd_mode", &server_config::connfd_mode, NULL, 0, 1, false, "connection socket trigger mode, 0:LT 1:ET"},
+    {"drain_timeout", &server_config::drain_timeout, NULL, 0, 3600, true, "seconds to finish open connections on stop or upgrade"},
+    {"inline_requests", &server_config::inline_requests, NULL, 0, 1, true, "epoll engine answers cached requests on the event loop, 0 hands all to the thread pool"},
+    {"test_routes", &server_config::test_routes, NULL, 0, 1, false, "register routes for testing (/stream/:size, /upload), never on a public server"},
+    {"workers", &server_config::workers, NULL, 0, 1024, false, "worker processes under a master, 0 runs a single process"},
+    {"pin_workers", &server_config::pin_workers, NULL, 0, 1, false, "pin each worker process to its own cpu"},
+    {"pin_threads", &server_config::pin_threads, NULL, 0, 1, false, "pin the event loop and each pool thread to a cpu of its numa node"},
+    {"numa_node", &server_config::numa_node, NULL, -1, 1023, false, "numa node for threads and connection memory, -1 picks automatically"},
+    {"tls_cert", NULL, &server_config::tls_cert, 0, 0, false, "PEM certificate chain, serves HTTPS when set"},
+    {"tls_key", NULL, &server_config::tls_key, 0, 0, false, "PEM private key, read from tls_cert when empty"},
+    {"tls_session_cache", &server_config::tls_session_cache, NULL, 0, 10000000, false, "TLS sessions cached for resumption, 0 disables"},
+    {"tls_session_tickets", &server_config::tls_session_tickets, NULL, 0, 1, false, "issue TLS session tickets"},
+    {"ktls", &server_config::ktls, NULL, 0, 1, false, "hand record encryption to the kernel after the handshake when available"},
+    {"http2", &server_config::http2, NULL, 0, 1, false, "serve HTTP/2: h2 over TLS via ALPN, h2c by prior knowledge or Upgrade"},
+    {"h2_max_streams", &server_config::h2_max_streams, NULL, 1, 10000, false, "concurrent requests per HTTP/2 connection"},
+};
+
+static const int OPTION_COUNT = sizeof(options) / sizeof(options[0]);
+
+server_config::server_config()
+    : ip("0.0.0.0"), port(0), engine("epoll"), doc_root("../doc_root"), charset("utf-8"), threads(8), max_requests(10000),
+      file_io_threads(4), max_fd(65536), max_events(10000), timeslot(5), keepalive_timeout(15),
+      keepalive_requests(1000), header_timeout(10), body_timeout(15), send_timeout(15), send_min_rate(1024),
+      client_max_connections(0), client_request_rate(0), client_request_burst(100), backlog(1024), defer_accept(0),
+      max_accept_per_loop(64), fd_reserve(64), read_buffer_size(2048), write_buffer_size(1024),
+      listenfd_mode(0), connfd_mode(1), drain_timeout(10), inline_requests(1), test_routes(0), workers(0), pin_workers(1), pin_threads(0), numa_node(-1),
+      tls_session_cache(20480), tls_session_tickets(1), ktls(1), http2(1), h2_max_streams(100)
+{
+}
+
+// 去掉首尾空白
+static char *trim(char *s)
+{
+    while (isspace((unsigned char)*s))
+    {
+        ++s;
+    }
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+    {
+        --end;
+    }
+    *end = '\0';
+    return s;
+}
+
+bool server_config::load_file(const char *path)
+{
+    FILE *in = fopen(path, "r");
+    if (!in)
+    {
+        printf("cannot open config file %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char line[1024];
+    int lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), in))
+    {
+        ++lineno;
+        char *hash = strchr(line, '#');
+        if (hash)
+        {
+            *hash = '\0';
+        }
+        char *key = trim(line);
+        if (*key == '\0')
+        {
+            continue;
+        }
+        char *eq = strchr(key, '=');
+        if (!eq)
+        {
+            printf("%s:%d: expected key = value\n", path, lineno);
+            ok = false;
+            break;
+        }
+        *eq = '\0';
+        if (!set(trim(key), trim(eq + 1)))
+        {
+            printf("%s:%d: invalid setting\n", path, lineno);
+            ok = false;
+        }
+    }
+    fclose(in);
+    return ok;
+}
+
+bool server_config::set(const char *key, const char *value)
+{
+    for (int i = 0; i < OPTION_COUNT; ++i)
+    {
+        const config_option &o = options[i];
+        if (strcmp(o.name, key) != 0)
+        {
+            continue;
+        }
+        if (o.str_value)
+        {
+            this->*o.str_value = value;
+            return true;
+        }
+        char *end = NULL;
+        errno = 0;
+        long v = strtol(value, &end, 10);
+        if (errno || end == value || *end != '\0' || v < o.min || v > o.max)
+        {
+            printf("%s must be an integer in [%ld, %ld], got '%s'\n", key, o.min, o.max, value);
+            return false;
+        }
+        this->*o.int_value = v;
+        return true;
+    }
+    printf("unknown setting %s\n", key);
+    return false;
+}
+
+bool server_config::validate() const
+{
+    if (port == 0)
+    {
+        printf("listen port is required\n");
+        return false;
+    }
+    if (engine != "epoll" && engine != "uring" && engine != "coro")
+    {
+        printf("unknown engine %s\n", engine.c_str());
+        return false;
+    }
+    if (doc_root.empty())
+    {
+        printf("doc_root must not be empty\n");
+        return false;
+    }
+    if (!tls_cert.empty() && engine != "epoll")
+    {
+        printf("tls_cert requires the epoll engine\n");
+        return false;
+    }
+    if (!mime::valid_overrides(mime_types))
+    {
+        printf("invalid mime_types %s\n", mime_types.c_str());
+        return false;
+    }
+    if (fd_reserve >= max_fd / 2)
+    {
+        printf("fd_reserve %d must be less than half of max_fd %d\n", fd_reserve, max_fd);
+        return false;
+    }
+    return true;
+}
+
+std::string server_config::restart_changes(const server_config &next) const
+{
+    std::string names;
+    for (int i = 0; i < OPTION_COUNT; ++i)
+    {
+        const config_option &o = options[i];
+        bool changed = o.str_value ? this->*o.str_value != next.*o.str_value : this->*o.int_value != next.*o.int_value;
+        if (changed && !o.reloadable)
+        {
+            names += names.empty() ? "" : " ";
+            names += o.name;
+        }
+    }
+    return names;
+}
+
+void server_config::apply_reloadable(const server_config &next)
+{
+    for (int i = 0; i < OPTION_COUNT; ++i)
+    {
+        const config_option &o = options[i];
+        if (!o.reloadable)
+        {
+            continue;
+        }
+        if (o.str_value)
+        {
+            this->*o.str_value = next.*o.str_value;
+        }
+        else
+        {
+            this->*o.int_value = next.*o.int_value;
+        }
+    }
+}
+
+int server_config::option_count()
+{
+    return OPTION_COUNT;
+}
+
+const char *server_config::option_name(int i)
+{
+    return options[i].name;
+}
+
+void server_config::print_options(FILE *out)
+{
+    server_config defaults;
+    for (int i = 0; i < OPTION_COUNT; ++i)
+    {
+        const config_option &o = options[i];
+        std::string def = o.str_value ? defaults.*o.str_value : std::to_string(defaults.*o.int_value);
+        fprintf(out, "  --%s=VALUE  %s (default: %s%s)\n", o.name, o.help, def.empty() ? "none" : def.c_str(),
+                o.reloadable ? ", reloadable" : "");
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdio.h>
+#include <string>
+
+// 服务器的运行时配置 每个可调参数都有默认值，可由配置文件和命令行选项覆盖(命令行优先)
+// 配置文件每行一个"键 = 值"，'#'之后为注释；命令行上每个键都对应一个"--键=值"长选项
+// 所有参数在启动时一次性校验，之后只读
+class server_config
+{
+public:
+    server_config();
+
+    // 读入配置文件 出错时打印文件名、行号和原因并返回false
+    bool load_file(const char *path);
+    // 设置一个参数 键未知或值不合法时打印原因并返回false
+    bool set(const char *key, const char *value);
+    // 检查参数之间的约束 启动前调用
+    bool validate() const;
+
+    // 重新加载(SIGHUP)：与next相比有变化、但只能在启动时确定的参数名 以空格分隔
+    std::string restart_changes(const server_config &next) const;
+    // 重新加载：从next复制可以在运行中修改的参数
+    void apply_reloadable(const server_config &next);
+
+    // 参数个数及第i个参数的键和说明 用于生成长选项和用法
+    static int option_count();
+    static const char *option_name(int i);
+    static void print_options(FILE *out);
+
+public:
+    std::string ip;          // 监听地址
+    int port;                // 监听端口
+    std::string engine;      // 事件后端 epoll/uring/coro
+    std::string doc_root;    // 网站根目录
+    std::string charset;     // 文本类型的默认字符集 为空时不附加
+    std::string mime_types;  // 覆盖内置MIME表的"扩展名=类型"列表 逗号分隔
+    int threads;             // 工作线程数
+    int max_requests;        // 工作线程池允许同时在途的最大请求数
+    int file_io_threads;     // 阻塞I/O线程池的线程数
+    int max_fd;              // 可接受的最大连接fd 预分配的连接对象数
+    int max_events;          // 每次epoll_wait最多返回的事件数
+    int timeslot;            // 周期性tick的间隔(秒) 发布统计、fd耗尽后重试accept；各阶段的超时按截止时间准时触发
+    int keepalive_timeout;   // 保持连接等待下一个请求的空闲超时(秒)
+    int keepalive_requests;  // 每个连接最多处理的请求数 0表示不限
+    int header_timeout;      // 收完请求行和头部的最长时间(秒) 从请求开始算，不因读到数据而延长
+    int body_timeout;        // 接收消息体时两次读之间的最长间隔(秒)
+    int send_timeout;        // 发送响应时两次写之间的最长间隔(秒)
+    int send_min_rate;       // 发送响应的最低平均速率(字节/秒) 0表示不限
+    int client_max_connections; // 每个客户端IP同时打开的最大连接数 0表示不限
+    int client_request_rate;    // 每个客户端IP每秒的请求数(令牌桶补充速率) 0表示不限
+    int client_request_burst;   // 每个客户端IP允许的突发请求数(令牌桶容量)
+    int backlog;             // 监听队列长度
+    int defer_accept;        // TCP_DEFER_ACCEPT超时(秒) 0表示不启用
+    int max_accept_per_loop; // 每轮事件循环最多accept的连接数
+    int fd_reserve;          // 给日志、目标文件等预留的fd数量
+    int read_buffer_size;    // 每个连接的读缓冲区大小 决定请求行和头部的最大长度
+    int write_buffer_size;   // 每个连接的写缓冲区大小 决定响应头部的最大长度
+    int listenfd_mode;       // 监听socket的触发模式 0:LT 1:ET
+    int connfd_mode;         // 连接socket的触发模式 0:LT 1:ET
+    int drain_timeout;       // 停止或升级时等待已有连接处理完的最长时间(秒)
+    int inline_requests;     // epoll后端在事件循环中直接完成命中缓存的请求 0:全部交给工作线程
+    int test_routes;         // 是否注册测试用的动态路由(/stream/:size、/upload) 生产环境不要打开
+    int workers;             // 工作进程数 0表示单进程
+    int pin_workers;         // 多进程模式下是否把工作进程依次绑定到各个CPU上
+    int pin_threads;         // 是否把事件循环和工作线程逐个绑定到所在NUMA节点的CPU上
+    int numa_node;           // 事件循环、线程池和连接表所在的NUMA节点 -1表示自动
+    std::string tls_cert;    // 证书链(PEM) 为空时只提供明文HTTP
+    std::string tls_key;     // 私钥(PEM) 为空时从tls_cert中读取
+    int tls_session_cache;   // 服务端会话缓存的条目数 0表示不缓存
+    int tls_session_tickets; // 是否发放会话票据 多进程模式下各工作进程共用票据密钥
+    int ktls;                // 握手后是否尝试把加解密交给内核(kTLS) 之后响应直接writev到socket
+    int http2;               // 是否提供HTTP/2 仅epoll后端
+    int h2_max_streams;      // 每个HTTP/2连接同时进行的最大请求数
+};
+
+#endif
@@ -0,0 +1,593 @@
+#include <coroutine>
+#include <exception>
+#include <vector>
+#include <climits>
+#include <sys/eventfd.h>
+#include "coro_server.h"
+#include "lst_timer.h"
+
+extern void show_error(int connfd, const char *info);
+
+// 距when(monotonic_ms()的毫秒数)还有多少毫秒 已经过去时为0
+static int ms_until(long long when)
+{
+    long long ms = when - monotonic_ms();
+    if (ms <= 0)
+    {
+        return 0;
+    }
+    return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+class coro_server;
+
+// 连接协程的返回类型：创建后立即运行，不需要等待其结果，结束时自动销毁协程帧
+struct conn_task
+{
+    struct promise_type
+    {
+        conn_task get_return_object() { return conn_task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// 投递到阻塞I/O线程池的任务：在I/O线程中访问目标文件，完成后通知事件循环恢复协程
+struct coro_file_job
+{
+    coro_server *server;
+    http_conn *conn;
+    std::coroutine_handle<> handle;
+    http_conn::HTTP_CODE ret;
+
+    void process();
+    void shed();
+};
+
+class coro_server
+{
+public:
+    static const int MAX_EVENT_NUMBER = 1024;
+
+    // 每个连接在协程引擎中的状态，以fd为下标
+    struct slot
+    {
+        std::coroutine_handle<> reader; // 等待可读的协程
+        std::coroutine_handle<> writer; // 等待可写的协程
+        bool readable;                  // ET模式下到达时没有协程在等待的可读事件
+        bool writable;
+        bool expired;                   // 定时器已超时
+        coro_file_job job;
+    };
+
+    // 等待fd可读/可写 返回false表示连接已超时
+    struct io_awaiter
+    {
+        coro_server *server;
+        int fd;
+        bool write;
+
+        bool await_ready()
+        {
+            slot &s = server->m_slots[fd];
+            bool &ready = write ? s.writable : s.readable;
+            if (s.expired || ready)
+            {
+                ready = false;
+                return true;
+            }
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            slot &s = server->m_slots[fd];
+            (write ? s.writer : s.reader) = h;
+        }
+        bool await_resume() { return !server->m_slots[fd].expired; }
+    };
+
+    // 把目标文件的访问交给阻塞I/O线程池
+    struct file_awaiter
+    {
+        coro_server *server;
+        int fd;
+
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> h) { return server->offload(fd, h); }
+        http_conn::HTTP_CODE await_resume() { return server->m_slots[fd].job.ret; }
+    };
+
+public:
+    coro_server(int listenfd, int sigfd, http_conn *users, int max_fd, int file_threads, server_control &ctl);
+    ~coro_server();
+    int run();
+    void post(coro_file_job *job);
+
+private:
+    conn_task serve(int fd);
+    bool send_ready(int fd);
+    bool offload(int fd, std::coroutine_handle<> h);
+    void deal_with_accept();
+    void add_client(int connfd, const sockaddr_in &client_address, bool counted);
+    void close_conn(int fd);
+    void adjust_timer(int fd);
+    void wake(std::coroutine_handle<> &waiter, bool &ready);
+    void resume_completed();
+    void pause_accept(bool emfile);
+    void resume_accept();
+
+    static void cb_func(client_data *user_data);
+
+private:
+    int m_epollfd;
+    int m_listenfd;
+    int m_sigfd;
+    int m_eventfd;               // 阻塞I/O线程完成任务后通知事件循环
+    http_conn *m_users;
+    int m_max_fd;
+    server_control &m_ctl;
+    slot *m_slots;
+    client_data *m_users_timer;
+    sort_timer_lst m_timer_lst;
+    threadpool<coro_file_job> *m_file_pool;
+
+    locker m_done_locker;                // 保护m_done
+    std::vector<coro_file_job *> m_done; // 已完成、等待恢复协程的任务
+
+    bool m_accept_paused;
+    bool m_accept_emfile;
+
+    static coro_server *s_server; // 定时器回调通过它找到协程引擎
+};
+
+coro_server *coro_server::s_server = NULL;
+
+void coro_file_job::process()
+{
+    ret = conn->do_request();
+    server->post(this);
+}
+
+void coro_file_job::shed()
+{
+    ret = http_conn::SERVICE_UNAVAILABLE;
+    server->post(this);
+}
+
+coro_server::coro_server(int listenfd, int sigfd, http_conn *users, int max_fd, int file_threads, server_control &ctl)
+    : m_listenfd(listenfd), m_sigfd(sigfd), m_users(users), m_max_fd(max_fd), m_ctl(ctl),
+      m_accept_paused(false), m_accept_emfile(false)
+{
+    m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_epollfd < 0 || m_eventfd < 0)
+    {
+        throw std::exception();
+    }
+    m_file_pool = new threadpool<coro_file_job>(file_threads);
+    m_slots = new slot[max_fd];
+    m_users_timer = new client_data[max_fd];
+    // 协程等到可读后再读 读必须一直读到EAGAIN，否则ET模式下会丢失后续通知
+    http_conn::m_et = true;
+    s_server = this;
+}
+
+coro_server::~coro_server()
+{
+    delete m_file_pool;
+    delete[] m_slots;
+    delete[] m_users_timer;
+    close(m_eventfd);
+    close(m_epollfd);
+    s_server = NULL;
+}
+
+// 一个连接的完整生命周期
+conn_task coro_server::serve(int fd)
+{
+    http_conn &conn = m_users[fd];
+    bool pipelined = false; // 读缓冲区中已有下一个请求的数据 先解析它们再等待可读
+    for (;;)
+    {
+        // 读取并解析 直到得到完整的请求
+        http_conn::HTTP_CODE ret = pipelined ? conn.process_read() : http_conn::NO_REQUEST;
+        while (ret == http_conn::NO_REQUEST)
+        {
+            if (!co_await io_awaiter{this, fd, false} || !conn.read())
+            {
+                close_conn(fd);
+                co_return;
+            }
+            adjust_timer(fd);
+            // 读缓冲区满时read没有读到EAGAIN，内核中可能还有数据，ET模式下不会再有新的可读通知
+            if (conn.m_read_idx >= http_conn::m_read_buffer_size)
+            {
+                m_slots[fd].readable = true;
+            }
+            ret = conn.process_read();
+        }
+
+        // 请求完整 在阻塞I/O线程池中访问目标文件
+        if (ret == http_conn::GET_REQUEST)
+        {
+            ret = conn.lookup_cache(); // 已知不存在的路径和HEAD请求的元数据缓存命中时不需要阻塞I/O线程
+        }
+        if (ret == http_conn::NO_REQUEST)
+        {
+            ret = co_await file_awaiter{this, fd};
+            if (m_slots[fd].expired)
+            {
+                conn.unmap();
+                close_conn(fd);
+                co_return;
+            }
+        }
+        if (ret == http_conn::SERVICE_UNAVAILABLE)
+        {
+            conn.m_linger = false;
+        }
+        if (!conn.process_write(ret))
+        {
+            close_conn(fd);
+            co_return;
+        }
+
+        // 写响应 内核写缓冲区满时等待可写
+        bool ok = true;
+        while (ok && !send_ready(fd))
+        {
+            if (errno != EAGAIN)
+            {
+                ok = false;
+                break;
+            }
+            ok = co_await io_awaiter{this, fd, true};
+        }
+        conn.unmap();
+        if (!ok || !conn.keep_alive())
+        {
+            close_conn(fd);
+            co_return;
+        }
+        pipelined = conn.next_request(); // 保持连接 等待下一个请求
+        adjust_timer(fd);
+    }
+}
+
+// 尽量把m_iv中的响应写完 返回true表示已全部写完 false时errno为EAGAIN表示需要等待可写
+bool coro_server::send_ready(int fd)
+{
+    http_conn &conn = m_users[fd];
+    for (;;)
+    {
+        // 流式响应的上一块已写完 让生产者生成下一块 等待可写期间生产者不会被调用
+        if (conn.stream_pending() && conn.m_iv[1].iov_len == 0 && !conn.next_chunk())
+        {
+            errno = EIO;
+            return false;
+        }
+        if (conn.iov_pending() == 0)
+        {
+            return true;
+        }
+        int temp = writev(fd, conn.m_iv, conn.m_iv_count);
+        if (temp < 0)
+        {
+            return false;
+        }
+        conn.iov_advance(temp); // 跳过已写出的部分
+        adjust_timer(fd);
+    }
+}
+
+// 返回false表示不挂起(线程池已满 直接回503)
+bool coro_server::offload(int fd, std::coroutine_handle<> h)
+{
+    coro_file_job &job = m_slots[fd].job;
+    job.server = this;
+    job.conn = &m_users[fd];
+    job.handle = h;
+    if (!m_file_pool->append(&job))
+    {
+        job.ret = http_conn::SERVICE_UNAVAILABLE;
+        return false;
+    }
+    return true;
+}
+
+// 由阻塞I/O线程调用
+void coro_server::post(coro_file_job *job)
+{
+    m_done_locker.lock();
+    m_done.push_back(job);
+    m_done_locker.unlock();
+    eventfd_write(m_eventfd, 1);
+}
+
+// 在事件循环线程上恢复文件访问已完成的协程
+void coro_server::resume_completed()
+{
+    eventfd_t value;
+    eventfd_read(m_eventfd, &value);
+    std::vector<coro_file_job *> done;
+    m_done_locker.lock();
+    done.swap(m_done);
+    m_done_locker.unlock();
+    for (size_t i = 0; i < done.size(); ++i)
+    {
+        done[i]->handle.resume();
+    }
+}
+
+void coro_server::wake(std::coroutine_handle<> &waiter, bool &ready)
+{
+    if (waiter)
+    {
+        std::coroutine_handle<> h = waiter;
+        waiter = nullptr;
+        h.resume();
+    }
+    else
+    {
+        ready = true; // 记下来 协程下次等待时直接返回
+    }
+}
+
+void coro_server::deal_with_accept()
+{
+    for (int n = 0; n < m_ctl.max_accept_per_loop; ++n)
+    {
+        if (http_conn::m_user_count >= m_ctl.high_watermark)
+        {
+            pause_accept(false);
+            return;
+        }
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof(client_address);
+        int connfd = accept4(m_listenfd, (struct sockaddr *)&client_address, &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE)
+            {
+                pause_accept(true);
+            }
+            return;
+        }
+        if (connfd >= m_max_fd)
+        {
+            show_error(connfd, "Internal server busy");
+            continue;
+        }
+        bool counted;
+        if (!http_conn::m_client_limits.connect(client_address.sin_addr.s_addr, counted)) // 该IP的连接数已达上限
+        {
+            close(connfd);
+            continue;
+        }
+        add_client(connfd, client_address, counted);
+    }
+}
+
+void coro_server::add_client(int connfd, const sockaddr_in &client_address, bool counted)
+{
+    m_users[connfd].init(connfd, client_address, 1);
+    slot &s = m_slots[connfd];
+    s.reader = nullptr;
+    s.writer = nullptr;
+    s.readable = false;
+    s.writable = false;
+    s.expired = false;
+
+    m_users_timer[connfd].address = client_address;
+    m_users_timer[connfd].counted = counted;
+    m_users_timer[connfd].sockfd = connfd;
+    util_timer *timer = new util_timer;
+    timer->user_data = &m_users_timer[connfd];
+    timer->cb_func = cb_func;
+    timer->expire = m_users[connfd].deadline(monotonic_ms());
+    m_users_timer[connfd].timer = timer;
+    m_timer_lst.add_timer(timer);
+
+    // 读写事件一次性以ET方式注册 之后协程等待时不需要再epoll_ctl
+    epoll_event event;
+    event.data.fd = connfd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, connfd, &event);
+
+    serve(connfd);
+}
+
+void coro_server::close_conn(int fd)
+{
+    printf("close fd %d\n", fd);
+    epoll_ctl(m_epollfd, EPOLL_CTL_DEL, fd, 0);
+    close(fd);
+    m_users[fd].m_sockfd = -1;
+    http_conn::m_user_count--;
+    if (m_users_timer[fd].counted)
+    {
+        http_conn::m_client_limits.disconnect(m_users_timer[fd].address.sin_addr.s_addr);
+        m_users_timer[fd].counted = false;
+    }
+    slot &s = m_slots[fd];
+    s.reader = nullptr;
+    s.writer = nullptr;
+    util_timer *timer = m_users_timer[fd].timer;
+    if (timer)
+    {
+        m_timer_lst.del_timer(timer);
+        m_users_timer[fd].timer = NULL;
+    }
+    if (m_accept_paused && !m_accept_emfile && http_conn::m_user_count < m_ctl.low_watermark)
+    {
+        resume_accept();
+    }
+}
+
+void coro_server::adjust_timer(int fd)
+{
+    util_timer *timer = m_users_timer[fd].timer;
+    if (timer)
+    {
+        timer->expire = m_users[fd].deadline(monotonic_ms()); // 按连接所处的阶段
+        m_timer_lst.adjust_timer(timer);
+    }
+}
+
+void coro_server::pause_accept(bool emfile)
+{
+    if (!m_accept_paused)
+    {
+        printf("pause accept, user count:%d\n", http_conn::m_user_count);
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, 0);
+        m_accept_paused = true;
+    }
+    m_accept_emfile = m_accept_emfile || emfile;
+}
+
+void coro_server::resume_accept()
+{
+    if (m_accept_paused && !m_ctl.draining) // 排空时不再恢复
+    {
+        printf("resume accept, user count:%d\n", http_conn::m_user_count);
+        epoll_event event;
+        event.data.fd = m_listenfd;
+        event.events = EPOLLIN;
+        epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_listenfd, &event);
+        m_accept_paused = false;
+        m_accept_emfile = false;
+    }
+}
+
+// 定时器回调：标记超时并唤醒正在等待I/O的协程，由协程自己关闭连接
+// 正在等待文件访问的协程在访问完成后检查该标记
+void coro_server::cb_func(client_data *user_data)
+{
+    int fd = user_data->sockfd;
+    user_data->timer = NULL; // tick随后会释放该定时器
+    slot &s = s_server->m_slots[fd];
+    s.expired = true;
+    bool unused = false;
+    s_server->wake(s.reader, unused);
+    s_server->wake(s.writer, unused);
+}
+
+int coro_server::run()
+{
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = m_listenfd;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_listenfd, &event);
+    event.data.fd = m_sigfd;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_sigfd, &event);
+    event.data.fd = m_eventfd;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_eventfd, &event);
+
+    epoll_event events[MAX_EVENT_NUMBER];
+    long long next_tick = monotonic_ms() + m_ctl.timeslot * 1000LL;
+    unsigned pending_signals = 0; // 等待本批事件处理完后交给m_ctl.on_signal的信号
+    bool drain_started = false;   // 已停止accept并关闭了空闲连接
+    while (true)
+    {
+        // 直接用epoll_wait的超时驱动定时器 在最早的连接截止时间、下一个tick或排空的截止时间醒来
+        int timeout = ms_until(next_wakeup(m_ctl, next_tick, m_timer_lst.next_expire()));
+        int number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, timeout);
+        if (number < 0 && errno != EINTR)
+        {
+            printf("epoll failure\n");
+            return -1;
+        }
+
+        for (int i = 0; i < number; ++i)
+        {
+            int sockfd = events[i].data.fd;
+            unsigned ev = events[i].events;
+            if (sockfd == m_listenfd)
+            {
+                deal_with_accept();
+            }
+            else if (sockfd == m_sigfd)
+            {
+                read_signals(m_sigfd, pending_signals);
+            }
+            else if (sockfd == m_eventfd)
+            {
+                resume_completed();
+            }
+            else
+            {
+                slot &s = m_slots[sockfd];
+                if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                {
+                    wake(s.reader, s.readable);
+                }
+                if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                {
+                    wake(s.writer, s.writable);
+                }
+            }
+        }
+
+        // 本批事件都已处理 应用信号带来的参数变化
+        if (pending_signals)
+        {
+            dispatch_signals(pending_signals, m_ctl);
+        }
+        if (m_ctl.draining && !drain_started) // 开始排空：停止accept 唤醒正在等待下一个请求的协程让它们关闭连接
+        {
+            drain_started = true;
+            pause_accept(false);
+            m_timer_lst.expire_if([this](client_data *user_data) { return m_users[user_data->sockfd].idle(); });
+        }
+        if (drain_finished(m_ctl, http_conn::m_user_count))
+        {
+            if (http_conn::m_user_count > 0)
+            {
+                printf("drain deadline reached, closing %d connections\n", http_conn::m_user_count);
+            }
+            break;
+        }
+
+        long long now = monotonic_ms();
+        if (m_timer_lst.next_expire() > 0 && now >= m_timer_lst.next_expire())
+        {
+            m_timer_lst.tick();
+        }
+        if (now >= next_tick)
+        {
+            printf("连接数量:%d\n", m_timer_lst.get_list_size());
+            if (m_ctl.on_tick)
+            {
+                m_ctl.on_tick(m_ctl);
+            }
+            next_tick = monotonic_ms() + m_ctl.timeslot * 1000LL;
+            if (m_accept_paused && m_accept_emfile)
+            {
+                resume_accept();
+            }
+        }
+    }
+    return 0;
+}
+
+int coro_server_run(int listenfd, int sigfd, http_conn *users, int max_fd, int file_threads, server_control &ctl)
+{
+    coro_server *server = NULL;
+    try
+    {
+        server = new coro_server(listenfd, sigfd, users, max_fd, file_threads, ctl);
+    }
+    catch (...)
+    {
+        return 1;
+    }
+    int ret = server->run();
+    delete server;
+    return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,17 @@
+#ifndef CORO_SERVER_H
+#define CORO_SERVER_H
+
+#include "http_conn.h"
+#include "server_control.h"
+
+// C++20协程请求引擎(-e coro)
+// 每个连接是一个协程：读请求、解析、访问目标文件、写响应按顺序写在一个函数里，需要等待时co_await事件循环
+// 复用http_conn的解析器和应答构造；连接fd以ET方式一次性注册读写事件，之后不再有EPOLLONESHOT的modfd往返
+// 本头文件不依赖C++20，只有coro_server.cpp需要以C++20编译
+
+// listenfd:监听socket sigfd:读取SIGTERM等信号的signalfd users/max_fd:预分配的http_conn数组
+// file_threads:阻塞I/O线程数 ctl:定时器间隔、accept水位等运行参数
+// 运行事件循环直到收到SIGTERM或排空结束 返回0表示正常退出
+int coro_server_run(int listenfd, int sigfd, http_conn *users, int max_fd, int file_threads, server_control &ctl);
+
+#endif
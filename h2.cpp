@@ -0,0 +1,1444 @@
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "h2.h"
+
+extern void modfd(int epollfd, int fd, int ev);
+
+// 连接前言 客户端在任何帧之前发送
+static const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const size_t PREFACE_LEN = sizeof(PREFACE) - 1;
+
+static const size_t FRAME_HEADER = 9;
+static const size_t MAX_FRAME_SIZE = 16384;      // 收发的最大帧 即SETTINGS_MAX_FRAME_SIZE的默认值，不另行协商
+static const long long DEFAULT_WINDOW = 65535;   // 连接和流的初始窗口
+static const long long MAX_WINDOW = 0x7fffffff;
+static const size_t WINDOW_UPDATE_THRESHOLD = 16384; // 攒够这么多再归还窗口 减少WINDOW_UPDATE帧
+static const size_t MAX_HEADER_BLOCK = 64 * 1024;    // 跨CONTINUATION帧的头部块的上限
+static const size_t OUTPUT_HIGH_WATER = 64 * 1024;   // 发送队列超过它时暂停生成DATA帧
+static const size_t TLS_RECORD_SIZE = 16384;         // TLS记录的最大明文长度
+static const int IOV_BATCH = 64;                     // 每次writev最多的段数
+static const int BODY_ROOM = 64;                     // 有消息体的请求在读缓冲区中至少为消息体留出的空间
+static const int CHUNK_OVERHEAD = 12;                // 拷入的消息体块的块头和块尾
+
+enum frame_type
+{
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9,
+    FRAME_PRIORITY_UPDATE = 0x10 // RFC 9218
+};
+
+enum frame_flag
+{
+    FLAG_END_STREAM = 0x1,
+    FLAG_ACK = 0x1,
+    FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8,
+    FLAG_PRIORITY = 0x20
+};
+
+enum setting_id
+{
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5,
+    SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+    SETTINGS_NO_RFC7540_PRIORITIES = 0x9
+};
+
+enum error_code
+{
+    NO_ERROR = 0x0,
+    PROTOCOL_ERROR = 0x1,
+    INTERNAL_ERROR = 0x2,
+    FLOW_CONTROL_ERROR = 0x3,
+    STREAM_CLOSED = 0x5,
+    FRAME_SIZE_ERROR = 0x6,
+    REFUSED_STREAM = 0x7,
+    COMPRESSION_ERROR = 0x9,
+    ENHANCE_YOUR_CALM = 0xb
+};
+
+bool (*h2_session::m_dispatch)(http_conn *conn, completion_queue::action &act) = NULL;
+int h2_session::m_max_streams = 100;
+long long h2_session::m_session_count = 0;
+long long h2_session::m_stream_count = 0;
+
+static unsigned int get32(const unsigned char *p)
+{
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put32(char *p, unsigned int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// 在HTTP/1.1的请求头部(不含请求行)中查找字段 名字不区分大小写
+static bool find_header(const char *head, const char *end, const char *name, std::string &value)
+{
+    size_t name_len = strlen(name);
+    const char *line = (const char *)memmem(head, end - head, "\r\n", 2);
+    while (line && line < end)
+    {
+        line += 2;
+        const char *eol = (const char *)memmem(line, end + 2 - line, "\r\n", 2);
+        if (!eol)
+        {
+            break;
+        }
+        if ((size_t)(eol - line) > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0)
+        {
+            const char *v = line + name_len + 1;
+            while (v < eol && (*v == ' ' || *v == '\t'))
+            {
+                ++v;
+            }
+            value.assign(v, eol - v);
+            return true;
+        }
+        line = eol;
+    }
+    return false;
+}
+
+// HTTP2-Settings头部的值 base64url编码的SETTINGS帧载荷
+static bool base64url_decode(const std::string &in, std::string &out)
+{
+    unsigned int bits = 0;
+    int count = 0;
+    for (size_t i = 0; i < in.size(); ++i)
+    {
+        char c = in[i];
+        int v;
+        if (c >= 'A' && c <= 'Z')
+            v = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            v = c - '0' + 52;
+        else if (c == '-' || c == '+')
+            v = 62;
+        else if (c == '_' || c == '/')
+            v = 63;
+        else if (c == '=')
+            break;
+        else
+            return false;
+        bits = (bits << 6) | v;
+        count += 6;
+        if (count >= 8)
+        {
+            count -= 8;
+            out += (char)((bits >> count) & 0xff);
+        }
+    }
+    return out.size() % 6 == 0;
+}
+
+// 优先级头部(RFC 9218) 如"u=1, i" 不认识的参数被忽略
+static void parse_priority(const std::string &value, int &urgency, bool &incremental)
+{
+    size_t pos = 0;
+    while (pos < value.size())
+    {
+        size_t end = value.find(',', pos);
+        if (end == std::string::npos)
+        {
+            end = value.size();
+        }
+        std::string item = value.substr(pos, end - pos);
+        item.erase(0, item.find_first_not_of(" \t"));
+        item.erase(item.find_last_not_of(" \t") + 1);
+        if (item.size() == 3 && item.compare(0, 2, "u=") == 0 && item[2] >= '0' && item[2] <= '7')
+        {
+            urgency = item[2] - '0';
+        }
+        else if (item == "i" || item == "i=?1")
+        {
+            incremental = true;
+        }
+        else if (item == "i=?0")
+        {
+            incremental = false;
+        }
+        pos = end + 1;
+    }
+}
+
+// 请求行和头部中的值会原样拼进HTTP/1.1请求 不能含有分隔符
+static bool valid_value(const std::string &value)
+{
+    return value.find_first_of(std::string("\r\n\0", 3)) == std::string::npos;
+}
+
+enum detect_result
+{
+    DETECT_HTTP1,
+    DETECT_PREFACE, // 连接前言
+    DETECT_UPGRADE, // Upgrade: h2c
+    DETECT_MORE     // 还不能判断 等待更多数据
+};
+
+// 连接上的下一个请求是否要切换到HTTP/2 只在还没开始解析请求时判断
+static detect_result detect(const char *buf, int len, bool tls, int state, int checked)
+{
+    if (state != http_conn::CHECK_STATE_REQUESTLINE || checked != 0)
+    {
+        return DETECT_HTTP1;
+    }
+    if (memcmp(buf, PREFACE, (size_t)len < PREFACE_LEN ? len : PREFACE_LEN) == 0)
+    {
+        return (size_t)len >= PREFACE_LEN ? DETECT_PREFACE : DETECT_MORE;
+    }
+    if (tls) // TLS上由ALPN协商 不支持升级
+    {
+        return DETECT_HTTP1;
+    }
+    const char *end = (const char *)memmem(buf, len, "\r\n\r\n", 4);
+    if (!end) // 头部还不完整 读缓冲区满时交给HTTP/1.1的解析器报错
+    {
+        return len < http_conn::m_read_buffer_size ? DETECT_MORE : DETECT_HTTP1;
+    }
+    std::string upgrade, settings, length, decoded;
+    if (!find_header(buf, end, "Upgrade", upgrade) || !find_header(buf, end, "HTTP2-Settings", settings))
+    {
+        return DETECT_HTTP1;
+    }
+    bool h2c = false;
+    for (size_t i = 0; i + 3 <= upgrade.size() && !h2c; ++i)
+    {
+        h2c = strncasecmp(upgrade.c_str() + i, "h2c", 3) == 0 && (i + 3 == upgrade.size() || upgrade[i + 3] == ',' || upgrade[i + 3] == ' ') &&
+              (i == 0 || upgrade[i - 1] == ',' || upgrade[i - 1] == ' ');
+    }
+    // 带消息体的请求不升级 否则要在切换之前按HTTP/1.1读完整个消息体
+    bool body = find_header(buf, end, "Transfer-Encoding", length) || (find_header(buf, end, "Content-Length", length) && length != "0");
+    if (!h2c || body || !base64url_decode(settings, decoded))
+    {
+        return DETECT_HTTP1;
+    }
+    return DETECT_UPGRADE;
+}
+
+bool h2_session::on_read(http_conn *conn, bool &keep)
+{
+    keep = true;
+    if (!conn->m_h2)
+    {
+        switch (detect(conn->m_read_buf, conn->m_read_idx, conn->m_ssl != NULL, conn->m_check_state, conn->m_checked_idx))
+        {
+        case DETECT_HTTP1:
+            return false;
+        case DETECT_MORE:
+            modfd(http_conn::m_epollfd, conn->m_sockfd, EPOLLIN);
+            return true;
+        case DETECT_PREFACE:
+            conn->m_h2 = new h2_session(conn);
+            conn->m_h2->start();
+            break;
+        case DETECT_UPGRADE:
+            conn->m_h2 = new h2_session(conn);
+            conn->m_h2->upgrade();
+            break;
+        }
+        __atomic_add_fetch(&m_session_count, 1, __ATOMIC_RELAXED);
+    }
+    keep = conn->m_h2->receive();
+    return true;
+}
+
+bool h2_session::complete(h2_stream *stream, completion_queue::action act)
+{
+    h2_session *session = stream->session;
+    if (!session) // 连接已经关闭
+    {
+        discard(stream);
+        return true;
+    }
+    session->handle(stream, act);
+    return session->finish();
+}
+
+h2_session::h2_session(http_conn *conn)
+    : m_conn(conn), m_preface(false), m_last_stream(0), m_rr_last(0), m_header_stream(0), m_header_end_stream(false),
+      m_send_window(DEFAULT_WINDOW), m_recv_window(DEFAULT_WINDOW), m_recv_unacked(0), m_peer_initial_window(DEFAULT_WINDOW),
+      m_out_off(0), m_out_bytes(0), m_stage_off(0), m_goaway_sent(false), m_peer_goaway(false), m_failed(false)
+{
+}
+
+h2_session::~h2_session()
+{
+    for (std::map<int, h2_stream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+    {
+        if (it->second->busy) // 工作线程还在使用 处理完后由complete释放
+        {
+            it->second->session = NULL;
+        }
+        else
+        {
+            discard(it->second);
+        }
+    }
+}
+
+bool h2_session::on_write()
+{
+    return finish();
+}
+
+// 本端的SETTINGS 必须是连接上发出的第一帧(升级时紧跟在101响应之后)
+void h2_session::start()
+{
+    char payload[18];
+    const unsigned int settings[][2] = {
+        {SETTINGS_MAX_CONCURRENT_STREAMS, (unsigned int)m_max_streams},
+        {SETTINGS_MAX_HEADER_LIST_SIZE, (unsigned int)http_conn::m_read_buffer_size},
+        {SETTINGS_NO_RFC7540_PRIORITIES, 1}};
+    for (int i = 0; i < 3; ++i)
+    {
+        payload[i * 6] = settings[i][0] >> 8;
+        payload[i * 6 + 1] = settings[i][0];
+        put32(payload + i * 6 + 2, settings[i][1]);
+    }
+    frame(FRAME_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+// Upgrade: h2c 回101后以HTTP/2继续，升级前的请求成为流1，它的响应以HTTP/2发送
+bool h2_session::upgrade()
+{
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    const char *buf = m_conn->m_read_buf;
+    int len = m_conn->m_read_idx;
+    const char *end = (const char *)memmem(buf, len, "\r\n\r\n", 4);
+    size_t head = end + 4 - buf;
+
+    segment seg;
+    seg.data.assign(switching, sizeof(switching) - 1);
+    seg.ext = NULL;
+    seg.len = 0;
+    seg.owner = NULL;
+    m_out.push_back(seg);
+    m_out_bytes += seg.data.size();
+    start();
+
+    // HTTP2-Settings相当于对方的第一个SETTINGS帧 不需要确认
+    std::string value, settings;
+    find_header(buf, end, "HTTP2-Settings", value);
+    base64url_decode(value, settings);
+    if (!apply_settings((const unsigned char *)settings.data(), settings.size()))
+    {
+        return false;
+    }
+
+    h2_stream *stream = open_stream(1);
+    memcpy(stream->conn.m_read_buf, buf, head);
+    stream->conn.m_read_idx = head;
+    stream->remote_closed = true;
+    m_streams[1] = stream;
+    m_last_stream = 1;
+
+    // 之后的字节是连接前言和帧
+    m_in.assign(buf + head, len - head);
+    m_conn->m_read_idx = 0;
+    dispatch(stream);
+    return true;
+}
+
+// 处理读缓冲区中的数据 读缓冲区满或OpenSSL中还有数据时继续读，把对方这次发来的帧都处理完
+bool h2_session::receive()
+{
+    while (true)
+    {
+        bool full = m_conn->m_read_idx >= http_conn::m_read_buffer_size;
+        if (!m_failed)
+        {
+            m_in.append(m_conn->m_read_buf, m_conn->m_read_idx);
+        }
+        m_conn->m_read_idx = 0;
+        if (!m_failed && !process_input())
+        {
+            break;
+        }
+        if (!full && !m_conn->read_pending())
+        {
+            break;
+        }
+        if (!m_conn->read())
+        {
+            return false;
+        }
+    }
+    return finish();
+}
+
+// 生成并写出能发送的帧 然后重新监听连接；返回false表示关闭连接
+bool h2_session::finish()
+{
+    if (m_failed) // 尽量发出GOAWAY
+    {
+        flush();
+        return false;
+    }
+    if (__atomic_load_n(&http_conn::m_draining, __ATOMIC_RELAXED) && !m_goaway_sent)
+    {
+        goaway(NO_ERROR); // 排空：不再接受新请求 已有的请求处理完后关闭
+    }
+    int ret;
+    do
+    {
+        schedule();
+        ret = flush();
+        if (ret < 0)
+        {
+            return false;
+        }
+    } while (ret > 0 && pick());
+
+    bool pending = m_out_bytes > 0 || m_stage_off < m_stage.size();
+    if ((m_goaway_sent || m_peer_goaway) && m_streams.empty() && !pending)
+    {
+        return false;
+    }
+    modfd(http_conn::m_epollfd, m_conn->m_sockfd, pending ? EPOLLIN | EPOLLOUT : EPOLLIN);
+    return true;
+}
+
+bool h2_session::connection_error(int code)
+{
+    if (!m_failed)
+    {
+        printf("http2 connection error %d\n", code);
+        goaway(code);
+        m_failed = true;
+    }
+    return false;
+}
+
+// 依次处理m_in中的完整帧 发生连接错误时返回false
+bool h2_session::process_input()
+{
+    size_t off = 0;
+    if (!m_preface)
+    {
+        size_t n = m_in.size() < PREFACE_LEN ? m_in.size() : PREFACE_LEN;
+        if (memcmp(m_in.data(), PREFACE, n) != 0)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        if (n < PREFACE_LEN)
+        {
+            return true;
+        }
+        off = PREFACE_LEN;
+        m_preface = true;
+    }
+    bool ok = true;
+    while (ok && m_in.size() - off >= FRAME_HEADER)
+    {
+        const unsigned char *p = (const unsigned char *)m_in.data() + off;
+        size_t len = (p[0] << 16) | (p[1] << 8) | p[2];
+        if (len > MAX_FRAME_SIZE)
+        {
+            ok = connection_error(FRAME_SIZE_ERROR);
+            break;
+        }
+        if (m_in.size() - off < FRAME_HEADER + len)
+        {
+            break;
+        }
+        off += FRAME_HEADER + len;
+        ok = on_frame(p[3], p[4], get32(p + 5) & 0x7fffffff, p + FRAME_HEADER, len);
+    }
+    m_in.erase(0, off);
+    return ok;
+}
+
+bool h2_session::on_frame(int type, int flags, int id, const unsigned char *payload, size_t len)
+{
+    // 头部块必须由连续的CONTINUATION帧接完
+    if (m_header_stream && (type != FRAME_CONTINUATION || id != m_header_stream))
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    switch (type)
+    {
+    case FRAME_DATA:
+        return on_data(id, flags, payload, len);
+    case FRAME_HEADERS:
+    {
+        if (id == 0 || id % 2 == 0)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        size_t pad = 0;
+        if (flags & FLAG_PADDED)
+        {
+            if (len < 1)
+            {
+                return connection_error(FRAME_SIZE_ERROR);
+            }
+            pad = *payload++;
+            --len;
+        }
+        if (flags & FLAG_PRIORITY) // RFC 7540的依赖和权重 忽略
+        {
+            if (len < 5)
+            {
+                return connection_error(FRAME_SIZE_ERROR);
+            }
+            payload += 5;
+            len -= 5;
+        }
+        if (pad > len)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        m_header_block.assign((const char *)payload, len - pad);
+        m_header_stream = id;
+        m_header_end_stream = flags & FLAG_END_STREAM;
+        return (flags & FLAG_END_HEADERS) ? on_headers(id, m_header_end_stream) : true;
+    }
+    case FRAME_CONTINUATION:
+        if (!m_header_stream)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        m_header_block.append((const char *)payload, len);
+        if (m_header_block.size() > MAX_HEADER_BLOCK)
+        {
+            return connection_error(ENHANCE_YOUR_CALM);
+        }
+        return (flags & FLAG_END_HEADERS) ? on_headers(id, m_header_end_stream) : true;
+    case FRAME_PRIORITY:
+        if (id == 0)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        return true;
+    case FRAME_RST_STREAM:
+    {
+        if (len != 4)
+        {
+            return connection_error(FRAME_SIZE_ERROR);
+        }
+        if (id == 0 || id > m_last_stream)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        std::map<int, h2_stream *>::iterator it = m_streams.find(id);
+        if (it != m_streams.end()) // 对方取消了请求 不再回复RST_STREAM
+        {
+            it->second->local_closed = true;
+            reset(it->second, NO_ERROR);
+        }
+        return true;
+    }
+    case FRAME_SETTINGS:
+        if (id != 0)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        if (flags & FLAG_ACK)
+        {
+            return len == 0 ? true : connection_error(FRAME_SIZE_ERROR);
+        }
+        if (len % 6 != 0)
+        {
+            return connection_error(FRAME_SIZE_ERROR);
+        }
+        if (!apply_settings(payload, len))
+        {
+            return false;
+        }
+        frame(FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        return true;
+    case FRAME_PUSH_PROMISE: // 客户端不能推送
+        return connection_error(PROTOCOL_ERROR);
+    case FRAME_PING:
+        if (id != 0)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        if (len != 8)
+        {
+            return connection_error(FRAME_SIZE_ERROR);
+        }
+        if (!(flags & FLAG_ACK))
+        {
+            frame(FRAME_PING, FLAG_ACK, 0, (const char *)payload, len);
+        }
+        return true;
+    case FRAME_GOAWAY: // 对方不会再发新请求 已有的请求照常完成
+        if (id != 0)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        m_peer_goaway = true;
+        return true;
+    case FRAME_WINDOW_UPDATE:
+        return on_window_update(id, payload, len);
+    case FRAME_PRIORITY_UPDATE:
+        if (id != 0)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        return on_priority_update(payload, len);
+    default: // 未知类型的帧必须忽略
+        return true;
+    }
+}
+
+// 一个完整的头部块：新请求或已有请求的尾部字段
+bool h2_session::on_headers(int id, bool end_stream)
+{
+    std::vector<hpack_field> fields;
+    // 解码后的大小按通告的SETTINGS_MAX_HEADER_LIST_SIZE限制 超过时头部块没有解码完，只能关闭连接
+    hpack_decoder::RESULT ret = m_decoder.decode((const unsigned char *)m_header_block.data(), m_header_block.size(),
+                                                 http_conn::m_read_buffer_size, fields);
+    m_header_block.clear();
+    m_header_stream = 0;
+    if (ret == hpack_decoder::DECODE_TOO_LARGE)
+    {
+        return connection_error(ENHANCE_YOUR_CALM);
+    }
+    if (ret != hpack_decoder::DECODE_OK)
+    {
+        return connection_error(COMPRESSION_ERROR);
+    }
+
+    if (id <= m_last_stream)
+    {
+        std::map<int, h2_stream *>::iterator it = m_streams.find(id);
+        if (it == m_streams.end() || it->second->remote_closed) // 已经结束或被拒绝的请求
+        {
+            return true;
+        }
+        if (!end_stream)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        // 尾部字段被忽略 只用来结束消息体
+        h2_stream *stream = it->second;
+        stream->remote_closed = true;
+        if (!stream->busy && !stream->responding && !stream->local_closed)
+        {
+            feed(stream);
+        }
+        return true;
+    }
+
+    m_last_stream = id;
+    if (m_goaway_sent) // 已经通告不再处理的请求
+    {
+        return true;
+    }
+    if ((int)m_streams.size() >= m_max_streams)
+    {
+        rst_stream(id, REFUSED_STREAM);
+        return true;
+    }
+    h2_stream *stream = open_stream(id);
+    int status = 0;
+    if (!build_request(stream, fields, end_stream, status))
+    {
+        discard(stream);
+        if (status)
+        {
+            reject(id, status, end_stream);
+        }
+        else
+        {
+            rst_stream(id, PROTOCOL_ERROR); // 格式错误的请求
+        }
+        return true;
+    }
+    m_streams[id] = stream;
+    dispatch(stream);
+    return true;
+}
+
+bool h2_session::on_data(int id, int flags, const unsigned char *payload, size_t len)
+{
+    if (id == 0)
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    if ((long long)len > m_recv_window)
+    {
+        return connection_error(FLOW_CONTROL_ERROR);
+    }
+    m_recv_window -= len;
+    size_t n = len;
+    if (flags & FLAG_PADDED)
+    {
+        if (n < 1 || (size_t)payload[0] > n - 1)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        n -= payload[0] + 1;
+        ++payload;
+    }
+
+    std::map<int, h2_stream *>::iterator it = m_streams.find(id);
+    h2_stream *stream = it == m_streams.end() ? NULL : it->second;
+    if (!stream || stream->remote_closed || stream->local_closed)
+    {
+        if (id > m_last_stream)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        if (stream && !stream->local_closed)
+        {
+            reset(stream, STREAM_CLOSED);
+        }
+        credit(NULL, len); // 丢弃 只归还连接的窗口
+        return true;
+    }
+    if ((long long)len > stream->recv_window)
+    {
+        reset(stream, FLOW_CONTROL_ERROR);
+        credit(NULL, len);
+        return true;
+    }
+    stream->recv_window -= len;
+    credit(stream, len - n); // 填充直接归还
+    stream->body.append((const char *)payload, n);
+    if (flags & FLAG_END_STREAM)
+    {
+        stream->remote_closed = true;
+    }
+    if (!stream->busy && !stream->responding)
+    {
+        feed(stream);
+    }
+    return true;
+}
+
+bool h2_session::apply_settings(const unsigned char *p, size_t len)
+{
+    for (size_t i = 0; i + 6 <= len; i += 6)
+    {
+        int id = (p[i] << 8) | p[i + 1];
+        unsigned int value = get32(p + i + 2);
+        switch (id)
+        {
+        case SETTINGS_ENABLE_PUSH: // 本端不推送
+            if (value > 1)
+            {
+                return connection_error(PROTOCOL_ERROR);
+            }
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE: // 同时调整所有已打开的请求的发送窗口
+        {
+            if (value > MAX_WINDOW)
+            {
+                return connection_error(FLOW_CONTROL_ERROR);
+            }
+            long long delta = (long long)value - m_peer_initial_window;
+            for (std::map<int, h2_stream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+            {
+                it->second->send_window += delta;
+                if (it->second->send_window > MAX_WINDOW)
+                {
+                    return connection_error(FLOW_CONTROL_ERROR);
+                }
+            }
+            m_peer_initial_window = value;
+            break;
+        }
+        case SETTINGS_MAX_FRAME_SIZE: // 本端的帧不超过默认的16384 总是可以
+            if (value < MAX_FRAME_SIZE || value > 0xffffff)
+            {
+                return connection_error(PROTOCOL_ERROR);
+            }
+            break;
+        default: // 头部表大小：编码器不使用动态表；其他参数与服务端无关
+            break;
+        }
+    }
+    return true;
+}
+
+bool h2_session::on_window_update(int id, const unsigned char *payload, size_t len)
+{
+    if (len != 4)
+    {
+        return connection_error(FRAME_SIZE_ERROR);
+    }
+    long long increment = get32(payload) & 0x7fffffff;
+    if (id == 0)
+    {
+        if (increment == 0)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        if (m_send_window + increment > MAX_WINDOW)
+        {
+            return connection_error(FLOW_CONTROL_ERROR);
+        }
+        m_send_window += increment;
+        return true;
+    }
+    std::map<int, h2_stream *>::iterator it = m_streams.find(id);
+    if (it == m_streams.end())
+    {
+        return id > m_last_stream ? connection_error(PROTOCOL_ERROR) : true;
+    }
+    h2_stream *stream = it->second;
+    if (increment == 0 || stream->send_window + increment > MAX_WINDOW)
+    {
+        reset(stream, increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+        return true;
+    }
+    stream->send_window += increment;
+    return true;
+}
+
+// PRIORITY_UPDATE(RFC 9218) 请求发出后调整优先级 还没打开的请求的更新被忽略
+bool h2_session::on_priority_update(const unsigned char *payload, size_t len)
+{
+    if (len < 4)
+    {
+        return connection_error(FRAME_SIZE_ERROR);
+    }
+    int id = get32(payload) & 0x7fffffff;
+    if (id == 0)
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    std::map<int, h2_stream *>::iterator it = m_streams.find(id);
+    if (it != m_streams.end())
+    {
+        parse_priority(std::string((const char *)payload + 4, len - 4), it->second->urgency, it->second->incremental);
+    }
+    return true;
+}
+
+h2_stream *h2_session::open_stream(int id)
+{
+    h2_stream *stream = new h2_stream;
+    stream->session = this;
+    stream->id = id;
+    stream->recv_window = DEFAULT_WINDOW;
+    stream->send_window = m_peer_initial_window;
+    stream->conn.init_stream(*m_conn, stream);
+    __atomic_add_fetch(&m_stream_count, 1, __ATOMIC_RELAXED);
+    return stream;
+}
+
+// 把请求的头部还原成HTTP/1.1的请求行和头部 放进conn的读缓冲区
+// 格式错误时返回false；status不为0时以该状态码拒绝请求，否则应以RST_STREAM(PROTOCOL_ERROR)拒绝
+bool h2_session::build_request(h2_stream *stream, const std::vector<hpack_field> &fields, bool end_stream, int &status)
+{
+    std::string method, path, scheme, authority, headers;
+    bool has_length = false;
+    bool regular = false; // 伪头部必须在普通头部之前
+    for (size_t i = 0; i < fields.size(); ++i)
+    {
+        const std::string &name = fields[i].name;
+        const std::string &value = fields[i].value;
+        if (name.empty() || !valid_value(value))
+        {
+            return false;
+        }
+        if (name[0] == ':')
+        {
+            if (regular)
+            {
+                return false;
+            }
+            if (name == ":method")
+                method = value;
+            else if (name == ":path")
+                path = value;
+            else if (name == ":scheme")
+                scheme = value;
+            else if (name == ":authority")
+                authority = value;
+            else
+                return false;
+            continue;
+        }
+        regular = true;
+        for (size_t j = 0; j < name.size(); ++j)
+        {
+            if (isupper((unsigned char)name[j]) || name[j] == ':' || name[j] == ' ' || !valid_value(name))
+            {
+                return false;
+            }
+        }
+        // HTTP/2中不允许的逐跳头部
+        if (name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "transfer-encoding" ||
+            name == "upgrade" || (name == "te" && value != "trailers"))
+        {
+            return false;
+        }
+        if (name == "host")
+        {
+            if (authority.empty())
+            {
+                authority = value;
+            }
+            continue;
+        }
+        if (name == "content-length")
+        {
+            has_length = true;
+        }
+        else if (name == "priority")
+        {
+            parse_priority(value, stream->urgency, stream->incremental);
+        }
+        headers += name + ": " + value + "\r\n";
+    }
+    if (method.empty() || path.empty() || scheme.empty() || method.find(' ') != std::string::npos ||
+        path.find(' ') != std::string::npos)
+    {
+        return false;
+    }
+
+    std::string head = method + " " + path + " HTTP/1.1\r\n";
+    if (!authority.empty())
+    {
+        head += "Host: " + authority + "\r\n";
+    }
+    head += headers;
+    if (!end_stream && !has_length) // 长度未知的消息体 按chunked编码拷入
+    {
+        head += "Transfer-Encoding: chunked\r\n";
+        stream->chunked = true;
+    }
+    head += "\r\n";
+    if (head.size() > (size_t)http_conn::m_read_buffer_size - (end_stream ? 0 : BODY_ROOM))
+    {
+        status = 431;
+        return false;
+    }
+    memcpy(stream->conn.m_read_buf, head.data(), head.size());
+    stream->conn.m_read_idx = head.size();
+    stream->remote_closed = end_stream;
+    return true;
+}
+
+// 不经过conn直接回复只有状态码的响应
+void h2_session::reject(int id, int status, bool end_stream)
+{
+    std::string block;
+    hpack_encoder::status(block, status);
+    frame(FRAME_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, id, block.data(), block.size());
+    if (!end_stream)
+    {
+        rst_stream(id, NO_ERROR);
+    }
+}
+
+void h2_session::dispatch(h2_stream *stream)
+{
+    completion_queue::action act;
+    stream->busy = true;
+    if (m_dispatch(&stream->conn, act))
+    {
+        handle(stream, act);
+    }
+}
+
+void h2_session::handle(h2_stream *stream, completion_queue::action act)
+{
+    stream->busy = false;
+    if (stream->local_closed) // 处理期间被取消
+    {
+        try_release(stream);
+        return;
+    }
+    switch (act)
+    {
+    case completion_queue::WANT_READ: // 请求不完整 拷入更多消息体
+        feed(stream);
+        break;
+    case completion_queue::WANT_WRITE:
+        respond(stream);
+        break;
+    case completion_queue::CLOSE:
+        reset(stream, INTERNAL_ERROR);
+        break;
+    }
+}
+
+// 把收到的消息体拷入conn的读缓冲区并继续处理 没有可拷入的数据时等待DATA帧
+void h2_session::feed(h2_stream *stream)
+{
+    http_conn &conn = stream->conn;
+    char *buf = conn.m_read_buf + conn.m_read_idx;
+    size_t space = http_conn::m_read_buffer_size - conn.m_read_idx;
+    size_t n = 0;
+    if (stream->chunked)
+    {
+        if (space > (size_t)CHUNK_OVERHEAD)
+        {
+            n = stream->body.size() < space - CHUNK_OVERHEAD ? stream->body.size() : space - CHUNK_OVERHEAD;
+        }
+        if (n)
+        {
+            int len = snprintf(buf, space, "%zx\r\n", n);
+            memcpy(buf + len, stream->body.data(), n);
+            memcpy(buf + len + n, "\r\n", 2);
+            conn.m_read_idx += len + n + 2;
+        }
+    }
+    else
+    {
+        n = stream->body.size() < space ? stream->body.size() : space;
+        memcpy(buf, stream->body.data(), n);
+        conn.m_read_idx += n;
+    }
+    bool added = n > 0;
+    if (n)
+    {
+        stream->body.erase(0, n);
+        credit(stream, n);
+    }
+    if (stream->chunked && stream->remote_closed && stream->body.empty() && !stream->last_chunk &&
+        http_conn::m_read_buffer_size - conn.m_read_idx >= 5)
+    {
+        memcpy(conn.m_read_buf + conn.m_read_idx, "0\r\n\r\n", 5);
+        conn.m_read_idx += 5;
+        stream->last_chunk = true;
+        added = true;
+    }
+    if (added)
+    {
+        dispatch(stream);
+    }
+    else if (stream->remote_closed && stream->body.empty()) // 消息体比Content-Length短
+    {
+        reset(stream, PROTOCOL_ERROR);
+    }
+}
+
+// 归还接收窗口 stream为NULL时只归还连接的窗口
+void h2_session::credit(h2_stream *stream, size_t len)
+{
+    m_recv_unacked += len;
+    if (m_recv_unacked >= WINDOW_UPDATE_THRESHOLD)
+    {
+        window_update(0, m_recv_unacked);
+        m_recv_window += m_recv_unacked;
+        m_recv_unacked = 0;
+    }
+    if (!stream)
+    {
+        return;
+    }
+    stream->recv_unacked += len;
+    if (!stream->remote_closed && stream->recv_unacked >= (int)WINDOW_UPDATE_THRESHOLD)
+    {
+        window_update(stream->id, stream->recv_unacked);
+        stream->recv_window += stream->recv_unacked;
+        stream->recv_unacked = 0;
+    }
+}
+
+// 把conn构造好的HTTP/1.1响应转换为HEADERS帧 消息体留待schedule按优先级和窗口分成DATA帧
+void h2_session::respond(h2_stream *stream)
+{
+    http_conn &conn = stream->conn;
+    const char *head = (const char *)conn.m_iv[0].iov_base;
+    size_t head_len = conn.m_iv[0].iov_len;
+    const char *end = (const char *)memmem(head, head_len, "\r\n\r\n", 4);
+    const char *space = (const char *)memchr(head, ' ', head_len);
+    if (!end || !space)
+    {
+        reset(stream, INTERNAL_ERROR);
+        return;
+    }
+
+    std::string block;
+    hpack_encoder::status(block, atoi(space + 1));
+    const char *line = (const char *)memmem(head, end + 2 - head, "\r\n", 2) + 2;
+    while (line < end + 2)
+    {
+        const char *eol = (const char *)memmem(line, end + 2 - line, "\r\n", 2);
+        const char *colon = (const char *)memchr(line, ':', eol - line);
+        if (colon)
+        {
+            std::string name(line, colon - line);
+            for (size_t i = 0; i < name.size(); ++i)
+            {
+                name[i] = tolower((unsigned char)name[i]);
+            }
+            const char *value = colon + 1;
+            while (value < eol && (*value == ' ' || *value == '\t'))
+            {
+                ++value;
+            }
+            if (name != "connection" && name != "keep-alive" && name != "transfer-encoding" && name != "upgrade")
+            {
+                hpack_encoder::header(block, name, std::string(value, eol - value));
+            }
+        }
+        line = eol + 2;
+    }
+
+    stream->data[0] = end + 4;
+    stream->data_len[0] = head + head_len - (end + 4);
+    if (conn.m_iv_count == 2 && !conn.m_producer)
+    {
+        stream->data[1] = (const char *)conn.m_iv[1].iov_base;
+        stream->data_len[1] = conn.m_iv[1].iov_len;
+    }
+    bool body = stream->data_len[0] + stream->data_len[1] > 0 || conn.m_producer;
+    stream->responding = true;
+
+    // 头部块超过一帧时分成HEADERS和若干CONTINUATION
+    size_t off = 0;
+    do
+    {
+        size_t n = block.size() - off < MAX_FRAME_SIZE ? block.size() - off : MAX_FRAME_SIZE;
+        int flags = off + n == block.size() ? FLAG_END_HEADERS : 0;
+        if (off == 0 && !body)
+        {
+            flags |= FLAG_END_STREAM;
+        }
+        frame(off == 0 ? FRAME_HEADERS : FRAME_CONTINUATION, flags, stream->id, block.data() + off, n);
+        off += n;
+    } while (off < block.size());
+    if (!body)
+    {
+        close_local(stream);
+    }
+}
+
+// 响应已经完整发出 请求的消息体还没收完时让对方停止发送
+void h2_session::close_local(h2_stream *stream)
+{
+    stream->local_closed = true;
+    if (!stream->remote_closed)
+    {
+        rst_stream(stream->id, NO_ERROR);
+        stream->remote_closed = true;
+    }
+    try_release(stream);
+}
+
+// 以错误码结束请求 在工作线程中的请求处理完后再释放
+void h2_session::reset(h2_stream *stream, int code)
+{
+    if (!stream->local_closed)
+    {
+        rst_stream(stream->id, code);
+    }
+    stream->local_closed = true;
+    stream->remote_closed = true;
+    stream->body.clear();
+    stream->data_len[0] = stream->data_len[1] = 0;
+    try_release(stream);
+}
+
+void h2_session::try_release(h2_stream *stream)
+{
+    if (!stream->local_closed || stream->busy || stream->queued > 0)
+    {
+        return;
+    }
+    m_streams.erase(stream->id);
+    discard(stream);
+}
+
+void h2_session::discard(h2_stream *stream)
+{
+    stream->conn.unmap();
+    stream->conn.init(); // 关闭转存消息体的临时文件
+    delete stream;
+}
+
+bool h2_session::sendable(const h2_stream *stream) const
+{
+    // 升级时在收到连接前言(及随后的SETTINGS)之前不发送消息体 对方可能还没准备好接收大量帧
+    if (!m_preface || !stream->responding || stream->local_closed)
+    {
+        return false;
+    }
+    if (stream->data_len[0] + stream->data_len[1] > 0)
+    {
+        return stream->send_window > 0 && m_send_window > 0;
+    }
+    // 流式响应：上一块已经写出 生成下一块
+    return stream->conn.m_producer && stream->queued == 0;
+}
+
+// 下一个发送DATA帧的请求：urgency最小的请求中，非incremental的按流编号依次发完，incremental的轮流发送
+h2_stream *h2_session::pick()
+{
+    int urgency = 8;
+    for (std::map<int, h2_stream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+    {
+        if (it->second->urgency < urgency && sendable(it->second))
+        {
+            urgency = it->second->urgency;
+        }
+    }
+    if (urgency == 8)
+    {
+        return NULL;
+    }
+    h2_stream *first = NULL; // 编号最小的incremental请求
+    h2_stream *next = NULL;  // m_rr_last之后的第一个
+    for (std::map<int, h2_stream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+    {
+        h2_stream *stream = it->second;
+        if (stream->urgency != urgency || !sendable(stream))
+        {
+            continue;
+        }
+        if (!stream->incremental)
+        {
+            return stream;
+        }
+        if (!first)
+        {
+            first = stream;
+        }
+        if (!next && stream->id > m_rr_last)
+        {
+            next = stream;
+        }
+    }
+    return next ? next : first;
+}
+
+// 为一个请求排入一个DATA帧
+void h2_session::send_data(h2_stream *stream)
+{
+    http_conn &conn = stream->conn;
+    m_rr_last = stream->id;
+    if (stream->data_len[0] + stream->data_len[1] == 0) // 让生产者生成下一块
+    {
+        if (!conn.m_chunk_buf)
+        {
+            conn.m_chunk_buf = new char[http_conn::STREAM_CHUNK_SIZE];
+        }
+        int n = conn.m_producer(&conn, conn.m_chunk_buf, http_conn::STREAM_CHUNK_SIZE);
+        if (n <= 0)
+        {
+            conn.m_producer = NULL;
+            if (n < 0)
+            {
+                reset(stream, INTERNAL_ERROR);
+                return;
+            }
+            data_frame(stream, NULL, 0, true);
+            close_local(stream);
+            return;
+        }
+        conn.m_stream_sent += n;
+        stream->data[1] = conn.m_chunk_buf;
+        stream->data_len[1] = n;
+        if (stream->send_window <= 0 || m_send_window <= 0)
+        {
+            return;
+        }
+    }
+    int k = stream->data_len[0] ? 0 : 1;
+    size_t n = stream->data_len[k];
+    n = n < MAX_FRAME_SIZE ? n : MAX_FRAME_SIZE;
+    n = (long long)n < m_send_window ? n : m_send_window;
+    n = (long long)n < stream->send_window ? n : stream->send_window;
+    bool last = n == stream->data_len[k] && (k == 1 || stream->data_len[1] == 0) && !conn.m_producer;
+    data_frame(stream, stream->data[k], n, last);
+    stream->data[k] += n;
+    stream->data_len[k] -= n;
+    stream->send_window -= n;
+    m_send_window -= n;
+    if (last)
+    {
+        close_local(stream);
+    }
+}
+
+void h2_session::schedule()
+{
+    while (m_out_bytes < OUTPUT_HIGH_WATER)
+    {
+        h2_stream *stream = pick();
+        if (!stream)
+        {
+            break;
+        }
+        send_data(stream);
+    }
+}
+
+// 写出发送队列 返回1表示全部写出，0表示发送缓冲区满，-1表示出错
+int h2_session::flush()
+{
+    // kTLS和明文连接直接writev 消息体不经复制；用户态TLS先拼成整记录
+    bool staged = m_conn->m_ssl && !tls_context::offloaded(m_conn->m_ssl);
+    while (true)
+    {
+        struct iovec iv[IOV_BATCH];
+        int count = 0;
+        if (staged)
+        {
+            if (m_stage_off == m_stage.size())
+            {
+                m_stage.clear();
+                m_stage_off = 0;
+                while (!m_out.empty() && m_stage.size() < TLS_RECORD_SIZE)
+                {
+                    const segment &seg = m_out.front();
+                    const char *p = (seg.ext ? seg.ext : seg.data.data()) + m_out_off;
+                    size_t left = (seg.ext ? seg.len : seg.data.size()) - m_out_off;
+                    size_t n = left < TLS_RECORD_SIZE - m_stage.size() ? left : TLS_RECORD_SIZE - m_stage.size();
+                    m_stage.append(p, n);
+                    consume(n);
+                }
+                if (m_stage.empty())
+                {
+                    return 1;
+                }
+            }
+            // 写不出时下次以同样的内容和长度重试 满足OpenSSL的要求
+            iv[0].iov_base = &m_stage[m_stage_off];
+            iv[0].iov_len = m_stage.size() - m_stage_off;
+            count = 1;
+        }
+        else
+        {
+            if (m_out.empty())
+            {
+                return 1;
+            }
+            size_t off = m_out_off;
+            for (std::deque<segment>::iterator it = m_out.begin(); it != m_out.end() && count < IOV_BATCH; ++it)
+            {
+                iv[count].iov_base = (void *)((it->ext ? it->ext : it->data.data()) + off);
+                iv[count].iov_len = (it->ext ? it->len : it->data.size()) - off;
+                off = 0;
+                ++count;
+            }
+        }
+        ssize_t n = m_conn->writev_some(iv, count);
+        if (n < 0)
+        {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        if (staged)
+        {
+            m_stage_off += n;
+        }
+        else
+        {
+            consume(n);
+        }
+    }
+}
+
+// 从发送队列中去掉已写出的len字节 引用请求内存的段都写出后该请求才能释放
+void h2_session::consume(size_t len)
+{
+    m_out_bytes -= len;
+    while (len > 0)
+    {
+        segment &seg = m_out.front();
+        size_t left = (seg.ext ? seg.len : seg.data.size()) - m_out_off;
+        if (len < left)
+        {
+            m_out_off += len;
+            return;
+        }
+        len -= left;
+        h2_stream *owner = seg.owner;
+        m_out.pop_front();
+        m_out_off = 0;
+        if (owner && --owner->queued == 0)
+        {
+            try_release(owner);
+        }
+    }
+}
+
+// 排入一个帧 与队尾的帧头、控制帧合并成一段
+void h2_session::frame(int type, int flags, int id, const char *payload, size_t len)
+{
+    if (m_out.empty() || m_out.back().ext)
+    {
+        segment seg;
+        seg.ext = NULL;
+        seg.len = 0;
+        seg.owner = NULL;
+        m_out.push_back(seg);
+    }
+    std::string &out = m_out.back().data;
+    char header[FRAME_HEADER];
+    header[0] = len >> 16;
+    header[1] = len >> 8;
+    header[2] = len;
+    header[3] = type;
+    header[4] = flags;
+    put32(header + 5, id);
+    out.append(header, FRAME_HEADER);
+    if (len)
+    {
+        out.append(payload, len);
+    }
+    m_out_bytes += FRAME_HEADER + len;
+}
+
+// DATA帧 载荷直接引用请求的响应内存
+void h2_session::data_frame(h2_stream *stream, const char *data, size_t len, bool end_stream)
+{
+    frame(FRAME_DATA, end_stream ? FLAG_END_STREAM : 0, stream->id, NULL, 0);
+    if (!len)
+    {
+        return;
+    }
+    // 修正刚排入的帧头中的长度
+    std::string &out = m_out.back().data;
+    char *p = &out[out.size() - FRAME_HEADER];
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    segment seg;
+    seg.ext = data;
+    seg.len = len;
+    seg.owner = stream;
+    m_out.push_back(seg);
+    m_out_bytes += len;
+    ++stream->queued;
+}
+
+void h2_session::rst_stream(int id, int code)
+{
+    char payload[4];
+    put32(payload, code);
+    frame(FRAME_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+void h2_session::window_update(int id, size_t increment)
+{
+    char payload[4];
+    put32(payload, increment);
+    frame(FRAME_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+void h2_session::goaway(int code)
+{
+    char payload[8];
+    put32(payload, m_last_stream);
+    put32(payload + 4, code);
+    frame(FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    m_goaway_sent = true;
+}
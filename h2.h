@@ -0,0 +1,149 @@
+#ifndef H2_H
+#define H2_H
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include "http_conn.h"
+#include "hpack.h"
+
+class h2_session;
+
+// HTTP/2连接上的一个请求(流)
+// 请求头部被还原成HTTP/1.1的请求行和头部放进conn的读缓冲区，消息体随DATA帧陆续拷入，
+// 之后与HTTP/1.1的请求一样在事件循环中内联完成或交给线程池(路由、静态文件、缓存都是同一套)；
+// conn构造好的HTTP/1.1响应再由h2_session转换为HEADERS和DATA帧，消息体直接引用conn中的内存发送
+struct h2_stream
+{
+    h2_stream() : session(NULL), id(0), busy(false), remote_closed(false), local_closed(false), chunked(false),
+                  last_chunk(false), responding(false), recv_window(0), recv_unacked(0), send_window(0),
+                  queued(0), urgency(3), incremental(false)
+    {
+        data[0] = data[1] = NULL;
+        data_len[0] = data_len[1] = 0;
+    }
+
+    h2_session *session; // 所在的连接 连接关闭时还在线程池中的请求置为NULL，处理完后直接释放
+    int id;
+    http_conn conn;
+    bool busy;          // 正在事件循环之外处理(工作线程或阻塞I/O线程池) 期间不能访问conn
+    bool remote_closed; // 收到了END_STREAM 请求已经完整
+    bool local_closed;  // 发出了END_STREAM或RST_STREAM 之后不再发送
+    bool chunked;       // 请求没有Content-Length 消息体以chunked编码拷入conn
+    bool last_chunk;    // 已拷入最后的0长度块
+    bool responding;    // 响应的HEADERS已经发出
+    std::string body;   // 收到但还没拷入conn读缓冲区的消息体
+    long long recv_window; // 对方还能发送的消息体字节数
+    int recv_unacked;      // 已拷入conn、还没用WINDOW_UPDATE归还的字节数
+    long long send_window; // 本端还能发送的消息体字节数
+    const char *data[2];   // 尚未发送的响应消息体：写缓冲区中头部之后的部分、m_iv[1](文件映射或处理回调生成的内容)
+    size_t data_len[2];
+    int queued;            // 发送队列中引用data的段数 为0时conn才能被重置或释放
+    int urgency;           // 优先级(RFC 9218) 0最高
+    bool incremental;      // 同一优先级的incremental请求轮流发送 否则按流编号依次发完
+};
+
+// 一个HTTP/2连接(RFC 9113) 只在事件循环线程中访问
+// 建立方式：TLS上ALPN协商h2，明文上客户端直接发送连接前言(prior knowledge)或通过Upgrade: h2c升级
+// 输入的帧在读到时全部处理；输出的帧放在发送队列中，连接可写时集中writev，写不完时监听EPOLLOUT
+// 流控：对方的窗口用完时暂停对应请求的DATA帧；接收的消息体拷入conn之后才归还窗口，上传速度受处理速度约束
+// 优先级：按RFC 9218的priority头部和PRIORITY_UPDATE帧调度，RFC 7540的依赖树已被废弃，其PRIORITY帧被忽略
+class h2_session
+{
+public:
+    // 事件循环读到数据后调用 连接已是HTTP/2或由这次读到的数据切换到HTTP/2时处理并返回true，keep为false表示关闭连接；
+    // 其他情况返回false，由调用者按HTTP/1.1解析
+    static bool on_read(http_conn *conn, bool &keep);
+    // 事件循环：工作线程处理完连接上的一个请求 返回false表示关闭连接
+    static bool complete(h2_stream *stream, completion_queue::action act);
+
+    explicit h2_session(http_conn *conn);
+    ~h2_session();
+
+    bool on_write();   // 连接可写 返回false表示关闭连接
+    bool idle() const { return m_streams.empty(); }
+    bool sending() const { return m_out_bytes > 0 || m_stage_off < m_stage.size(); } // 有还没写出的输出
+
+public:
+    // 把请求交给线程池 在事件循环中直接完成时返回true并给出后续动作；由事件循环设置，与HTTP/1.1的请求使用同一策略
+    static bool (*m_dispatch)(http_conn *conn, completion_queue::action &act);
+    static int m_max_streams;         // 每个连接同时进行的最大请求数 通过SETTINGS_MAX_CONCURRENT_STREAMS告知对方
+    static long long m_session_count; // 建立的HTTP/2连接数
+    static long long m_stream_count;  // HTTP/2连接上的请求数
+
+private:
+    // 发送队列中的一段：帧头和控制帧放在data中，DATA帧的消息体引用owner->conn中的内存
+    struct segment
+    {
+        std::string data;
+        const char *ext;
+        size_t len;
+        h2_stream *owner;
+    };
+
+    void start();
+    bool upgrade();
+    bool receive();
+    bool finish();
+    bool process_input();
+    bool on_frame(int type, int flags, int id, const unsigned char *payload, size_t len);
+    bool on_headers(int id, bool end_stream);
+    bool on_data(int id, int flags, const unsigned char *payload, size_t len);
+    bool apply_settings(const unsigned char *payload, size_t len);
+    bool on_window_update(int id, const unsigned char *payload, size_t len);
+    bool on_priority_update(const unsigned char *payload, size_t len);
+    bool connection_error(int code);
+
+    h2_stream *open_stream(int id);
+    bool build_request(h2_stream *stream, const std::vector<hpack_field> &fields, bool end_stream, int &status);
+    void reject(int id, int status, bool end_stream);
+    void dispatch(h2_stream *stream);
+    void handle(h2_stream *stream, completion_queue::action act);
+    void feed(h2_stream *stream);
+    void credit(h2_stream *stream, size_t len);
+    void respond(h2_stream *stream);
+    void close_local(h2_stream *stream);
+    void reset(h2_stream *stream, int code);
+    void try_release(h2_stream *stream);
+    static void discard(h2_stream *stream);
+
+    h2_stream *pick();
+    bool sendable(const h2_stream *stream) const;
+    void send_data(h2_stream *stream);
+    void schedule();
+    int flush();
+    void consume(size_t len);
+
+    void frame(int type, int flags, int id, const char *payload, size_t len);
+    void data_frame(h2_stream *stream, const char *data, size_t len, bool end_stream);
+    void rst_stream(int id, int code);
+    void window_update(int id, size_t increment);
+    void goaway(int code);
+
+private:
+    http_conn *m_conn;
+    hpack_decoder m_decoder;
+    std::map<int, h2_stream *> m_streams; // 还没释放的请求 按流编号
+    std::string m_in;                     // 还不够一帧的输入
+    bool m_preface;                       // 已收到连接前言
+    int m_last_stream;                    // 对方打开过的最大流编号
+    int m_rr_last;                        // incremental请求轮流发送时上一次发送的流编号
+    std::string m_header_block;           // 跨CONTINUATION帧的头部块
+    int m_header_stream;                  // 正在接收头部块的流 0表示没有
+    bool m_header_end_stream;
+    long long m_send_window;              // 连接级的发送窗口
+    long long m_recv_window;              // 连接级的接收窗口
+    size_t m_recv_unacked;
+    long long m_peer_initial_window;      // 对方的SETTINGS_INITIAL_WINDOW_SIZE
+    std::deque<segment> m_out;            // 发送队列
+    size_t m_out_off;                     // 队首一段中已写出的字节数
+    size_t m_out_bytes;                   // 发送队列中未写出的字节数
+    std::string m_stage;                  // TLS连接把发送队列拼成整记录再交给OpenSSL 避免帧头单独成为一个记录
+    size_t m_stage_off;
+    bool m_goaway_sent;
+    bool m_peer_goaway;
+    bool m_failed;                        // 发生了连接错误 发出GOAWAY后关闭
+};
+
+#endif
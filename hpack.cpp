@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <string.h>
+#include "hpack.h"
+
+// 静态表(RFC 7541附录A) 下标从1开始
+static const struct
+{
+    const char *name;
+    const char *value;
+} static_table[] = {
+    {"", ""},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+static const size_t STATIC_COUNT = sizeof(static_table) / sizeof(static_table[0]) - 1;
+
+// Huffman编码表(RFC 7541附录B) 第256项为EOS
+static const struct
+{
+    unsigned int code;
+    int bits;
+} huffman_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28}, {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12}, {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7}, {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+// 由编码表构造的解码树 叶子上是符号，内部节点的sym为-1
+struct huffman_tree
+{
+    struct node
+    {
+        short child[2];
+        short sym;
+    };
+    node nodes[513];
+    int count;
+
+    huffman_tree() : count(1)
+    {
+        nodes[0].child[0] = nodes[0].child[1] = nodes[0].sym = -1;
+        for (int sym = 0; sym < 257; ++sym)
+        {
+            int cur = 0;
+            for (int i = huffman_codes[sym].bits - 1; i >= 0; --i)
+            {
+                int bit = (huffman_codes[sym].code >> i) & 1;
+                if (nodes[cur].child[bit] < 0)
+                {
+                    nodes[count].child[0] = nodes[count].child[1] = nodes[count].sym = -1;
+                    nodes[cur].child[bit] = count++;
+                }
+                cur = nodes[cur].child[bit];
+            }
+            nodes[cur].sym = sym;
+        }
+    }
+};
+
+static bool huffman_decode(const unsigned char *p, size_t len, std::string &out)
+{
+    static const huffman_tree tree;
+    int cur = 0;
+    int depth = 0;    // 上一个符号之后读入的位数
+    bool ones = true; // 这些位是否全为1 末尾的填充必须是不超过7位的EOS前缀
+    for (size_t i = 0; i < len; ++i)
+    {
+        for (int b = 7; b >= 0; --b)
+        {
+            int bit = (p[i] >> b) & 1;
+            cur = tree.nodes[cur].child[bit];
+            if (cur < 0)
+            {
+                return false;
+            }
+            ++depth;
+            ones = ones && bit;
+            int sym = tree.nodes[cur].sym;
+            if (sym >= 0)
+            {
+                if (sym == 256) // 字符串中不能出现EOS
+                {
+                    return false;
+                }
+                out += (char)sym;
+                cur = 0;
+                depth = 0;
+                ones = true;
+            }
+        }
+    }
+    return depth < 8 && ones;
+}
+
+// 带前缀的整数(RFC 7541 5.1) 超过32位的值视为错误
+static bool read_int(const unsigned char *&p, const unsigned char *end, int prefix, size_t &value)
+{
+    if (p == end)
+    {
+        return false;
+    }
+    size_t max = (1u << prefix) - 1;
+    value = *p++ & max;
+    if (value < max)
+    {
+        return true;
+    }
+    for (int shift = 0; p < end && shift < 32; shift += 7)
+    {
+        unsigned char b = *p++;
+        value += (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            return value <= 0xffffffffu;
+        }
+    }
+    return false;
+}
+
+static bool read_string(const unsigned char *&p, const unsigned char *end, std::string &out)
+{
+    if (p == end)
+    {
+        return false;
+    }
+    bool huffman = *p & 0x80;
+    size_t len;
+    if (!read_int(p, end, 7, len) || len > (size_t)(end - p))
+    {
+        return false;
+    }
+    out.clear();
+    if (huffman)
+    {
+        if (!huffman_decode(p, len, out))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        out.assign((const char *)p, len);
+    }
+    p += len;
+    return true;
+}
+
+bool hpack_decoder::lookup(size_t index, hpack_field &field) const
+{
+    if (index == 0)
+    {
+        return false;
+    }
+    if (index <= STATIC_COUNT)
+    {
+        field.name = static_table[index].name;
+        field.value = static_table[index].value;
+        return true;
+    }
+    index -= STATIC_COUNT + 1;
+    if (index >= m_table.size())
+    {
+        return false;
+    }
+    field = m_table[index];
+    return true;
+}
+
+void hpack_decoder::evict(size_t max_size)
+{
+    while (m_size > max_size && !m_table.empty())
+    {
+        m_size -= m_table.back().name.size() + m_table.back().value.size() + 32;
+        m_table.pop_back();
+    }
+}
+
+void hpack_decoder::insert(const hpack_field &field)
+{
+    size_t size = field.name.size() + field.value.size() + 32;
+    if (size > m_max_size) // 比整个表还大 结果是清空动态表
+    {
+        evict(0);
+        return;
+    }
+    evict(m_max_size - size);
+    m_table.push_front(field);
+    m_size += size;
+}
+
+hpack_decoder::RESULT hpack_decoder::decode(const unsigned char *data, size_t len, size_t max_list_size, std::vector<hpack_field> &out)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = data + len;
+    size_t list_size = 0;
+    bool field_seen = false; // 已经解码出字段 之后不能再有动态表大小更新
+    while (p < end)
+    {
+        hpack_field field;
+        size_t index;
+        if ((*p & 0xe0) == 0x20) // 动态表大小更新 只能出现在头部块的开头(RFC 7541 4.2)
+        {
+            if (field_seen || !read_int(p, end, 5, index) || index > TABLE_SIZE)
+            {
+                return DECODE_ERROR;
+            }
+            m_max_size = index;
+            evict(m_max_size);
+            continue;
+        }
+        field_seen = true;
+        if (*p & 0x80) // 索引
+        {
+            if (!read_int(p, end, 7, index) || !lookup(index, field))
+            {
+                return DECODE_ERROR;
+            }
+        }
+        else
+        {
+            // 字面值：加入动态表(01) 不加入(0000) 永不加入(0001) 名字可以引用表中的条目
+            bool indexing = (*p & 0xc0) == 0x40;
+            if (!read_int(p, end, indexing ? 6 : 4, index))
+            {
+                return DECODE_ERROR;
+            }
+            if (index)
+            {
+                if (!lookup(index, field))
+                {
+                    return DECODE_ERROR;
+                }
+            }
+            else if (!read_string(p, end, field.name))
+            {
+                return DECODE_ERROR;
+            }
+            if (!read_string(p, end, field.value))
+            {
+                return DECODE_ERROR;
+            }
+            if (indexing)
+            {
+                insert(field);
+            }
+        }
+        list_size += field.name.size() + field.value.size() + 32;
+        if (list_size > max_list_size)
+        {
+            return DECODE_TOO_LARGE;
+        }
+        out.push_back(field);
+    }
+    return DECODE_OK;
+}
+
+static void write_int(std::string &out, unsigned char flags, int prefix, size_t value)
+{
+    size_t max = (1u << prefix) - 1;
+    if (value < max)
+    {
+        out += (char)(flags | value);
+        return;
+    }
+    out += (char)(flags | max);
+    value -= max;
+    while (value >= 128)
+    {
+        out += (char)(value % 128 + 128);
+        value /= 128;
+    }
+    out += (char)value;
+}
+
+static void write_string(std::string &out, const std::string &s)
+{
+    write_int(out, 0x00, 7, s.size());
+    out += s;
+}
+
+void hpack_encoder::status(std::string &out, int status)
+{
+    char value[16];
+    snprintf(value, sizeof(value), "%d", status);
+    for (size_t i = 8; i <= 14; ++i) // :status 200 204 206 304 400 404 500
+    {
+        if (strcmp(static_table[i].value, value) == 0)
+        {
+            write_int(out, 0x80, 7, i);
+            return;
+        }
+    }
+    write_int(out, 0x00, 4, 8);
+    write_string(out, value);
+}
+
+void hpack_encoder::header(std::string &out, const std::string &name, const std::string &value)
+{
+    for (size_t i = 1; i <= STATIC_COUNT; ++i)
+    {
+        if (name == static_table[i].name)
+        {
+            write_int(out, 0x00, 4, i);
+            write_string(out, value);
+            return;
+        }
+    }
+    out += '\0';
+    write_string(out, name);
+    write_string(out, value);
+}
@@ -0,0 +1,58 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+// HTTP/2的头部压缩(RFC 7541)
+// 解码器维护对方编码器的动态表，支持全部表示方式和Huffman编码；
+// 编码器只引用静态表中的名字，不使用动态表也不做Huffman编码，连接上不需要为它保存状态
+struct hpack_field
+{
+    std::string name;
+    std::string value;
+};
+
+class hpack_decoder
+{
+public:
+    static const size_t TABLE_SIZE = 4096; // 动态表大小的上限 即SETTINGS_HEADER_TABLE_SIZE的默认值，不另行通告
+
+    enum RESULT
+    {
+        DECODE_OK,
+        DECODE_ERROR,    // 编码有误 连接必须以COMPRESSION_ERROR关闭
+        DECODE_TOO_LARGE // 解码后的头部超过max_list_size 没有解码完，动态表已与对方不一致，连接必须关闭
+    };
+
+    hpack_decoder() : m_size(0), m_max_size(TABLE_SIZE) {}
+
+    // 解码一个完整的头部块 追加到out
+    // 解码后的大小按每个字段的名字和值的长度加32累计(即SETTINGS_MAX_HEADER_LIST_SIZE的算法)，超过max_list_size时立即停止；
+    // 一个字节的索引就能复制一个4KB的动态表条目，只限制编码后的头部块不足以限制解码后的大小
+    // 即使请求随后被拒绝，头部块也要解码，否则动态表与对方不一致
+    RESULT decode(const unsigned char *data, size_t len, size_t max_list_size, std::vector<hpack_field> &out);
+
+private:
+    bool lookup(size_t index, hpack_field &field) const;
+    void insert(const hpack_field &field);
+    void evict(size_t max_size);
+
+private:
+    std::deque<hpack_field> m_table; // 动态表 新条目在前
+    size_t m_size;                   // 动态表当前大小 每个条目按名字和值的长度加32计
+    size_t m_max_size;               // 编码器用大小更新指令设置的大小 不超过TABLE_SIZE
+};
+
+class hpack_encoder
+{
+public:
+    // 响应状态 常见状态码是静态表中的一个字节
+    static void status(std::string &out, int status);
+    // 不加入动态表的字面头部 名字须为小写
+    static void header(std::string &out, const std::string &name, const std::string &value);
+};
+
+#endif
@@ -1,4 +1,10 @@
+#include <sys/syscall.h>
+#include <ctype.h>
+#include <limits>
 #include "http_conn.h"
+#include "router.h"
+#include "mime.h"
+#include "h2.h"
 
 const char *ok_200_title = "200 OK";
 const char *error_400_title = "400 Bad Request";
@@ -9,7 +15,20 @@ const char *error_404_title = "404 Not Found";
 const char *error_404_form = "404 The requested file was not found on this server.\n";
 const char *error_500_title = "500 Internal Error";
 const char *error_500_form = "500 There was an unusual problem serving the requested file.\n";
-const char *doc_root = "../doc_root";
+const char *error_405_title = "405 Method Not Allowed";
+const char *error_405_form = "405 The request method is not supported for the requested resource.\n";
+const char *error_413_title = "413 Payload Too Large";
+const char *error_413_form = "413 The request body is larger than the server is willing to accept.\n";
+const char *error_414_title = "414 URI Too Long";
+const char *error_414_form = "414 The requested path is too long.\n";
+const char *error_505_title = "505 HTTP Version Not Supported";
+const char *error_505_form = "505 Only HTTP/1.0 and HTTP/1.1 are supported.\n";
+const char *error_429_title = "429 Too Many Requests";
+const char *error_429_form = "429 You have sent too many requests, please slow down.\n";
+const char *error_503_title = "503 Service Unavailable";
+const char *error_503_form = "503 The server is overloaded, please retry later.\n";
+const char *index_file = "index.html"; // 请求目录时返回的索引文件
+const char *spool_dir = "/tmp"; // 转存大消息体的临时文件所在目录
 
 int setnonblocking(int fd)
 {
@@ -20,6 +39,7 @@ int setnonblocking(int fd)
 }
 
 // 往内核事件表注册fd上的事件
+// fd须由调用方创建为非阻塞(accept4/socket/socketpair的SOCK_NONBLOCK)，这里不再额外调用fcntl
 void addfd(int epollfd, int fd, bool one_shot, int trig_mode)
 {
     epoll_event event;
@@ -35,7 +55,6 @@ void addfd(int epollfd, int fd, bool one_shot, int trig_mode)
         event.events |= EPOLLONESHOT;
     }
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    setnonblocking(fd);
 }
 
 // 删除fd上的所有注册事件
@@ -61,6 +80,42 @@ void modfd(int epollfd, int fd, int ev)
 
 int http_conn::m_user_count = 0;
 int http_conn::m_epollfd = -1;
+threadpool<file_task> *http_conn::m_file_pool = NULL;
+completion_queue *http_conn::m_completions = NULL;
+tls_context *http_conn::m_tls = NULL;
+http_conn::body_handler http_conn::m_default_body_handler = http_conn::spool_body;
+const router *http_conn::m_router = NULL;
+long long http_conn::m_request_count = 0;
+long long http_conn::m_inline_count = 0;
+long long http_conn::m_offload_count = 0;
+stat_cache http_conn::m_stat_cache;
+stat_cache http_conn::m_negative_cache(http_conn::NEGATIVE_TTL_US);
+client_limits http_conn::m_client_limits;
+int http_conn::m_root_fd = -1;
+int http_conn::m_root_refs = 0;
+std::vector<std::pair<int, int> > http_conn::m_retired_roots;
+locker http_conn::m_root_lock;
+int http_conn::m_read_buffer_size = http_conn::READ_BUFFER_SIZE;
+int http_conn::m_write_buffer_size = http_conn::WRITE_BUFFER_SIZE;
+bool http_conn::m_draining = false;
+int http_conn::m_keep_alive_timeout = 15;
+int http_conn::m_keep_alive_requests = 1000;
+int http_conn::m_header_timeout = 10;
+int http_conn::m_body_timeout = 15;
+int http_conn::m_send_timeout = 15;
+int http_conn::m_send_min_rate = 1024;
+
+http_conn::~http_conn()
+{
+    delete m_h2;
+    if (m_ssl)
+    {
+        tls_context::release(m_ssl);
+    }
+    delete[] m_read_buf;
+    delete[] m_write_buf;
+    delete[] m_chunk_buf;
+}
 
 void http_conn::close_conn(bool real_close)
 {
@@ -73,40 +128,203 @@ void http_conn::close_conn(bool real_close)
     }
 }
 
+void http_conn::abort_conn()
+{
+    if (m_sockfd != -1)
+    {
+        struct linger tmp = {1, 0};
+        setsockopt(m_sockfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
+    }
+}
+
+void http_conn::on_closed()
+{
+    delete m_h2; // 还在工作线程中的请求处理完后自行释放
+    m_h2 = NULL;
+}
+
+bool http_conn::idle() const
+{
+    return m_read_idx == 0 && (!m_h2 || m_h2->idle());
+}
+
+int http_conn::keep_alive_timeout() const
+{
+    int timeout = __atomic_load_n(&m_keep_alive_timeout, __ATOMIC_RELAXED);
+    return m_client_timeout > 0 && m_client_timeout < timeout ? m_client_timeout : timeout;
+}
+
+// 各阶段的超时：
+// 等待下一个请求：keep_alive_timeout，从上一个响应发完算起
+// 接收请求行和头部：从第一块数据(新连接从建立时)算起header_timeout，每隔几秒发一个字节也无法延长(slowloris)
+// 接收消息体：body_timeout内没有读到数据
+// 发送响应：send_timeout内没有写出数据，或开始发送send_timeout之后平均速率低于send_min_rate(慢读，占着映射的文件)
+// HTTP/2连接没有请求时按保持连接，有输出未写完时按发送，其余按消息体(各请求的头部和消息体交错在同一连接上)
+long long http_conn::deadline(long long now)
+{
+    if (m_in_flight) // 不能读其他成员 工作线程正在修改它们；完成项执行后再按所处的阶段计算
+    {
+        return std::numeric_limits<long long>::max();
+    }
+    // 超时参数以秒为单位
+    long long send_timeout = __atomic_load_n(&m_send_timeout, __ATOMIC_RELAXED) * 1000LL;
+    long long body_timeout = __atomic_load_n(&m_body_timeout, __ATOMIC_RELAXED) * 1000LL;
+    if (m_h2)
+    {
+        if (m_h2->idle())
+        {
+            return now + keep_alive_timeout() * 1000LL;
+        }
+        return now + (m_h2->sending() ? send_timeout : body_timeout);
+    }
+    if (iov_pending() > 0 || stream_pending())
+    {
+        long long expire = now + send_timeout;
+        int min_rate = __atomic_load_n(&m_send_min_rate, __ATOMIC_RELAXED);
+        if (min_rate > 0 && m_send_start + send_timeout + m_sent * 1000 / min_rate < expire)
+        {
+            expire = m_send_start + send_timeout + m_sent * 1000 / min_rate;
+        }
+        return expire;
+    }
+    if (m_read_idx == 0 && m_served > 0)
+    {
+        return now + keep_alive_timeout() * 1000LL;
+    }
+    if (m_check_state == CHECK_STATE_CONTENT)
+    {
+        return now + body_timeout;
+    }
+    if (m_request_start == 0)
+    {
+        m_request_start = now;
+    }
+    return m_request_start + __atomic_load_n(&m_header_timeout, __ATOMIC_RELAXED) * 1000LL;
+}
+
 void http_conn::init(int sockfd, const sockaddr_in &addr, int trig_mode)
 {
     m_sockfd = sockfd;
     m_address = addr;
-    int error = 0;
-    socklen_t len = sizeof(error);
-    getsockopt(m_sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
-    int reuse = 1;
-    setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    addfd(m_epollfd, sockfd, true, trig_mode);
+    // 上一个使用该fd的连接的TLS状态 连接关闭时只关闭了fd，到这里才释放
+    if (m_ssl)
+    {
+        tls_context::release(m_ssl);
+        m_ssl = NULL;
+    }
+    if (m_tls)
+    {
+        m_ssl = m_tls->accept(sockfd);
+    }
+    // 缓冲区在fd第一次被使用时分配 之后随连接对象复用 未用到的fd不占内存
+    if (!m_read_buf)
+    {
+        m_read_buf = new char[m_read_buffer_size];
+        m_write_buf = new char[m_write_buffer_size];
+    }
+    // connfd由accept4创建时已是非阻塞的 SO_REUSEADDR只对监听socket有意义
+    // io_uring后端不使用epoll，此时m_epollfd为-1
+    if (m_epollfd >= 0)
+    {
+        addfd(m_epollfd, sockfd, true, trig_mode);
+    }
     m_user_count++;
+    m_in_flight = false;
+    ++m_generation;
+    m_served = 0;
+    m_client_timeout = 0;
+    m_client_max = 0;
+
+    init();
+    m_request_start = monotonic_ms(); // 连接建立后第一个请求的头部也要在header_timeout内收完
+}
 
+void http_conn::init_stream(const http_conn &parent, h2_stream *stream)
+{
+    m_sockfd = parent.m_sockfd;
+    m_address = parent.m_address;
+    m_stream = stream;
+    m_generation = parent.m_generation;
+    m_served = 0;
+    m_client_timeout = 0;
+    m_client_max = 0;
+    m_read_buf = new char[m_read_buffer_size];
+    m_write_buf = new char[m_write_buffer_size];
     init();
 }
 
-void http_conn::init()
+void http_conn::init(int kept)
 {
     m_check_state = CHECK_STATE_REQUESTLINE;
     m_linger = false;
 
     m_method = GET;
     m_url = 0;
+    m_index = false;
     m_version = 0;
+    m_http10 = false;
     m_content_length = 0;
     m_host = 0;
     m_start_line = 0;
     m_checked_idx = 0;
-    m_read_idx = 0;
+    m_read_idx = kept;
+    m_pipelined = kept > 0;
     m_write_idx = 0;
-    memset(m_read_buf, '\0', READ_BUFFER_SIZE);
-    memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
+    m_file_address = 0;
+    m_iv_count = 0;
+    m_request_start = 0;
+    m_send_start = 0;
+    m_sent = 0;
+
+    m_chunked = false;
+    m_has_length = false;
+    m_expect_continue = false;
+    m_body_done = false;
+    m_body_start = 0;
+    m_body_received = 0;
+    m_chunk_state = CHUNK_SIZE;
+    m_chunk_left = 0;
+    m_body_handler = NULL;
+    std::string().swap(m_body); // 连接可能长期空闲 不保留上一个请求消息体的内存
+    if (m_body_fd >= 0)
+    {
+        close(m_body_fd);
+        m_body_fd = -1;
+    }
+    m_dynamic_status = 200;
+    m_dynamic_title = ok_200_title;
+    m_dynamic_body.clear();
+    m_dynamic_headers.clear();
+    m_route = NULL;
+    m_params.count = 0;
+    delete[] m_chunk_buf;
+    m_chunk_buf = NULL;
+    m_producer = NULL;
+    m_stream_sent = 0;
+    m_inline = false;
+    m_offloaded = NO_REQUEST;
+
+    memset(m_read_buf + kept, '\0', m_read_buffer_size - kept);
+    memset(m_write_buf, '\0', m_write_buffer_size);
     memset(m_real_file, '\0', FILENAME_LEN);
 }
 
+// 上一个请求在m_checked_idx处结束 之后已读入的数据是客户端不等响应就发来的后续请求，移到读缓冲区开头
+bool http_conn::next_request()
+{
+    int kept = m_read_idx - m_checked_idx;
+    if (kept > 0)
+    {
+        memmove(m_read_buf, m_read_buf + m_checked_idx, kept);
+    }
+    else
+    {
+        kept = 0;
+    }
+    init(kept);
+    return kept > 0;
+}
+
 // 从状态机
 http_conn::LINE_STATUS http_conn::parse_line()
 {
@@ -148,11 +366,40 @@ http_conn::LINE_STATUS http_conn::parse_line()
     return LINE_OPEN; // 最后一个不是换行或回车符
 }
 
+ssize_t http_conn::recv_some(char *buf, int len)
+{
+    if (m_ssl)
+    {
+        return tls_context::recv(m_ssl, buf, len);
+    }
+    if (m_tls) // 创建TLS状态失败 不能以明文继续
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    return recv(m_sockfd, buf, len, 0);
+}
+
+ssize_t http_conn::writev_some(const struct iovec *iov, int count)
+{
+    if (m_ssl)
+    {
+        return tls_context::writev(m_ssl, iov, count);
+    }
+    return writev(m_sockfd, iov, count);
+}
+
 // 非阻塞读操作
 bool http_conn::read()
 {
+    // 先解析上一个请求之后已读入的数据 之后的数据在重新监听可读后再读
+    if (m_pipelined)
+    {
+        m_pipelined = false;
+        return true;
+    }
     // 开始读的字节序号=客户数据的结尾后一个>=读缓冲区了 --> 越界错误？
-    if (m_read_idx >= READ_BUFFER_SIZE)
+    if (m_read_idx >= m_read_buffer_size)
     {
         return false;
     }
@@ -163,20 +410,32 @@ bool http_conn::read()
     {
         // LT读
         printf("LT读\n");
-        bytes_read = recv(m_sockfd,m_read_buf+m_read_idx,READ_BUFFER_SIZE-m_read_idx,0);
-        m_read_idx += bytes_read;
+        bytes_read = recv_some(m_read_buf + m_read_idx, m_read_buffer_size - m_read_idx);
+        // TLS握手还在进行或只收到了记录的一部分 没有可交给应用的数据；HTTP/2连接读满缓冲区后再读时内核中可能已经没有数据
+        if (bytes_read == -1 && errno == EAGAIN)
+        {
+            return true;
+        }
         if (bytes_read <= 0)// 0:被关闭 -1:出错
         {
             return false;
         }
+        m_read_idx += bytes_read;
     }
     else
     {
         // ET写 确保把socket读缓冲区中的所有数据读出
         while (true)
         {
+            // 读缓冲区已满(通常是消息体还在陆续到达) 剩余数据留在内核中
+            // 工作线程回收已处理的消息体后会重置EPOLLONESHOT，那时会再次触发可读事件
+            // TLS连接留在OpenSSL中的已解密数据不会触发可读事件 见read_pending
+            if (m_read_idx >= m_read_buffer_size)
+            {
+                break;
+            }
             // recv是否阻塞是根据socket是否阻塞，这里是非阻塞
-            bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+            bytes_read = recv_some(m_read_buf + m_read_idx, m_read_buffer_size - m_read_idx);
             if (bytes_read == -1) // 读失败
             {
                 if (errno == EAGAIN || errno == EWOULDBLOCK) // 缓冲区空 全部被读完了
@@ -208,10 +467,26 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
     *m_url++ = '\0'; // 截断字符串
 
     char *method = text;
-    if (strcasecmp(method, "GET") == 0) // 仅支持GET方法
+    if (strcasecmp(method, "GET") == 0)
     {
         m_method = GET;
     }
+    else if (strcasecmp(method, "POST") == 0)
+    {
+        m_method = POST;
+    }
+    else if (strcasecmp(method, "PUT") == 0)
+    {
+        m_method = PUT;
+    }
+    else if (strcasecmp(method, "HEAD") == 0)
+    {
+        m_method = HEAD;
+    }
+    else if (strcasecmp(method, "OPTIONS") == 0)
+    {
+        m_method = OPTIONS;
+    }
     else
     {
         printf("不支持%s方法\n", method);
@@ -230,11 +505,15 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
     }
     *m_version++ = '\0';
     m_version += strspn(m_version, " \t");
-    if (strcasecmp(m_version, "HTTP/1.1") != 0)
+    // 1.x中更高的次版本按1.1处理；其他主版本回505
+    if (strncasecmp(m_version, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)m_version[7]) ||
+        m_version[7 + strspn(m_version + 7, "0123456789")] != '\0')
     {
-        printf("Only supports HTTP/1.1 and your request is %s\n", m_version);
-        return BAD_REQUEST;
+        printf("Only supports HTTP/1.0 and HTTP/1.1 and your request is %s\n", m_version);
+        return strncasecmp(m_version, "HTTP/", 5) == 0 ? VERSION_NOT_SUPPORTED : BAD_REQUEST;
     }
+    m_http10 = atoi(m_version + 7) == 0;
+    m_linger = !m_http10; // HTTP/1.1默认保持连接 可被Connection头部改变
 
     if (strncasecmp(m_url, "http://", 7) == 0)
     {
@@ -242,6 +521,11 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
         m_url = strchr(m_url, '/'); // 在参数 str 所指向的字符串中搜索第一次出现字符 c（一个无符号字符）的位置
     }
 
+    if (m_url && m_method == OPTIONS && strcmp(m_url, "*") == 0) // 询问整个服务器支持的方法
+    {
+        m_check_state = CHECK_STATE_HEADER;
+        return NO_REQUEST;
+    }
     if (!m_url || m_url[0] != '/')
     {
         printf("! m_url || m_url[ 0 ] != '/'\n");
@@ -257,33 +541,100 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
     // 遇到空行，表示头部字段解析完毕
     if (text[0] == '\0')
     {
-        if (m_method == HEAD)
-        {
-            return GET_REQUEST;
-        }
-        // 请求有消息体，则还需读取CHECK_STATE_CONTENT字节的消息体，状态机转到CHECK_STATE_CONTENT状态
-        if (m_content_length != 0)
+        HTTP_CODE ret = route_request();
+        // 处理回调和消息体的耗时无法预知 内联解析到此为止 工作线程从end_of_headers继续
+        if (m_inline && ret == NO_REQUEST && (m_route || m_chunked || m_content_length != 0))
         {
-            m_check_state = CHECK_STATE_CONTENT;
-            return NO_REQUEST;
+            return OFFLOAD_REQUEST;
         }
-        // 否则已经得到了完整的请求
-        return GET_REQUEST;
+        return end_of_headers(ret);
     }
     else if (strncasecmp(text, "Connection:", 11) == 0)
     {
+        // 逗号分隔的选项 close优先于keep-alive
+        bool close = false, keep = false;
         text += 11;
-        text += strspn(text, " \t");
-        if (strcasecmp(text, "keep-alive") == 0)
+        while (*text)
+        {
+            text += strspn(text, " \t,");
+            int len = strcspn(text, " \t,");
+            close = close || (len == 5 && strncasecmp(text, "close", 5) == 0);
+            keep = keep || (len == 10 && strncasecmp(text, "keep-alive", 10) == 0);
+            text += len;
+        }
+        if (close)
+        {
+            m_linger = false;
+        }
+        else if (keep)
         {
             m_linger = true;
         }
     }
+    else if (strncasecmp(text, "Keep-Alive:", 11) == 0)
+    {
+        parse_keep_alive(text + 11);
+    }
     else if (strncasecmp(text, "Content-Length:", 15) == 0)
     {
         text += 15;
         text += strspn(text, " \t");
-        m_content_length = atol(text);
+        char *end = NULL;
+        errno = 0;
+        long long length = strtoll(text, &end, 10);
+        if (end == text || *end != '\0' || errno != 0 || length < 0)
+        {
+            return BAD_REQUEST;
+        }
+        // 与Transfer-Encoding同时出现或重复出现时无法确定消息边界 拒绝以免被用来夹带请求
+        if (m_chunked || m_has_length)
+        {
+            return BAD_REQUEST;
+        }
+        m_has_length = true;
+        m_content_length = length;
+    }
+    else if (strncasecmp(text, "Transfer-Encoding:", 18) == 0)
+    {
+        // 逗号分隔的编码列表 chunked必须恰好是最后一种编码且只出现一次 其他编码无法确定消息体的长度
+        if (m_chunked || m_has_length)
+        {
+            return BAD_REQUEST;
+        }
+        text += 18;
+        bool last_chunked = false;
+        while (*text)
+        {
+            text += strspn(text, " \t,");
+            if (*text == '\0')
+            {
+                break;
+            }
+            int len = strcspn(text, ",");
+            int end = len;
+            while (end > 0 && (text[end - 1] == ' ' || text[end - 1] == '\t'))
+            {
+                --end;
+            }
+            bool chunked = end == 7 && strncasecmp(text, "chunked", 7) == 0;
+            if (last_chunked)
+            {
+                return BAD_REQUEST;
+            }
+            last_chunked = chunked;
+            text += len;
+        }
+        if (!last_chunked)
+        {
+            return BAD_REQUEST;
+        }
+        m_chunked = true;
+    }
+    else if (strncasecmp(text, "Expect:", 7) == 0)
+    {
+        text += 7;
+        text += strspn(text, " \t");
+        m_expect_continue = strcasecmp(text, "100-continue") == 0 && !m_http10; // HTTP/1.0客户端不认识100响应
     }
     else if (strncasecmp(text, "Host:", 5) == 0)
     {
@@ -299,123 +650,918 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
     return NO_REQUEST;
 }
 
-// 没有真正的解析http请求的消息体，只是判断它是否被完整的读入了
-http_conn::HTTP_CODE http_conn::parse_content(char *text)
+// 客户端的Keep-Alive头部：timeout=秒数, max=请求数(旧客户端只发一个秒数) 只采纳比本端更小的值
+void http_conn::parse_keep_alive(const char *text)
+{
+    while (*text)
+    {
+        text += strspn(text, " \t,");
+        int len = strcspn(text, ",");
+        int value = 0;
+        if (strncasecmp(text, "timeout=", 8) == 0 || isdigit((unsigned char)*text))
+        {
+            value = atoi(text + (isdigit((unsigned char)*text) ? 0 : 8));
+            if (value > 0 && (m_client_timeout == 0 || value < m_client_timeout))
+            {
+                m_client_timeout = value;
+            }
+        }
+        else if (strncasecmp(text, "max=", 4) == 0)
+        {
+            value = atoi(text + 4);
+            if (value > 0 && (m_client_max == 0 || value < m_client_max))
+            {
+                m_client_max = value;
+            }
+        }
+        text += len;
+    }
+}
+
+// 允许的请求方法掩码对应的Allow头部
+static std::string allow_header(int allowed)
 {
-    if (m_read_idx >= (m_content_length + m_checked_idx))
+    static const char *names[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH"};
+    std::string allow = "Allow:";
+    for (int m = http_conn::GET; m <= http_conn::PATCH; ++m)
     {
-        text[m_content_length] = '\0';
-        return GET_REQUEST;
+        if (allowed & (1 << m))
+        {
+            allow += allow.size() > 6 ? ", " : " ";
+            allow += names[m];
+        }
     }
+    allow += "\r\n";
+    return allow;
+}
 
-    return NO_REQUEST;
+// 头部解析完毕后查找路由 决定消息体交给谁处理
+// 没有匹配的动态路由时，GET和HEAD请求访问静态文件，OPTIONS回答允许的方法，其他方法回405
+// 头部解析完毕 route_ret为路由匹配的结果：有消息体时开始接收，否则请求已经完整
+http_conn::HTTP_CODE http_conn::end_of_headers(HTTP_CODE route_ret)
+{
+    if (route_ret != NO_REQUEST)
+    {
+        if (m_chunked || m_content_length != 0)
+        {
+            m_linger = false; // 不读消息体就响应 连接上剩下的数据无法再解析
+        }
+        return route_ret;
+    }
+    // 请求有消息体，则还需读取消息体，状态机转到CHECK_STATE_CONTENT状态
+    if (m_chunked || m_content_length != 0)
+    {
+        if (m_content_length > MAX_BODY_SIZE)
+        {
+            m_linger = false; // 不读消息体就响应 连接上剩下的数据无法再解析
+            return PAYLOAD_TOO_LARGE;
+        }
+        m_check_state = CHECK_STATE_CONTENT;
+        m_body_start = m_checked_idx;
+        // 客户端在等待许可后才会发送消息体
+        if (m_expect_continue && m_read_idx == m_checked_idx)
+        {
+            send_continue();
+        }
+        return NO_REQUEST;
+    }
+    // 否则已经得到了完整的请求
+    return finish_body();
 }
 
-// 主状态机 分析http请求的入口函数
-http_conn::HTTP_CODE http_conn::process_read()
+http_conn::HTTP_CODE http_conn::route_request()
 {
-    // 记录当前行的读取状态
-    LINE_STATUS line_status = LINE_OK;
-    // 记录http请求的处理结果
-    HTTP_CODE ret = NO_REQUEST;
-    char *text = 0;
+    __atomic_add_fetch(&m_request_count, 1, __ATOMIC_RELAXED);
+    // 连接上的请求数到达本端或客户端的上限 这个响应之后关闭
+    ++m_served;
+    int max = __atomic_load_n(&m_keep_alive_requests, __ATOMIC_RELAXED);
+    if ((max > 0 && m_served >= max) || (m_client_max > 0 && m_served >= m_client_max))
+    {
+        m_linger = false;
+    }
+    if (!m_client_limits.request(m_address.sin_addr.s_addr)) // 该IP的令牌已用完
+    {
+        return TOO_MANY_REQUESTS;
+    }
+    int allowed = 0;
+    m_route = m_router ? m_router->match(m_method, m_url, m_params, allowed) : NULL;
+    if (!m_route && m_router && m_method == HEAD) // HEAD按GET的路由处理 响应不带消息体
+    {
+        m_route = m_router->match(GET, m_url, m_params, allowed);
+    }
+    if (m_route)
+    {
+        m_body_handler = m_route->body;
+        if (!m_body_handler && (m_method == POST || m_method == PUT))
+        {
+            m_body_handler = m_default_body_handler;
+        }
+        return NO_REQUEST;
+    }
+    if (allowed == 0) // 路径上没有动态路由 只能访问静态文件
+    {
+        if (m_method == GET || m_method == HEAD)
+        {
+            return NO_REQUEST;
+        }
+        allowed = 1 << GET;
+    }
+    if (allowed & (1 << GET))
+    {
+        allowed |= 1 << HEAD;
+    }
+    allowed |= 1 << OPTIONS;
 
-    // (正在分析消息主体 && 读到了完整行) || (正在分析请求行或者头部，那就使用从状态机读一行看是否完整)
-    while (((m_check_state == CHECK_STATE_CONTENT) && (line_status == LINE_OK)) 
-        || ((line_status = parse_line()) == LINE_OK))
+    if (m_method == OPTIONS)
     {
-        text = get_line();            // 获取当前要读的行的起始位置
-        m_start_line = m_checked_idx; // 记录下一行的起始位置
-        printf("got 1 http line: %s\n", text);
+        return respond(200, ok_200_title, std::string(), allow_header(allowed));
+    }
+    return respond(405, error_405_title, error_405_form, allow_header(allowed));
+}
 
-        switch (m_check_state)
+std::string http_conn::param(const char *name) const
+{
+    for (int i = 0; i < m_params.count; ++i)
+    {
+        if (strcmp(m_params.name[i], name) == 0)
         {
-        case CHECK_STATE_REQUESTLINE: // 分析请求行
+            return std::string(m_params.value[i], m_params.len[i]);
+        }
+    }
+    return std::string();
+}
+
+// 解析消息体：按Content-Length或chunked编码把已读入的部分交给处理回调
+// 交出去的字节占用的读缓冲区空间随即回收，所以任意长度的消息体都只需要固定大小的读缓冲区
+http_conn::HTTP_CODE http_conn::parse_content()
+{
+    HTTP_CODE ret = NO_REQUEST;
+    bool more = true; // 读缓冲区中是否还有可以继续解析的数据
+    while (more && ret == NO_REQUEST)
+    {
+        long long avail = m_read_idx - m_checked_idx;
+        if (!m_chunked)
         {
-            ret = parse_request_line(text);
-            // printf("m_url:%s\n",m_url);
-            if (ret == BAD_REQUEST) // 请求不完整
+            long long left = m_content_length - m_body_received;
+            ret = deliver_body(avail < left ? avail : left);
+            if (ret == NO_REQUEST && m_body_received == m_content_length)
             {
-                printf("BAD_REQUEST:request line 不完整\n");
-                return BAD_REQUEST;
+                ret = finish_body();
             }
-            break; // 请求行解析完成 开始解析头部字段
+            break;
         }
-        case CHECK_STATE_HEADER: // 分析头部字段
+
+        switch (m_chunk_state)
         {
-            ret = parse_headers(text);
-            if (ret == BAD_REQUEST) // 请求不完整
+        case CHUNK_SIZE: // 十六进制的块大小 后面可能带有;开头的扩展
+        {
+            LINE_STATUS line_status = parse_line();
+            if (line_status != LINE_OK)
+            {
+                if (line_status == LINE_BAD)
+                {
+                    return BAD_REQUEST;
+                }
+                more = false;
+                break;
+            }
+            char *text = get_line();
+            m_start_line = m_checked_idx;
+            char *end = NULL;
+            errno = 0;
+            long long size = strtoll(text, &end, 16);
+            if (end == text || errno != 0 || size < 0 || (*end != '\0' && *end != ';' && *end != ' ' && *end != '\t'))
             {
-                printf("BAD_REQUEST:header 不完整\n");
                 return BAD_REQUEST;
             }
-            else if (ret == GET_REQUEST) // 获得了完整的客户请求
+            if (size > MAX_BODY_SIZE - m_body_received)
             {
-                // content为空的情况
-                return do_request();
+                return PAYLOAD_TOO_LARGE;
             }
+            m_chunk_left = size;
+            m_chunk_state = size ? CHUNK_DATA : CHUNK_TRAILER; // 长度为0的块表示消息体结束
             break;
         }
-        case CHECK_STATE_CONTENT: // 分析消息主体
+        case CHUNK_DATA:
         {
-            ret = parse_content(text);
-            if (ret == GET_REQUEST) // 获得了完整的客户请求
+            long long len = avail < m_chunk_left ? avail : m_chunk_left;
+            m_chunk_left -= len;
+            ret = deliver_body(len);
+            if (m_chunk_left)
             {
-                return do_request();
+                more = false; // 块数据还没有收全
+            }
+            else
+            {
+                m_chunk_state = CHUNK_DATA_END;
             }
-            line_status = LINE_OPEN; // 行数据尚不完整
             break;
         }
-        default:
+        case CHUNK_DATA_END:
+        case CHUNK_TRAILER: // 尾部字段被忽略 以空行结束
         {
-            printf("INTERNAL_ERROR\n");
-            return INTERNAL_ERROR;
+            LINE_STATUS line_status = parse_line();
+            if (line_status != LINE_OK)
+            {
+                if (line_status == LINE_BAD)
+                {
+                    return BAD_REQUEST;
+                }
+                more = false;
+                break;
+            }
+            char *text = get_line();
+            m_start_line = m_checked_idx;
+            if (m_chunk_state == CHUNK_DATA_END)
+            {
+                if (text[0] != '\0')
+                {
+                    return BAD_REQUEST;
+                }
+                m_chunk_state = CHUNK_SIZE;
+            }
+            else if (text[0] == '\0')
+            {
+                ret = finish_body();
+            }
+            break;
         }
         }
     }
 
-    printf("NO_REQUEST\n");
-    return NO_REQUEST;
+    if (ret == NO_REQUEST)
+    {
+        compact_body();
+    }
+    return ret;
 }
 
-// 当得到一个完整、正确的http请求时，分析目标文件的属性
-http_conn::HTTP_CODE http_conn::do_request()
+// 把读缓冲区中接下来的len字节消息体交给处理回调
+http_conn::HTTP_CODE http_conn::deliver_body(int len)
 {
-    strcpy(m_real_file, doc_root);
-    int len = strlen(doc_root);
-    // 将m_url复制到doc_root后面
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
-    // 取得m_real_file文件属性，文件属性存储在结构体m_file_stat里
-    // printf("m_real_file:%s\n",m_real_file);
-    if (stat(m_real_file, &m_file_stat) < 0) // 获取失败返回-1 目标文件不存在
+    const char *data = m_read_buf + m_checked_idx;
+    m_checked_idx += len;
+    m_start_line = m_checked_idx;
+    m_body_received += len;
+    if (!m_body_handler || len == 0)
     {
-        printf("NO_RESOURCE\n");
-        return NO_RESOURCE;
+        return NO_REQUEST;
     }
+    return m_body_handler(this, data, len);
+}
 
-    if (!(m_file_stat.st_mode & S_IROTH)) // ！目标文件对所有用户可读
+// 消息体接收完毕(没有消息体的请求在头部解析完后直接到这里) 交给路由的处理函数
+// 没有路由的请求(如带消息体的GET)照常访问目标文件
+http_conn::HTTP_CODE http_conn::finish_body()
+{
+    m_body_done = true;
+    if (m_body_handler)
     {
-        printf("FORBIDDEN_REQUEST\n");
-        return FORBIDDEN_REQUEST;
+        HTTP_CODE ret = m_body_handler(this, NULL, 0);
+        if (ret != NO_REQUEST)
+        {
+            return ret;
+        }
     }
+    return m_route ? m_route->handler(this) : GET_REQUEST;
+}
 
-    if (S_ISDIR(m_file_stat.st_mode)) // 目标文件是目录
+// 回收读缓冲区中已交给处理回调的消息体 尚未解析完的部分(如不完整的块大小行)移到消息体的起始位置
+void http_conn::compact_body()
+{
+    int consumed = m_start_line - m_body_start;
+    if (consumed <= 0)
     {
-        printf("BAD_REQUEST:目标文件是目录\n");
-        return BAD_REQUEST;
+        return;
     }
-
-    int fd = open(m_real_file, O_RDONLY);
-    // 使用mmap将目标文件映射到内存地址m_file_address处
-    m_file_address = (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
-    // 告诉调用者获取文件成功
-    printf("FILE_REQUEST:成功获取目标资源\n");
-    return FILE_REQUEST;
+    memmove(m_read_buf + m_body_start, m_read_buf + m_start_line, m_read_idx - m_start_line);
+    m_read_idx -= consumed;
+    m_checked_idx -= consumed;
+    m_start_line = m_body_start;
 }
 
-// 释放内存
-void http_conn::unmap()
+// 允许客户端发送消息体 此时连接上还没有任何响应，发送缓冲区是空的，非阻塞地写一次即可
+void http_conn::send_continue()
+{
+    static const char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    if (m_ssl)
+    {
+        struct iovec iv = {(void *)continue_line, sizeof(continue_line) - 1};
+        writev_some(&iv, 1);
+        return;
+    }
+    send(m_sockfd, continue_line, sizeof(continue_line) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// 创建转存消息体的临时文件 文件没有名字，关闭后自动删除
+static int open_spool_file()
+{
+    int fd = open(spool_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0)
+    {
+        return fd;
+    }
+    // 文件系统不支持O_TMPFILE时退回mkostemp 创建后立即删除名字
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s/lwc_body_XXXXXX", spool_dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd >= 0)
+    {
+        unlink(path);
+    }
+    return fd;
+}
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool http_conn::spool(const char *data, int len)
+{
+    if (m_body_fd < 0)
+    {
+        if (m_body.size() + len <= (size_t)BODY_MEMORY_SIZE)
+        {
+            m_body.append(data, len);
+            return true;
+        }
+        m_body_fd = open_spool_file();
+        if (m_body_fd < 0 || !write_all(m_body_fd, m_body.data(), m_body.size()))
+        {
+            printf("转存消息体失败\n");
+            return false;
+        }
+        std::string().swap(m_body);
+    }
+    return write_all(m_body_fd, data, len);
+}
+
+http_conn::HTTP_CODE http_conn::respond(int status, const char *title, const std::string &content,
+                                        const std::string &headers)
+{
+    m_dynamic_status = status;
+    m_dynamic_title = title;
+    m_dynamic_body = content;
+    m_dynamic_headers = headers;
+    return DYNAMIC_REQUEST;
+}
+
+// 路由没有指定消息体处理回调时使用：接收并保存消息体，由路由的处理函数通过body()/body_fd()读取
+http_conn::HTTP_CODE http_conn::spool_body(http_conn *conn, const char *data, int len)
+{
+    if (data && !conn->spool(data, len))
+    {
+        return INTERNAL_ERROR;
+    }
+    return NO_REQUEST;
+}
+
+// 主状态机 分析http请求的入口函数
+// 返回GET_REQUEST表示得到了完整的请求 目标文件的访问(do_request)交给调用方决定同步还是异步进行
+http_conn::HTTP_CODE http_conn::process_read()
+{
+    // 记录当前行的读取状态
+    LINE_STATUS line_status = LINE_OK;
+    // 记录http请求的处理结果
+    HTTP_CODE ret = NO_REQUEST;
+    char *text = 0;
+    m_pipelined = false;
+
+    // 正在分析请求行或者头部，使用从状态机读一行看是否完整
+    while ((m_check_state != CHECK_STATE_CONTENT) && ((line_status = parse_line()) == LINE_OK))
+    {
+        text = get_line();            // 获取当前要读的行的起始位置
+        m_start_line = m_checked_idx; // 记录下一行的起始位置
+        printf("got 1 http line: %s\n", text);
+
+        switch (m_check_state)
+        {
+        case CHECK_STATE_REQUESTLINE: // 分析请求行
+        {
+            ret = parse_request_line(text);
+            // printf("m_url:%s\n",m_url);
+            if (ret != NO_REQUEST) // 请求行有误或版本不支持
+            {
+                printf("BAD_REQUEST:request line 不完整\n");
+                return ret;
+            }
+            break; // 请求行解析完成 开始解析头部字段
+        }
+        case CHECK_STATE_HEADER: // 分析头部字段
+        {
+            ret = parse_headers(text);
+            if (ret == BAD_REQUEST) // 请求不完整
+            {
+                printf("BAD_REQUEST:header 不完整\n");
+                return BAD_REQUEST;
+            }
+            else if (ret != NO_REQUEST) // 获得了完整的客户请求(content为空的情况)或者出错
+            {
+                return ret;
+            }
+            break;
+        }
+        default:
+        {
+            printf("INTERNAL_ERROR\n");
+            return INTERNAL_ERROR;
+        }
+        }
+    }
+
+    // 分析消息主体 消息体不经过从状态机 按长度或块编码直接交给处理回调
+    if (m_check_state == CHECK_STATE_CONTENT)
+    {
+        ret = parse_content();
+        // 消息体没有读完请求就结束了(出错或处理回调提前给出了结果) 剩余部分无法跳过 响应后关闭连接
+        if (ret != NO_REQUEST && !m_body_done)
+        {
+            m_linger = false;
+        }
+        return ret;
+    }
+
+    printf("NO_REQUEST\n");
+    return NO_REQUEST;
+}
+
+// 当得到一个完整、正确的http请求时，打开目标文件并分析其属性
+// 文件相对doc_root的目录fd打开，路径只解析一次；属性由fstat从已打开的文件取得
+http_conn::HTTP_CODE http_conn::do_request()
+{
+    HTTP_CODE ret = locate_file();
+    while (ret == NO_REQUEST)
+    {
+        struct stat st;
+        if (m_negative_cache.lookup(m_real_file, st))
+        {
+            return NO_RESOURCE;
+        }
+        int fd = open_file();
+        if (fd < 0)
+        {
+            return open_failed(errno);
+        }
+        if (fstat(fd, &m_file_stat) < 0)
+        {
+            close(fd);
+            return INTERNAL_ERROR;
+        }
+        m_stat_cache.insert(m_real_file, m_file_stat);
+
+        if (S_ISDIR(m_file_stat.st_mode) && !m_index) // 目录 改为访问其中的索引文件
+        {
+            close(fd);
+            ret = resolve_index();
+            continue;
+        }
+        ret = check_file();
+        if (ret == FILE_REQUEST && m_method != HEAD) // HEAD只需要元数据 不映射文件
+        {
+            ret = map_file(fd, true);
+        }
+        close(fd);
+    }
+    return ret;
+}
+
+// 尽量不访问文件系统就得到结果：已知不存在的路径直接404，HEAD请求在元数据缓存命中时直接响应
+// 不需要交给阻塞I/O线程 缓存未命中返回NO_REQUEST
+http_conn::HTTP_CODE http_conn::lookup_cache()
+{
+    HTTP_CODE ret = locate_file();
+    while (ret == NO_REQUEST)
+    {
+        struct stat st;
+        if (m_negative_cache.lookup(m_real_file, st))
+        {
+            return NO_RESOURCE;
+        }
+        if (m_method != HEAD || !m_stat_cache.lookup(m_real_file, m_file_stat))
+        {
+            return NO_REQUEST;
+        }
+        if (!S_ISDIR(m_file_stat.st_mode) || m_index)
+        {
+            return check_file();
+        }
+        ret = resolve_index();
+    }
+    return ret;
+}
+
+// 内联快速路径：元数据缓存命中、不超过INLINE_FILE_SIZE且页面都在page cache中的文件，在事件循环中直接打开并映射
+// 缓存命中说明路径最近刚被解析过，open和fstat不会读盘；有一页不在内存中就交给工作线程，writev不会在事件循环中缺页
+// 条件不满足时返回NO_REQUEST
+http_conn::HTTP_CODE http_conn::map_cached()
+{
+    HTTP_CODE ret = locate_file();
+    while (ret == NO_REQUEST)
+    {
+        if (!m_stat_cache.lookup(m_real_file, m_file_stat))
+        {
+            return NO_REQUEST;
+        }
+        if (S_ISDIR(m_file_stat.st_mode) && !m_index)
+        {
+            ret = resolve_index();
+            continue;
+        }
+        if (check_file() != FILE_REQUEST || m_file_stat.st_size > INLINE_FILE_SIZE)
+        {
+            return NO_REQUEST; // 错误响应也交给工作线程 由它确认文件的当前状态
+        }
+        int fd = open_file();
+        if (fd < 0)
+        {
+            return NO_REQUEST;
+        }
+        // 缓存的元数据可能已经过时 以打开的文件为准
+        if (fstat(fd, &m_file_stat) < 0 || check_file() != FILE_REQUEST || m_file_stat.st_size > INLINE_FILE_SIZE)
+        {
+            close(fd);
+            return NO_REQUEST;
+        }
+        m_stat_cache.insert(m_real_file, m_file_stat);
+        ret = map_file(fd, false);
+        close(fd);
+        if (ret == FILE_REQUEST && !resident())
+        {
+            unmap();
+            return NO_REQUEST;
+        }
+    }
+    return ret;
+}
+
+// 把解码后的路径按URL的路径语法重新编码后追加到out 只保留RFC 3986中路径可以直接出现的字符
+static void append_encoded_path(std::string &out, const char *path)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    for (const unsigned char *p = (const unsigned char *)path; *p; ++p)
+    {
+        unsigned char c = *p;
+        if (isalnum(c) || strchr("-._~!$&'()*+,;=:@/", c))
+        {
+            out += (char)c;
+        }
+        else
+        {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+    }
+}
+
+// 目标是目录：改为访问其中的索引文件，成功返回NO_REQUEST
+// 目录的URL不以'/'结尾时重定向到以'/'结尾的URL，否则页面中的相对链接会相对上一级目录解析
+http_conn::HTTP_CODE http_conn::resolve_index()
+{
+    int path_len = strcspn(m_url, "?#");
+    if (path_len == 0 || m_url[path_len - 1] != '/')
+    {
+        // Location由规范化后的路径重新编码得到 不回显原始URL：
+        // "//host/.."或"/\host"这样的原始路径原样放进Location会被浏览器当作指向其他站点的地址
+        std::string location = "Location: /";
+        append_encoded_path(location, m_real_file);
+        if (m_real_file[0])
+        {
+            location += '/';
+        }
+        if (m_url[path_len] == '?') // 保留原来的查询串 片段不属于请求目标
+        {
+            location.append(m_url + path_len, strcspn(m_url + path_len, "#"));
+        }
+        location += "\r\n";
+        return respond(301, "301 Moved Permanently", std::string(), location);
+    }
+    int len = strlen(m_real_file);
+    if (len + 1 + (int)strlen(index_file) >= FILENAME_LEN)
+    {
+        return URI_TOO_LONG;
+    }
+    if (len > 0)
+    {
+        m_real_file[len++] = '/';
+    }
+    strcpy(m_real_file + len, index_file);
+    m_index = true;
+    return NO_REQUEST;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    c |= 0x20; // 转小写
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+// 一遍扫描完成URL路径的规范化：在'?'或'#'处截止，解码%XX，合并重复的'/'，去掉"."段，".."段回退一段
+// 结果是不以'/'开头的相对路径，根目录为空串 out的大小为size
+// 返回结果的长度；编码非法、解码出'\0'或'/'、".."越过根目录时返回-1；结果放不下时返回-2
+static int normalize_path(const char *url, char *out, int size)
+{
+    int len = 0;
+    const char *p = url;
+    while (*p && *p != '?' && *p != '#')
+    {
+        if (*p == '/')
+        {
+            ++p;
+            continue;
+        }
+        // 读入一段 边读边解码
+        if (len > 0)
+        {
+            if (len + 1 >= size)
+            {
+                return -2;
+            }
+            out[len++] = '/';
+        }
+        int seg_start = len;
+        while (*p && *p != '/' && *p != '?' && *p != '#')
+        {
+            char c = *p++;
+            if (c == '%')
+            {
+                int hi = hex_value(p[0]);
+                int lo = hi >= 0 ? hex_value(p[1]) : -1;
+                if (lo < 0)
+                {
+                    return -1;
+                }
+                c = (char)(hi * 16 + lo);
+                p += 2;
+                if (c == '\0' || c == '/') // 编码的'/'既不作分隔符也不允许出现在文件名里
+                {
+                    return -1;
+                }
+            }
+            if (len + 1 >= size)
+            {
+                return -2;
+            }
+            out[len++] = c;
+        }
+
+        int seg_len = len - seg_start;
+        if (seg_len == 1 && out[seg_start] == '.') // 当前目录 去掉这一段
+        {
+            len = seg_start > 0 ? seg_start - 1 : 0;
+        }
+        else if (seg_len == 2 && out[seg_start] == '.' && out[seg_start + 1] == '.') // 上级目录 回退一段
+        {
+            if (seg_start == 0)
+            {
+                return -1;
+            }
+            int q = seg_start - 1;
+            while (q > 0 && out[q - 1] != '/')
+            {
+                --q;
+            }
+            len = q > 0 ? q - 1 : 0;
+        }
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// 把m_url规范化为doc_root下的相对路径 存入m_real_file 成功返回NO_REQUEST
+http_conn::HTTP_CODE http_conn::locate_file()
+{
+    m_index = false;
+    int len = normalize_path(m_url, m_real_file, FILENAME_LEN);
+    if (len == -2)
+    {
+        m_real_file[0] = '\0';
+        return URI_TOO_LONG;
+    }
+    if (len < 0)
+    {
+        m_real_file[0] = '\0';
+        printf("BAD_REQUEST:非法路径\n");
+        return BAD_REQUEST;
+    }
+    return NO_REQUEST;
+}
+
+// RESOLVE_BENEATH：解析过程(包括符号链接)不能离开doc_root；O_NOFOLLOW：目标本身不能是符号链接
+// O_NONBLOCK避免打开FIFO时阻塞；HEAD只需要元数据，用O_PATH打开，不读文件内容
+void http_conn::fill_open_how(struct open_how &how) const
+{
+    memset(&how, 0, sizeof(how));
+    how.flags = (m_method == HEAD ? O_PATH : O_RDONLY | O_NONBLOCK) | O_NOFOLLOW | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+}
+
+int http_conn::open_file()
+{
+    const char *path = m_real_file[0] ? m_real_file : ".";
+    struct open_how how;
+    fill_open_how(how);
+    int root_fd = acquire_root(); // 重新加载配置时可能被更换
+    int fd = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+    if (fd < 0 && errno == ENOSYS)
+    {
+        // 内核不支持openat2(5.6之前) 规范化后的路径中没有".."，只有符号链接可能指向doc_root之外
+        fd = openat(root_fd, path, how.flags);
+    }
+    int err = errno;
+    release_root(root_fd);
+    errno = err;
+    return fd;
+}
+
+http_conn::HTTP_CODE http_conn::open_failed(int err)
+{
+    switch (err)
+    {
+    case ENOENT:
+    case ENOTDIR:
+        m_negative_cache.insert(m_real_file, m_file_stat); // 只关心是否命中 元数据无意义
+        printf("NO_RESOURCE\n");
+        return NO_RESOURCE;
+    case ENAMETOOLONG:
+        printf("NO_RESOURCE\n");
+        return NO_RESOURCE;
+    case EACCES:
+    case EPERM:
+    case ELOOP: // 目标是符号链接
+    case EXDEV: // 解析越出了doc_root
+        printf("FORBIDDEN_REQUEST\n");
+        return FORBIDDEN_REQUEST;
+    default:
+        return INTERNAL_ERROR;
+    }
+}
+
+// 重新加载配置时可以再次调用 换上新的目录fd后，旧的fd等到在它上面进行中的打开(阻塞I/O线程、
+// 工作线程或io_uring中)全部归还后才关闭，连续多次重新加载也不会关掉仍在使用的fd
+// 两个缓存的键是相对doc_root的路径，换了目录后全部作废；换目录前开始的请求仍可能写入旧的结果，最多保留一个TTL
+bool http_conn::open_doc_root(const char *doc_root)
+{
+    int fd = open(doc_root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    m_root_lock.lock();
+    if (m_root_fd >= 0)
+    {
+        if (m_root_refs == 0)
+        {
+            close(m_root_fd);
+        }
+        else
+        {
+            m_retired_roots.push_back(std::make_pair(m_root_fd, m_root_refs));
+        }
+    }
+    m_root_fd = fd;
+    m_root_refs = 0;
+    m_root_lock.unlock();
+    m_stat_cache.clear();
+    m_negative_cache.clear();
+    return true;
+}
+
+int http_conn::acquire_root()
+{
+    m_root_lock.lock();
+    int fd = m_root_fd;
+    ++m_root_refs;
+    m_root_lock.unlock();
+    return fd;
+}
+
+// 归还acquire_root取得的fd 已被替换的fd在最后一次归还时关闭
+void http_conn::release_root(int fd)
+{
+    m_root_lock.lock();
+    if (fd == m_root_fd)
+    {
+        --m_root_refs;
+    }
+    else
+    {
+        for (size_t i = 0; i < m_retired_roots.size(); ++i)
+        {
+            if (m_retired_roots[i].first == fd)
+            {
+                if (--m_retired_roots[i].second == 0)
+                {
+                    close(fd);
+                    m_retired_roots.erase(m_retired_roots.begin() + i);
+                }
+                break;
+            }
+        }
+    }
+    m_root_lock.unlock();
+}
+
+// 根据m_file_stat检查目标文件能否被访问
+http_conn::HTTP_CODE http_conn::check_file()
+{
+    if (!(m_file_stat.st_mode & S_IROTH)) // ！目标文件对所有用户可读
+    {
+        printf("FORBIDDEN_REQUEST\n");
+        return FORBIDDEN_REQUEST;
+    }
+
+    if (S_ISDIR(m_file_stat.st_mode)) // 目标文件是目录
+    {
+        printf("BAD_REQUEST:目标文件是目录\n");
+        return BAD_REQUEST;
+    }
+    if (!S_ISREG(m_file_stat.st_mode)) // 设备、FIFO、socket或O_PATH打开的符号链接
+    {
+        printf("FORBIDDEN_REQUEST\n");
+        return FORBIDDEN_REQUEST;
+    }
+    return FILE_REQUEST;
+}
+
+// 使用mmap将已打开的目标文件映射到内存地址m_file_address处 fd由调用方关闭
+// populate:小文件在映射时就读入全部页面，读盘发生在调用线程而不是之后发送响应的主线程
+// 大文件只通知内核开始异步预读，不阻塞调用线程
+http_conn::HTTP_CODE http_conn::map_file(int fd, bool populate)
+{
+    if (fd < 0)
+    {
+        printf("NO_RESOURCE\n");
+        return NO_RESOURCE;
+    }
+    m_file_address = 0;
+    if (m_file_stat.st_size > 0) // 空文件不需要映射
+    {
+        bool small = populate && m_file_stat.st_size <= POPULATE_FILE_SIZE;
+        void *addr = mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE | (small ? MAP_POPULATE : 0), fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            printf("INTERNAL_ERROR:mmap失败\n");
+            return INTERNAL_ERROR;
+        }
+        m_file_address = (char *)addr;
+        if (!small)
+        {
+            posix_fadvise(fd, 0, m_file_stat.st_size, POSIX_FADV_WILLNEED);
+            madvise(addr, m_file_stat.st_size, MADV_SEQUENTIAL);
+        }
+    }
+    // 告诉调用者获取文件成功
+    printf("FILE_REQUEST:成功获取目标资源\n");
+    return FILE_REQUEST;
+}
+
+// 映射的页面是否都在page cache中 按段用mincore检查，遇到第一个不在的即返回；没有映射(空文件)时为true
+bool http_conn::resident() const
+{
+    static const long page_size = sysconf(_SC_PAGESIZE);
+    const long SPAN = 64; // 每次检查的页数
+    unsigned char vec[SPAN];
+    long pages = (m_file_stat.st_size + page_size - 1) / page_size;
+    for (long first = 0; m_file_address && first < pages; first += SPAN)
+    {
+        long count = pages - first < SPAN ? pages - first : SPAN;
+        if (mincore(m_file_address + first * page_size, count * page_size, vec) != 0)
+        {
+            return false;
+        }
+        for (long i = 0; i < count; ++i)
+        {
+            if (!(vec[i] & 1))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// 释放内存
+void http_conn::unmap()
 {
     if (m_file_address)
     {
@@ -427,11 +1573,13 @@ void http_conn::unmap()
 // 写http响应
 bool http_conn::write()
 {
+    if (m_h2) // 发送队列中的帧
+    {
+        return m_h2->on_write();
+    }
     int temp = 0;
-    int bytes_have_send = 0;
-    int bytes_to_send = m_write_idx; // 应用写缓冲区中待发送的字节数
     // 由于没有数据要写
-    if (bytes_to_send == 0)
+    if (iov_pending() == 0 && !stream_pending())
     {
         modfd(m_epollfd, m_sockfd, EPOLLIN); // 监听可读事件 解除对该fd的独占
         init();                              // 重置http_conn状态
@@ -440,12 +1588,20 @@ bool http_conn::write()
 
     while (1)
     {
+        // 流式响应：上一块已全部写入内核 再让生产者生成下一块(第一块和头部一起发出)
+        if (stream_pending() && m_iv[1].iov_len == 0 && !next_chunk())
+        {
+            printf("生产者出错\n");
+            return false; // 关闭http_conn
+        }
+
         // 集中写：多块分散内存的数据一并写入文件描述符对应的内核写缓冲区 iovec描述一块内存区域 成功则返回写入fd的字节数
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        temp = writev_some(m_iv, m_iv_count);
         if (temp <= -1) // 写失败
         {
             // 如果TCP写缓冲区没有空间，则等待下一轮EPOLLOUT事件（内核缓冲区有空间写）。
             // 虽然在此期间服务器无法立即接受到同一个客户端的下一个请求，但这可以保证连接的完整性。
+            // 流式响应的生产者也在此暂停，直到可写时才继续生成，每个连接占用的内存不超过一块
             if (errno == EAGAIN) // 非阻塞写 写缓冲区满
             {
                 printf("写缓冲区满 请重试\n");
@@ -459,43 +1615,119 @@ bool http_conn::write()
         static int resp_times = 0;
         printf("写响应成功 %d 次\n", ++resp_times);
 
-        // 待发送的减去temp
-        bytes_to_send -= temp;
-        // 已发送的加上temp
-        bytes_have_send += temp;
-        
-        // 一次只写一半到内核缓冲区，如何确保一次性发完一整个response？？？
-        // if (bytes_to_send <= bytes_have_send)
-        // TODO:测试
-        if (bytes_to_send <= 0)
+        // 跳过已写出的部分 一次writev可能只写出一部分
+        iov_advance(temp);
+        if (iov_pending() == 0 && !stream_pending())
         {
             unmap();      // 释放客户请求文件的内存
             // 取消监听可写 否则由于写缓冲区可写（未满）则立即触发EPOLLOUT
-            if (m_linger) // http请求要求保持连接
+            if (keep_alive()) // http请求要求保持连接
             {
-                init();                              // 重置http_conn状态
+                // 重置http_conn状态 已读入的下一个请求或TLS记录中连续发来的数据由事件循环直接去解析
+                if (next_request() || read_pending())
+                {
+                    notify(completion_queue::WANT_READ);
+                    return true;
+                }
                 modfd(m_epollfd, m_sockfd, EPOLLIN); // 监听可读事件 取消监听可写 解除对该fd的独占
                 return true;                         // 保留http_conn连接
             }
             else
             {
                 modfd(m_epollfd, m_sockfd, EPOLLIN); // 监听可读事件 取消监听可写 解除对该fd的独占
+                if (m_ssl)
+                {
+                    tls_context::shutdown(m_ssl); // 告诉客户端响应已完整 不是被截断
+                }
                 return false;                        // 会关闭http_conn
             }
         }
     }
 }
 
+int http_conn::iov_pending() const
+{
+    int bytes = 0;
+    for (int i = 0; i < m_iv_count; ++i)
+    {
+        bytes += m_iv[i].iov_len;
+    }
+    return bytes;
+}
+
+void http_conn::iov_advance(int n)
+{
+    for (int i = 0; i < m_iv_count && n > 0; ++i)
+    {
+        int len = (size_t)n < m_iv[i].iov_len ? n : m_iv[i].iov_len;
+        m_iv[i].iov_base = (char *)m_iv[i].iov_base + len;
+        m_iv[i].iov_len -= len;
+        n -= len;
+        m_sent += len;
+    }
+}
+
+http_conn::HTTP_CODE http_conn::stream(int status, const char *title, body_producer producer,
+                                       const std::string &headers)
+{
+    m_dynamic_status = status;
+    m_dynamic_title = title;
+    m_dynamic_headers = headers;
+    m_producer = producer;
+    return STREAM_REQUEST;
+}
+
+// 让生产者生成下一块并加上chunked编码的块头和块尾 生产者结束时放入最后的0长度块；HTTP/1.0的请求不加编码
+bool http_conn::next_chunk()
+{
+    static const int CHUNK_HEAD = 8; // 块头(十六进制长度+\r\n)的预留空间
+    static char last_chunk[] = "0\r\n\r\n";
+    if (!m_chunk_buf)
+    {
+        m_chunk_buf = new char[STREAM_CHUNK_SIZE];
+    }
+    char *data = m_chunk_buf + CHUNK_HEAD;
+    int n = m_producer(this, data, STREAM_CHUNK_SIZE - CHUNK_HEAD - 2);
+    if (n < 0)
+    {
+        m_producer = NULL;
+        return false;
+    }
+    if (n == 0)
+    {
+        m_producer = NULL;
+        m_iv[1].iov_base = last_chunk;
+        m_iv[1].iov_len = m_http10 ? 0 : sizeof(last_chunk) - 1;
+        return true;
+    }
+    if (m_http10)
+    {
+        m_iv[1].iov_base = data;
+        m_iv[1].iov_len = n;
+        m_stream_sent += n;
+        return true;
+    }
+    char head[CHUNK_HEAD + 1];
+    int len = snprintf(head, sizeof(head), "%x\r\n", n);
+    memcpy(data - len, head, len);
+    data[n] = '\r';
+    data[n + 1] = '\n';
+    m_iv[1].iov_base = data - len;
+    m_iv[1].iov_len = len + n + 2;
+    m_stream_sent += n;
+    return true;
+}
+
 bool http_conn::add_response(const char *format, ...)
 {
-    if (m_write_idx >= WRITE_BUFFER_SIZE)
+    if (m_write_idx >= m_write_buffer_size)
     {
         return false;
     }
     va_list arg_list;
     va_start(arg_list, format);
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
-    if (len >= (WRITE_BUFFER_SIZE - 1 - m_write_idx))
+    int len = vsnprintf(m_write_buf + m_write_idx, m_write_buffer_size - 1 - m_write_idx, format, arg_list);
+    if (len >= (m_write_buffer_size - 1 - m_write_idx))
     {
         return false;
     }
@@ -504,16 +1736,19 @@ bool http_conn::add_response(const char *format, ...)
     return true;
 }
 
+// title通常已以状态码开头(如"200 OK") 此时不再重复状态码
 bool http_conn::add_status_line(int status, const char *title)
 {
+    if (isdigit((unsigned char)title[0]))
+    {
+        return add_response("%s %s\r\n", "HTTP/1.1", title);
+    }
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
 bool http_conn::add_headers(int content_len)
 {
-    add_content_length(content_len);
-    add_linger();
-    add_blank_line();
+    return add_content_length(content_len) && add_linger() && add_blank_line();
 }
 
 bool http_conn::add_content_length(int content_len)
@@ -521,9 +1756,40 @@ bool http_conn::add_content_length(int content_len)
     return add_response("Content-Length: %d\r\n", content_len);
 }
 
+// 根据目标文件的扩展名 文本类型附带默认字符集
+bool http_conn::add_content_type()
+{
+    bool textual = false;
+    const char *type = mime::lookup(m_real_file, textual);
+    if (textual && mime::charset()[0])
+    {
+        return add_response("Content-Type: %s; charset=%s\r\n", type, mime::charset());
+    }
+    return add_response("Content-Type: %s\r\n", type);
+}
+
+// 保持连接时用Keep-Alive告知空闲超时和还能发送的请求数 客户端据此在服务器关闭之前停止复用连接
 bool http_conn::add_linger()
 {
-    return add_response("Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close");
+    if (!m_linger)
+    {
+        return add_response("Connection: close\r\n");
+    }
+    int max = __atomic_load_n(&m_keep_alive_requests, __ATOMIC_RELAXED);
+    if (m_client_max > 0 && (max == 0 || m_client_max < max))
+    {
+        max = m_client_max;
+    }
+    if (max == 0)
+    {
+        return add_response("Connection: keep-alive\r\nKeep-Alive: timeout=%d\r\n", keep_alive_timeout());
+    }
+    return add_response("Connection: keep-alive\r\nKeep-Alive: timeout=%d, max=%d\r\n", keep_alive_timeout(), max - m_served);
+}
+
+bool http_conn::add_retry_after(int seconds)
+{
+    return add_response("Retry-After: %d\r\n", seconds);
 }
 
 bool http_conn::add_blank_line()
@@ -533,12 +1799,22 @@ bool http_conn::add_blank_line()
 
 bool http_conn::add_content(const char *content)
 {
+    if (m_method == HEAD) // HEAD的响应只有状态行和头部
+    {
+        return true;
+    }
     return add_response("%s", content);
 }
 
 // 构造响应 响应内容不在同一块内存 所以主线程中用集中写writev写响应
 bool http_conn::process_write(HTTP_CODE ret)
 {
+    m_send_start = monotonic_ms();
+    m_sent = 0;
+    if (__atomic_load_n(&m_draining, __ATOMIC_RELAXED)) // 服务器正在排空 响应后关闭连接
+    {
+        m_linger = false;
+    }
     switch (ret)
     {
     case INTERNAL_ERROR: // 服务器内部错误
@@ -553,6 +1829,7 @@ bool http_conn::process_write(HTTP_CODE ret)
     }
     case BAD_REQUEST: // 客户请求有语法错误
     {
+        m_linger = false; // 无法确定这个请求在哪里结束 之后的数据不能再解析
         add_status_line(400, error_400_title);
         add_headers(strlen(error_400_form));
         if (!add_content(error_400_form))
@@ -581,9 +1858,110 @@ bool http_conn::process_write(HTTP_CODE ret)
         }
         break;
     }
+    case PAYLOAD_TOO_LARGE: // 消息体超过MAX_BODY_SIZE
+    {
+        add_status_line(413, error_413_title);
+        add_headers(strlen(error_413_form));
+        if (!add_content(error_413_form))
+        {
+            return false;
+        }
+        break;
+    }
+    case DYNAMIC_REQUEST: // 处理回调生成的响应
+    {
+        add_status_line(m_dynamic_status, m_dynamic_title);
+        if (!add_response("%s", m_dynamic_headers.c_str()) || !add_headers(m_dynamic_body.size()))
+        {
+            return false;
+        }
+        if (!m_dynamic_body.empty() && m_method != HEAD)
+        {
+            m_iv[0].iov_base = m_write_buf;
+            m_iv[0].iov_len = m_write_idx;
+            m_iv[1].iov_base = (void *)m_dynamic_body.data();
+            m_iv[1].iov_len = m_dynamic_body.size();
+            m_iv_count = 2;
+            return true;
+        }
+        break;
+    }
+    case STREAM_REQUEST: // 长度未知的响应 头部先发出 消息体由生产者在发送时逐块生成
+    {
+        // HTTP/1.0没有chunked编码 消息体原样发送，以关闭连接表示结束
+        if (m_http10)
+        {
+            m_linger = false;
+        }
+        add_status_line(m_dynamic_status, m_dynamic_title);
+        if (!add_response("%s", m_dynamic_headers.c_str()) || (!m_http10 && !add_response("Transfer-Encoding: chunked\r\n")) ||
+            !add_linger() || !add_blank_line())
+        {
+            return false;
+        }
+        if (m_method == HEAD)
+        {
+            m_producer = NULL;
+        }
+        m_iv[0].iov_base = m_write_buf;
+        m_iv[0].iov_len = m_write_idx;
+        m_iv[1].iov_base = m_chunk_buf;
+        m_iv[1].iov_len = 0;
+        m_iv_count = 2;
+        return true;
+    }
+    case URI_TOO_LONG: // 规范化后的路径超过FILENAME_LEN
+    {
+        add_status_line(414, error_414_title);
+        add_headers(strlen(error_414_form));
+        if (!add_content(error_414_form))
+        {
+            return false;
+        }
+        break;
+    }
+    case VERSION_NOT_SUPPORTED: // 不是HTTP/1.x
+    {
+        m_linger = false;
+        add_status_line(505, error_505_title);
+        add_headers(strlen(error_505_form));
+        if (!add_content(error_505_form))
+        {
+            return false;
+        }
+        break;
+    }
+    case TOO_MANY_REQUESTS: // 客户端超过了请求速率
+    {
+        add_status_line(429, error_429_title);
+        add_retry_after(RATE_RETRY_AFTER_SECS);
+        add_headers(strlen(error_429_form));
+        if (!add_content(error_429_form))
+        {
+            return false;
+        }
+        break;
+    }
+    case SERVICE_UNAVAILABLE: // 服务器过载 请求被拒绝
+    {
+        add_status_line(503, error_503_title);
+        add_retry_after(RETRY_AFTER_SECS);
+        add_headers(strlen(error_503_form));
+        if (!add_content(error_503_form))
+        {
+            return false;
+        }
+        break;
+    }
     case FILE_REQUEST: // 成功获取文件资源
     {
         add_status_line(200, ok_200_title);
+        add_content_type();
+        if (m_method == HEAD) // 只有元数据 文件没有被映射
+        {
+            add_headers(m_file_stat.st_size);
+            break;
+        }
         if (m_file_stat.st_size != 0)
         {
             add_headers(m_file_stat.st_size);
@@ -604,6 +1982,7 @@ bool http_conn::process_write(HTTP_CODE ret)
                 return false;
             }
         }
+        break;
     }
     default:
     {
@@ -619,19 +1998,144 @@ bool http_conn::process_write(HTTP_CODE ret)
 
 void http_conn::process()
 {
-    HTTP_CODE read_ret = process_read();
+    HTTP_CODE read_ret;
+    if (m_offloaded == OFFLOAD_REQUEST) // 事件循环已解析完头部并匹配了路由
+    {
+        read_ret = end_of_headers(NO_REQUEST);
+        if (read_ret == NO_REQUEST)
+        {
+            read_ret = process_read(); // 继续解析已经读到的消息体
+        }
+    }
+    else if (m_offloaded == GET_REQUEST) // 事件循环已解析完请求 目标文件不在缓存中
+    {
+        read_ret = GET_REQUEST;
+    }
+    else
+    {
+        read_ret = process_read();
+    }
+    m_offloaded = NO_REQUEST;
     if (read_ret == NO_REQUEST) // 请求不完整 但可以继续读
     {
-        modfd(m_epollfd, m_sockfd, EPOLLIN); // 监听可读事件 解除对该fd的独占
-        return;
+        if (m_read_idx < m_read_buffer_size)
+        {
+            notify(completion_queue::WANT_READ); // 由事件循环重新监听可读事件
+            return;
+        }
+        // 请求行和头部占满了读缓冲区 无法继续解析
+        m_linger = false;
+        read_ret = BAD_REQUEST;
     }
+    if (read_ret == GET_REQUEST) // 请求完整 访问目标文件
+    {
+        HTTP_CODE cached = lookup_cache();
+        if (cached != NO_REQUEST)
+        {
+            complete(cached);
+            return;
+        }
+        if (m_file_pool) // 交给阻塞I/O线程池 由它构造响应
+        {
+            m_file_task.conn = this;
+            if (!m_file_pool->append(&m_file_task))
+            {
+                shed();
+            }
+            return;
+        }
+        read_ret = do_request();
+    }
+    complete(read_ret);
+}
 
-    // 否则成功获取资源或者出错 并根据read_ret构造响应
-    bool write_ret = process_write(read_ret);
+// 事件循环读到数据后先在本线程解析：请求不完整、出错、命中缓存(包括map_cached能直接映射的小文件)时就地构造响应，
+// 由act告诉事件循环接下来重新监听可读、写出响应还是关闭连接，省去两次线程切换和对应的epoll_ctl
+// 需要执行处理回调、接收消息体或读盘时返回false，调用者把连接交给线程池，process从停下的位置继续
+bool http_conn::process_inline(completion_queue::action &act)
+{
+    if (m_check_state == CHECK_STATE_CONTENT) // 正在接收已交给工作线程的请求的消息体
+    {
+        return false;
+    }
+    m_inline = true;
+    HTTP_CODE ret = process_read();
+    m_inline = false;
+    if (ret == NO_REQUEST)
+    {
+        if (m_read_idx < m_read_buffer_size)
+        {
+            act = completion_queue::WANT_READ;
+            return true;
+        }
+        m_linger = false;
+        ret = BAD_REQUEST;
+    }
+    if (ret == GET_REQUEST)
+    {
+        ret = lookup_cache();
+        if (ret == NO_REQUEST && m_method == GET)
+        {
+            ret = map_cached();
+        }
+        if (ret == NO_REQUEST)
+        {
+            ret = OFFLOAD_REQUEST;
+            m_offloaded = GET_REQUEST;
+        }
+    }
+    else if (ret == OFFLOAD_REQUEST)
+    {
+        m_offloaded = OFFLOAD_REQUEST;
+    }
+    if (ret == OFFLOAD_REQUEST)
+    {
+        __atomic_add_fetch(&m_offload_count, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    __atomic_add_fetch(&m_inline_count, 1, __ATOMIC_RELAXED);
+    act = process_write(ret) ? completion_queue::WANT_WRITE : completion_queue::CLOSE;
+    return true;
+}
+
+void http_conn::process_file()
+{
+    complete(do_request());
+}
+
+void http_conn::complete(HTTP_CODE ret)
+{
+    // 成功获取资源或者出错 并根据ret构造响应
+    bool write_ret = process_write(ret);
     if (!write_ret) // 构造响应出错
     {
-        close_conn(); // 从内核事件表移除m_sockfd 并用户数量-1
+        notify(completion_queue::CLOSE); // 由事件循环关闭连接并删除其定时器
+        return;
     }
-    // 够造响应成功 等待内核缓冲区有空间可写
-    modfd(m_epollfd, m_sockfd, EPOLLOUT); // 监听可写事件 解除对该fd的独占
+    // 构造响应成功 由事件循环直接写出 写不完时再等待可写事件
+    notify(completion_queue::WANT_WRITE);
+}
+
+// 过载时快速拒绝：不解析请求 直接构造503响应 发完即关闭连接
+// 主线程(线程池已满)和工作线程(排队时延过高)都可能调用，此时该连接的EPOLLONESHOT尚未重置，不会有其他线程同时操作
+void http_conn::shed()
+{
+    m_linger = false;
+    m_write_idx = 0;
+    if (!process_write(SERVICE_UNAVAILABLE))
+    {
+        notify(completion_queue::CLOSE);
+        return;
+    }
+    notify(completion_queue::WANT_WRITE);
+}
+
+void file_task::process()
+{
+    conn->process_file();
+}
+
+void file_task::shed()
+{
+    conn->shed();
 }
@@ -18,17 +18,67 @@
 #include <sys/mman.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <linux/openat2.h>
+#include <string>
+#include <vector>
 #include "locker.h"
+#include "threadpool.h"
+#include "stat_cache.h"
+#include "completion_queue.h"
+#include "tls.h"
+#include "client_limits.h"
 
 #include <sys/uio.h>
 #include <sys/sem.h>
 
+class http_conn;
+class h2_session;
+struct h2_stream;
+class router;
+struct route;
+
+// 路由匹配时捕获的路径参数 值直接指向请求行中的URL，不复制、不以'\0'结尾
+struct route_params
+{
+    static const int MAX_PARAMS = 4;
+    int count;
+    const char *name[MAX_PARAMS];
+    const char *value[MAX_PARAMS];
+    int len[MAX_PARAMS];
+};
+
+// 阻塞I/O线程池中的任务：访问http_conn请求的目标文件(stat/open/mmap及预读)
+// 冷缓存的文件读盘只阻塞该线程池，不占用解析请求的工作线程，也不会把缺页留到主线程的writev中
+class file_task
+{
+public:
+    file_task() : conn(NULL) {}
+    void process();
+    void shed();
+
+public:
+    http_conn *conn;
+};
+
 class http_conn
 {
+    friend class uring_server; // io_uring后端直接驱动解析和应答的各个步骤
+    friend class coro_server;  // 协程引擎同样直接驱动解析和应答
+    friend struct coro_file_job;
+    friend class h2_session;   // HTTP/2连接上的请求各用一个http_conn解析和构造响应
+
 public:
     static const int FILENAME_LEN = 200;       // 文件名的最大长度
-    static const int READ_BUFFER_SIZE = 2048;  // 读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 1024; // 写缓冲区的大小
+    static const int READ_BUFFER_SIZE = 2048;  // 读缓冲区的默认大小 实际大小见m_read_buffer_size
+    static const int WRITE_BUFFER_SIZE = 1024; // 写缓冲区的默认大小 实际大小见m_write_buffer_size
+    static const int RETRY_AFTER_SECS = 1;     // 过载时503响应建议客户端重试的间隔
+    static const int RATE_RETRY_AFTER_SECS = 1; // 超过请求速率时429响应建议的重试间隔 速率至少每秒1个，1秒内桶中一定补充了一个令牌
+    static const int POPULATE_FILE_SIZE = 64 * 1024; // 不超过该大小的文件在mmap时一次性读入全部页面
+    static const int BODY_MEMORY_SIZE = 8 * 1024;    // 不超过该大小的请求消息体保存在内存中，更大的转存到临时文件
+    static const long long MAX_BODY_SIZE = 64LL * 1024 * 1024; // 允许接收的请求消息体的最大长度
+    static const int STREAM_CHUNK_SIZE = 16 * 1024;  // 流式响应的块缓冲区大小 每个连接最多占用这么多内存
+    static const long long NEGATIVE_TTL_US = 1000000; // 不存在的路径在负缓存中保留的时间
+    static const int INLINE_FILE_SIZE = 64 * 1024;    // 内联快速路径只发送不超过该大小、页面都已在page cache中的文件
     enum METHOD
     {
         GET = 0,
@@ -47,6 +97,14 @@ public:
         CHECK_STATE_HEADER,
         CHECK_STATE_CONTENT
     };
+    // chunked消息体的解析状态
+    enum CHUNK_STATE
+    {
+        CHUNK_SIZE = 0, // 块大小行
+        CHUNK_DATA,     // 块数据
+        CHUNK_DATA_END, // 块数据之后的CRLF
+        CHUNK_TRAILER   // 最后一个块之后的尾部字段
+    };
     enum HTTP_CODE
     {
         NO_REQUEST,
@@ -56,7 +114,15 @@ public:
         FORBIDDEN_REQUEST,
         FILE_REQUEST,
         INTERNAL_ERROR,
-        CLOSED_CONNECTION
+        CLOSED_CONNECTION,
+        SERVICE_UNAVAILABLE,
+        PAYLOAD_TOO_LARGE,
+        URI_TOO_LONG,
+        VERSION_NOT_SUPPORTED,
+        TOO_MANY_REQUESTS,
+        DYNAMIC_REQUEST, // 响应由处理回调生成(见respond)
+        STREAM_REQUEST,  // 响应由生产者边生成边发送(见stream)
+        OFFLOAD_REQUEST  // 事件循环内联解析时遇到要交给工作线程的请求(见process_inline)
     };
     enum LINE_STATUS
     {
@@ -65,27 +131,99 @@ public:
         LINE_OPEN
     };
 
+    // 请求消息体的处理回调：消息体边接收边按块交给它，不在内存中缓存整个上传
+    // data/len为本次收到的一块，data为NULL表示消息体已经接收完毕
+    // 返回NO_REQUEST表示继续接收，其他返回值结束请求并作为处理结果交给process_write
+    typedef HTTP_CODE (*body_handler)(http_conn *conn, const char *data, int len);
+
+    // 流式响应的生产者：把接下来的响应内容写入buf(最多size字节)，返回写入的字节数，0表示结束，-1表示出错
+    // 只在前一块全部写入内核之后才被调用，发送缓冲区满时生产者随之暂停；在发送响应的线程中调用，不能阻塞
+    typedef int (*body_producer)(http_conn *conn, char *buf, int size);
+
 public:
-    http_conn() {}
-    ~http_conn() {}
+    http_conn() : m_sockfd(-1), m_ssl(NULL), m_h2(NULL), m_stream(NULL), m_read_buf(NULL), m_write_buf(NULL), m_body_fd(-1), m_chunk_buf(NULL), m_inline(false), m_offloaded(NO_REQUEST), m_in_flight(false), m_generation(0), m_pipelined(false) {}
+    ~http_conn();
 
 public:
     void init(int sockfd, const sockaddr_in &addr, int trig_mode); // 初始化新接受的连接
     void close_conn(bool real_close = true);        // 关闭连接
+    void abort_conn();                              // 排空超时：进程退出时对仍打开的连接发RST 不再发送缓冲区中剩下的数据
+    void on_closed();                               // 事件循环关闭了连接的fd 释放HTTP/2连接的状态
     void process();                                 // 处理客户请求
+    bool process_inline(completion_queue::action &act); // 在事件循环中处理 不能快速完成时返回false
+    void shed();                                    // 过载时拒绝请求 回503
+    void process_file();                            // 在阻塞I/O线程池中访问目标文件并构造响应
+    bool idle() const;                              // 正在等待下一个请求 只能在事件循环线程中判断
+    // 响应写完后是否保持连接 排空开始前已发出响应头的连接也在写完后关闭
+    bool keep_alive() const { return m_linger && !__atomic_load_n(&m_draining, __ATOMIC_RELAXED); }
+    int keep_alive_timeout() const;                 // 等待下一个请求的空闲超时(秒) 客户端在Keep-Alive头部中要求的更短时取客户端的
+    // 按连接当前所处的阶段计算定时器的到期时刻 每次读写之后在事件循环中调用；now和返回值都是monotonic_ms()的毫秒数
+    // 请求在工作线程中时不会到期：关闭连接后fd被复用，工作线程会写到新连接的对象里
+    long long deadline(long long now);
+    // 事件循环把请求交给工作线程(或它再交给阻塞I/O线程池)之前置位，执行其投递的完成项时清除 只在事件循环线程中访问
+    void set_in_flight(bool in_flight) { m_in_flight = in_flight; }
+    bool in_flight() const { return m_in_flight; }
+    unsigned generation() const { return m_generation; } // 每接受一个新连接加1 区分先后使用同一fd的连接
     bool read();                                    // 非阻塞读操作
+    // TLS连接上还有已解密、没读进读缓冲区的数据(读缓冲区满时留下的) 重新监听可读前要先读它们，epoll不会再通知
+    bool read_pending() const { return m_ssl && tls_context::pending(m_ssl); }
+    // 读缓冲区中有客户端连续发来(pipelining)、还没解析的下一个请求 epoll不会再通知，要直接解析
+    bool pipelined() const { return m_pipelined; }
     bool write();                                   // 非阻塞写操作
 
+    // 以下一组函数供路由处理函数和消息体处理回调使用
+    METHOD method() const { return m_method; }
+    const char *url() const { return m_url; }
+    std::string param(const char *name) const;          // 路径参数 没有时返回空串
+    long long body_length() const { return m_body_received; }
+    const std::string &body() const { return m_body; } // 消息体未转存到临时文件时的内容
+    int body_fd() const { return m_body_fd; }           // 转存消息体的临时文件 没有转存时为-1
+    bool spool(const char *data, int len);              // 保存一块消息体 超过BODY_MEMORY_SIZE后转存到临时文件
+    // 设置响应 headers为额外的头部字段(每个以\r\n结尾) 返回DYNAMIC_REQUEST
+    HTTP_CODE respond(int status, const char *title, const std::string &content,
+                      const std::string &headers = std::string());
+    static HTTP_CODE spool_body(http_conn *conn, const char *data, int len); // 默认的处理回调
+    // 设置长度未知的响应 以chunked编码发送producer生成的内容 返回STREAM_REQUEST
+    HTTP_CODE stream(int status, const char *title, body_producer producer,
+                     const std::string &headers = std::string());
+    long long stream_offset() const { return m_stream_sent; } // 生产者已经生成的字节数
+
 private:
-    void init();                       // 初始化连接
+    void init(int kept = 0);           // 初始化连接 读缓冲区开头的kept字节是已读入的下一个请求，予以保留
+    bool next_request();               // 保持连接时为下一个请求重置状态 返回读缓冲区中是否已有它的数据
+    void init_stream(const http_conn &parent, h2_stream *stream); // 初始化HTTP/2连接parent上的一个请求
     HTTP_CODE process_read();          // 解析http请求
     bool process_write(HTTP_CODE ret); // 填充http应答
 
     // 以下一组函数被process_read调用以解析http请求
     HTTP_CODE parse_request_line(char *text);
     HTTP_CODE parse_headers(char *text);
-    HTTP_CODE parse_content(char *text);
+    HTTP_CODE route_request();
+    HTTP_CODE end_of_headers(HTTP_CODE route_ret);
+    HTTP_CODE parse_content();
+    HTTP_CODE deliver_body(int len);
+    HTTP_CODE finish_body();
+    void compact_body();
+    void send_continue();
     HTTP_CODE do_request();
+    HTTP_CODE lookup_cache();
+    HTTP_CODE map_cached();
+    HTTP_CODE resolve_index();
+    HTTP_CODE locate_file();
+    HTTP_CODE check_file();
+    void fill_open_how(struct open_how &how) const; // 在doc_root下打开目标文件的方式
+    int open_file();                                // 在doc_root下同步打开目标文件
+    HTTP_CODE open_failed(int err);                 // 打开目标文件失败 返回errno对应的响应
+    HTTP_CODE map_file(int fd, bool populate);
+    bool resident() const;             // 映射的目标文件的页面是否都在page cache中 发送时不会读盘
+    void complete(HTTP_CODE ret);      // 根据处理结果构造响应 并通知主线程可写
+    void notify(completion_queue::action act) { m_completions->post(m_sockfd, m_generation, act, m_stream); } // 把后续动作交给事件循环
+    bool stream_pending() const { return m_producer != NULL; } // 流式响应还有后续的块
+    bool next_chunk();                 // 让生产者生成下一块 放到m_iv[1]
+    int iov_pending() const;           // m_iv中还未发送的字节数
+    void iov_advance(int n);           // 跳过m_iv中已发送的n字节
+    ssize_t recv_some(char *buf, int len);           // 从连接读 TLS连接读解密后的数据
+    ssize_t writev_some(const struct iovec *iov, int count); // 向连接写 TLS连接加密后写出
     char *get_line() { return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
 
@@ -96,39 +234,112 @@ private:
     bool add_status_line(int status, const char *title);
     bool add_headers(int content_length);
     bool add_content_length(int content_length);
+    bool add_content_type();
     bool add_linger();
+    void parse_keep_alive(const char *text);
+    bool add_retry_after(int seconds);
     bool add_blank_line();
 
 public:
     static int m_epollfd;    // 所有socket上的事件都被注册到同一个epoll内核事件表中，所以设置为静态的(静态成员 所有对象共享)
     static int m_user_count; // 统计用户数量(静态成员 所有对象共享)
     static bool m_et;        // 是否启用边沿触发模式
+    static threadpool<file_task> *m_file_pool; // 阻塞I/O线程池 为NULL时在工作线程中同步访问目标文件
+    static completion_queue *m_completions;    // 工作线程处理完请求后通过它通知事件循环
+    static tls_context *m_tls;                 // 配置了证书时新连接都先进行TLS握手 为NULL时只提供明文HTTP
+    static body_handler m_default_body_handler; // POST/PUT请求消息体的处理回调
+    static const router *m_router;    // 动态请求的路由表 为NULL时只提供静态文件
+    static long long m_request_count; // 已解析完头部的请求总数
+    static long long m_inline_count;  // 在事件循环中内联完成的请求数
+    static long long m_offload_count; // 内联解析后仍交给工作线程的请求数
+    static stat_cache m_stat_cache;   // 目标文件的元数据缓存 HEAD请求只查它
+    static stat_cache m_negative_cache; // 不存在的路径
+    static client_limits m_client_limits; // 按客户端IP的连接数和请求速率限制
+    static bool open_doc_root(const char *doc_root); // 打开doc_root 启动和重新加载配置时调用
+    static int acquire_root();        // 取得doc_root的fd并加引用 在它上面的打开完成后用release_root归还
+    static void release_root(int fd);
+    static int m_read_buffer_size;    // 每个连接的读缓冲区大小 启动时设置
+    static int m_write_buffer_size;   // 每个连接的写缓冲区大小 启动时设置
+    static bool m_draining;           // 服务器正在排空 之后的响应都不再保持连接
+    static int m_keep_alive_timeout;  // 保持连接的空闲超时(秒) 通过Keep-Alive头部告知客户端，可重新加载
+    static int m_keep_alive_requests; // 每个连接最多处理的请求数 0表示不限，可重新加载
+    // 以下超时可重新加载 见deadline
+    static int m_header_timeout;      // 从请求(或连接)开始到收完请求行和头部的最长时间(秒) 期间的读不会延长它
+    static int m_body_timeout;        // 接收消息体时两次读之间的最长间隔(秒)
+    static int m_send_timeout;        // 发送响应时两次写之间的最长间隔(秒)
+    static int m_send_min_rate;       // 发送响应的最低平均速率(字节/秒) 0表示不限
 
 private:
+    static int m_root_fd;             // 网站根目录doc_root 目标文件都相对它打开
+    static int m_root_refs;           // 正在m_root_fd上打开文件的次数
+    static std::vector<std::pair<int, int> > m_retired_roots; // 已被替换但仍在使用的目录fd及其引用数
+    static locker m_root_lock;        // 保护以上三项
+
     int m_sockfd;          // 该http连接的socket
     sockaddr_in m_address; // 该http连接对方的socket地址
+    SSL *m_ssl;            // TLS连接的状态 明文连接为NULL；连接关闭后保留到fd被复用时才释放
+    h2_session *m_h2;      // 切换到HTTP/2后的连接状态 HTTP/1.1连接为NULL
+    h2_stream *m_stream;   // HTTP/2连接上的请求所属的流 m_sockfd为所在连接的fd，不注册到epoll
 
-    char m_read_buf[READ_BUFFER_SIZE];   // 应用读缓冲区(非内核)
+    char *m_read_buf;                    // 应用读缓冲区(非内核) 连接第一次被使用时分配
     int m_read_idx;                      // 标识读缓冲区中客户端数据的最后一个字节的下一个位置
     int m_checked_idx;                   // 当前正在分析的字符在读缓冲区的位置
     int m_start_line;                    // 当前正在解析的行的起始位置
-    char m_write_buf[WRITE_BUFFER_SIZE]; // 应用写缓冲区(非内核)
+    char *m_write_buf;                   // 应用写缓冲区(非内核)
     int m_write_idx;                     // 写缓冲区中待发送的字节数
 
     CHECK_STATE m_check_state; // 主状态机当前状态
     METHOD m_method;           // 请求方法
 
-    char m_real_file[FILENAME_LEN]; // 客户请求的目标文件的完整路径，内容为doc_root+m_url，doc_root是网站根目录
+    char m_real_file[FILENAME_LEN]; // 客户请求的目标文件相对doc_root的路径，由m_url规范化得到，doc_root是网站根目录
     char *m_url;                    // 客户请求的目标文件名
-    char *m_version;                // http协议版本号，仅支持1.1
+    bool m_index;                   // 目标是目录 已改为访问其中的索引文件
+    char *m_version;                // http协议版本号，支持1.0和1.1
+    bool m_http10;                  // 请求为HTTP/1.0 默认不保持连接，响应不能使用chunked编码
     char *m_host;                   // 主机名
-    int m_content_length;           //http请求的消息体的长度
-    bool m_linger;                  // http请求是否要求保持连接
+    long long m_content_length;     //http请求的消息体的长度
+    bool m_linger;                  // 响应后是否保持连接 HTTP/1.1默认保持，HTTP/1.0要求Connection: keep-alive
+    int m_served;                   // 连接上已解析完头部的请求数 达到m_keep_alive_requests后关闭连接
+    int m_client_timeout;           // 客户端在Keep-Alive头部中要求的空闲超时 0表示没有要求
+    int m_client_max;               // 客户端在Keep-Alive头部中要求的最大请求数 0表示没有要求
+    long long m_request_start;      // 当前请求收到第一块数据的时刻(毫秒 同deadline) 第一个请求从连接建立算起；0表示还没开始
+    long long m_send_start;         // 开始发送当前响应的时刻(毫秒)
+    long long m_sent;               // 当前响应已发送的字节数
+
+    bool m_chunked;                 // 消息体是否采用chunked传输编码
+    bool m_has_length;              // 是否已收到Content-Length头部
+    bool m_expect_continue;         // 客户端是否在等待100 Continue后才发送消息体
+    bool m_body_done;               // 消息体是否已经完整接收
+    int m_body_start;               // 读缓冲区中消息体的起始位置 之前的请求行和头部要保留给m_url等指针
+    long long m_body_received;      // 已收到的消息体字节数(chunked时为解码后的字节数)
+    CHUNK_STATE m_chunk_state;      // chunked消息体的解析状态
+    long long m_chunk_left;         // 当前块还未收到的字节数
+    body_handler m_body_handler;    // 本次请求消息体的处理回调 为NULL时丢弃消息体
+    std::string m_body;             // 保存在内存中的消息体
+    int m_body_fd;                  // 转存消息体的临时文件
+    char *m_chunk_buf;              // 流式响应的块缓冲区 按需分配
+    body_producer m_producer;       // 流式响应的生产者 最后一块生成后置为NULL
+    long long m_stream_sent;        // 生产者已经生成的字节数
+
+    int m_dynamic_status;           // 处理回调生成的响应的状态码
+    const char *m_dynamic_title;    // 状态行
+    std::string m_dynamic_body;     // 响应内容
+    std::string m_dynamic_headers;  // 额外的头部字段
+
+    const route *m_route;           // 匹配到的路由 为NULL时访问静态文件
+    route_params m_params;          // 路由捕获的路径参数
 
     char *m_file_address;    // 客户请求的目标文件被mmap到内存中后的起始位置
     struct stat m_file_stat; // 目标文件的状态。通过其获取文件是否存在、是否为目录、是否可读、文件大小等信息
     struct iovec m_iv[2];    // 因为采用writev集中写来执行写操作，内存区域的数组
     int m_iv_count;          // 被写内存块的数量
+
+    file_task m_file_task;   // 投递到阻塞I/O线程池的任务
+    bool m_inline;           // 正在事件循环中内联解析 遇到处理回调和消息体时停下
+    HTTP_CODE m_offloaded;   // 内联解析后交给工作线程时停下的位置 OFFLOAD_REQUEST:头部之后 GET_REQUEST:访问目标文件
+    bool m_in_flight;        // 请求在工作线程中 事件循环不能关闭连接
+    unsigned m_generation;   // 连接的代数 HTTP/2的请求取所在连接的
+    bool m_pipelined;        // 见pipelined 开始解析时清除
 };
 
 #endif
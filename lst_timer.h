@@ -2,6 +2,7 @@
 #define LST_TIMER
 
 #include <time.h>
+#include "admission.h"
 
 #define BUFFER_SIZE 64
 class util_timer;
@@ -11,6 +12,7 @@ struct client_data
 {
     sockaddr_in address;
     int sockfd;
+    bool counted; // 是否计入了该IP的连接数 见client_limits::connect
     char buf[BUFFER_SIZE];
     util_timer *timer;
 };
@@ -22,7 +24,7 @@ public:
     util_timer() : prev(NULL), next(NULL) {}
 
 public:
-    time_t expire;                  // 任务的超时时间
+    long long expire;               // 任务的超时时刻 monotonic_ms()的毫秒数
     void (*cb_func)(client_data *); // 任务回调函数
     client_data *user_data;         // 用户数据结构：客户端socket地址、socket文件描述符、读缓存、定时器
     util_timer *prev;               // 指向前一个定时器
@@ -73,6 +75,23 @@ public:
         {
             return;
         }
+        // 提前了(连接进入超时更短的阶段) 摘下后从头部重新插入
+        if (timer->prev && timer->expire < timer->prev->expire)
+        {
+            timer->prev->next = timer->next;
+            if (timer->next)
+            {
+                timer->next->prev = timer->prev;
+            }
+            else
+            {
+                tail = timer->prev;
+            }
+            timer->prev = timer->next = NULL;
+            size--;
+            add_timer(timer);
+            return;
+        }
         util_timer *tmp = timer->next;
         // 加时以后仍然小于后一个定时器
         if (!tmp || (timer->expire < tmp->expire))
@@ -140,7 +159,7 @@ public:
             return;
         }
         printf("timer tick\n");
-        time_t cur = time(NULL);
+        long long cur = monotonic_ms();
         util_timer *tmp = head;
         while (tmp)
         {
@@ -160,6 +179,29 @@ public:
         }
     }
 
+    // 对满足条件的定时器立即执行回调并删除 与超时的处理相同(排空时用来关闭空闲连接)
+    template <typename Pred>
+    void expire_if(Pred pred)
+    {
+        util_timer *tmp = head;
+        while (tmp)
+        {
+            util_timer *next = tmp->next;
+            if (pred(tmp->user_data))
+            {
+                tmp->cb_func(tmp->user_data);
+                del_timer(tmp);
+            }
+            tmp = next;
+        }
+    }
+
+    // 最早的超时时间 事件循环据此设置下一次醒来的时刻；链表为空时返回0
+    long long next_expire() const
+    {
+        return head ? head->expire : 0;
+    }
+
     int get_list_size()
     {
         return size;
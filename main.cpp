@@ -9,11 +9,29 @@
 #include <stdlib.h>
 #include <cassert>
 #include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <getopt.h>
+#include <string>
+#include <vector>
 
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
 #include "lst_timer.h"
+#include "router.h"
+#include "mime.h"
+#include "config.h"
+#include "server_control.h"
+#include "upgrade.h"
+#include "master.h"
+#include "topology.h"
+#include "tls.h"
+#include "h2.h"
+#include "uring_server.h"
+#ifdef LWC_COROUTINE
+#include "coro_server.h"
+#endif
 
 // #define LT// 电平触发
 // // #define ET// 边沿触发
@@ -26,13 +44,18 @@
 //     bool http_conn::m_et = false;
 // #endif
 
-#define MAX_FD 65536
-#define MAX_EVENT_NUMBER 10000
-#define TIMESLOT 5
+// 运行时配置 默认值见server_config 启动时由配置文件和命令行选项确定，SIGHUP时重新加载其中可以在运行中修改的部分
+static server_config config;
+static const char *config_file = NULL; // -f指定的配置文件
+static std::vector<std::pair<std::string, std::string> > cli_settings; // 命令行上的参数 重新加载时同样优先于配置文件
+static std::string cli_mime_types; // -t给出的覆盖项 追加在mime_types之后，同一扩展名以它为准
+static server_control control; // 事件循环的运行参数 由配置得出
+static int listen_socket = -1;
+static pid_t upgrade_pid = -1; // 升级时启动的新进程
 
 extern int addfd(int epollfd, int fd, bool one_shot, int trig_mode);
 extern int removefd(int epollfd, int fd);
-extern int setnonblocking(int fd);
+extern void modfd(int epollfd, int fd, int ev);
 
 bool http_conn::m_et = false;
 
@@ -40,19 +63,19 @@ bool http_conn::m_et = false;
 static int epollfd = 0;
 
 // 设定定时器相关参数
-static int pipefd[2];           // 信号处理函数与主循环通信的管道
+static int timerfd = -1;         // 在最早的截止时间到期 唤醒事件循环处理定时任务
+static long long timer_armed = 0; // timerfd当前设置的到期时刻(monotonic_ms()的毫秒数) 0表示没有设置或已经到期
+static long long next_tick = 0;   // 下一次调用on_tick的时刻(毫秒)
 static sort_timer_lst timer_lst; // 升序链表定时器
 
-// 信号处理函数
-void sig_handler(int sig)
-{
-    // 保留原来的errno，在函数最后恢复，以保证函数的可重入性
-    int save_errno = errno;
-    int msg = sig;
-    // 将信号值写入管道已通知主循环
-    int ret = send(pipefd[1], (char *)&msg, 1, 0);
-    errno = save_errno;
-}
+// accept的暂停与恢复：fd快用完时从epoll中摘掉listenfd，新连接留在内核监听队列里而不是被accept后再拒绝
+static bool accept_paused = false;   // 是否已暂停accept
+static bool accept_emfile = false;   // 是否因进程fd耗尽(EMFILE/ENFILE)而暂停，这种情况只在定时器tick时重试
+static std::vector<int> tls_reads;   // OpenSSL中还有已解密数据或读缓冲区中有下一个请求的连接 epoll不会通知 由事件循环在本轮末尾直接读
+static http_conn *connections = NULL;          // 以fd为下标的连接表 关闭连接时释放其HTTP/2状态
+static threadpool<http_conn> *request_pool = NULL; // epoll后端解析请求的线程池
+
+static router routes; // 动态请求的路由表 启动时注册并编译，之后只读
 
 // 设置信号处理函数
 void addsig(int sig, void(handler)(int), bool restart = true)
@@ -68,14 +91,34 @@ void addsig(int sig, void(handler)(int), bool restart = true)
     assert(sigaction(sig, &sa, NULL) != -1);
 }
 
-// 定时处理任务，实际上就是调用tick函数
-void timer_handler()
+// 定时处理任务：关闭已超时的连接，到了tick的时刻再调用on_tick 返回是否tick了
+bool timer_handler()
 {
     printf("连接数量:%d\n",timer_lst.get_list_size());
     // 定时器链表有连接才会tick
     timer_lst.tick();
-    // 由于alarm只会引起一次SIGALARM信号，所以需要重新定时，以不断触发SIGALARM信号
-    alarm(TIMESLOT);
+    if (monotonic_ms() < next_tick)
+    {
+        return false;
+    }
+    if (control.on_tick)
+    {
+        control.on_tick(control);
+    }
+    next_tick = monotonic_ms() + control.timeslot * 1000LL;
+    return true;
+}
+
+// 按最早的截止时间设置timerfd
+// 截止时间推后时不必重设，提前到期的那次唤醒没有可处理的定时器，之后再按新的时刻设置
+void rearm_timer()
+{
+    long long next = next_wakeup(control, next_tick, timer_lst.next_expire());
+    if (timer_armed == 0 || next < timer_armed)
+    {
+        arm_timerfd(timerfd, next);
+        timer_armed = next;
+    }
 }
 
 // 定时器回调函数，删除非活动连接socket上的注册事件并关闭之
@@ -83,43 +126,804 @@ void cb_func(client_data *user_data)
 {
     epoll_ctl(epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
     assert(user_data);
+    connections[user_data->sockfd].on_closed();
     close(user_data->sockfd);// 关闭socket连接
     http_conn::m_user_count--;// 静态成员 所有对象共享 用户数量减1
+    if (user_data->counted)
+    {
+        http_conn::m_client_limits.disconnect(user_data->address.sin_addr.s_addr);
+        user_data->counted = false;
+    }
     printf("close fd %d\n",user_data->sockfd);
 }
 
+// 连接数已满时直接回一个完整的503响应后关闭，客户端能据此退避重试而不是读到一段裸字符串
 void show_error(int connfd, const char *info)
 {
     printf("%s", info);
-    send(connfd, info, strlen(info), 0);
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf),
+                       "HTTP/1.1 503 Service Unavailable\r\nRetry-After: %d\r\nContent-Length: %d\r\nConnection: close\r\n\r\n%s",
+                       http_conn::RETRY_AFTER_SECS, (int)strlen(info), info);
+    send(connfd, buf, len, MSG_NOSIGNAL);
     close(connfd);
 }
 
+// 注册监听socket 多进程模式下每个工作进程的epoll都监听它，EPOLLEXCLUSIVE使一个新连接只唤醒其中一个
+void add_listenfd(int listenfd, int listenfd_mode)
+{
+    epoll_event event;
+    event.data.fd = listenfd;
+    event.events = EPOLLIN;
+    if (listenfd_mode == 1)
+    {
+        event.events |= EPOLLET;
+    }
+    if (master::worker_index() >= 0)
+    {
+        event.events |= EPOLLEXCLUSIVE;
+    }
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &event);
+}
+
+// 暂停accept
+void pause_accept(int listenfd, bool emfile)
+{
+    if (!accept_paused)
+    {
+        printf("pause accept, user count:%d\n", http_conn::m_user_count);
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, listenfd, 0);
+        accept_paused = true;
+    }
+    accept_emfile = accept_emfile || emfile;
+}
+
+// 恢复accept 重新注册后如果监听队列里已有连接 epoll会立即通知
+void resume_accept(int listenfd, int listenfd_mode)
+{
+    if (accept_paused && !control.draining) // 排空时不再恢复
+    {
+        printf("resume accept, user count:%d\n", http_conn::m_user_count);
+        add_listenfd(listenfd, listenfd_mode);
+        accept_paused = false;
+        accept_emfile = false;
+    }
+}
+
+// 为新接受的连接初始化http_conn对象和定时器
+void add_client(http_conn *users, client_data *users_timer, int connfd, const sockaddr_in &client_address, int connfd_mode, bool counted)
+{
+    // 用socket值来做http_conn对象的索引 并初始化http_conn,添加connfd到内核事件表
+    users[connfd].init(connfd, client_address, connfd_mode);
+    // 初始化client_data
+    users_timer[connfd].address = client_address;
+    users_timer[connfd].sockfd = connfd;
+    users_timer[connfd].counted = counted;
+    // 该连接的定时器 升序定时器链表的节点
+    util_timer *timer = new util_timer;
+    timer->user_data = &users_timer[connfd];
+    timer->cb_func = cb_func;
+    timer->expire = users[connfd].deadline(monotonic_ms());
+    users_timer[connfd].timer = timer;
+    // 将timer插入到升序定时器链表
+    timer_lst.add_timer(timer);
+}
+
+// 批量接受新连接，每次最多max_accept_per_loop个，避免大量新连接饿死已有连接的I/O
+// accept4直接返回非阻塞、close-on-exec的connfd，省去setnonblocking的两次fcntl
+// 返回true表示达到单轮上限，监听队列里可能还有连接没取完
+bool deal_with_accept(int listenfd, http_conn *users, client_data *users_timer, int connfd_mode)
+{
+    for (int n = 0; n < control.max_accept_per_loop; ++n)
+    {
+        if (http_conn::m_user_count >= control.high_watermark)
+        {
+            pause_accept(listenfd, false);
+            return false;
+        }
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof(client_address);
+        // 接受连接，获取被接受的远程socket地址
+        int connfd = accept4(listenfd, (struct sockaddr *)&client_address, &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) // 被信号中断/对方在accept前已经断开 继续取下一个
+            {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) // fd耗尽 LT模式下不暂停会在这里空转
+            {
+                pause_accept(listenfd, true);
+                return false;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) // 监听队列已经取空之外的错误
+            {
+                printf("errno is: %d\n", errno);
+            }
+            return false;
+        }
+        if (connfd >= config.max_fd) // users数组以fd为下标 不能越界
+        {
+            show_error(connfd, "Internal server busy");
+            continue;
+        }
+        bool counted;
+        if (!http_conn::m_client_limits.connect(client_address.sin_addr.s_addr, counted)) // 该IP的连接数已达上限 不占用连接对象
+        {
+            close(connfd);
+            continue;
+        }
+        add_client(users, users_timer, connfd, client_address, connfd_mode, counted);
+    }
+    return true;
+}
+
+// 关闭连接并删除其定时器 只在事件循环中调用
+void close_client(client_data *users_timer, int sockfd)
+{
+    util_timer *timer = users_timer[sockfd].timer;
+    cb_func(&users_timer[sockfd]);
+    if (timer)
+    {
+        timer_lst.del_timer(timer);
+    }
+}
+
+// 连接上有读写 重置其定时器并调整在链表上的位置
+void refresh_timer(client_data *users_timer, int sockfd)
+{
+    util_timer *timer = users_timer[sockfd].timer;
+    if (timer)
+    {
+        printf("定时器重置\n");
+        timer->expire = connections[sockfd].deadline(monotonic_ms()); // 按连接所处的阶段
+        timer_lst.adjust_timer(timer);
+    }
+}
+
+// 写出响应 写成功时重置定时器，出错或响应后不保持连接时关闭
+void deal_with_write(http_conn *users, client_data *users_timer, int sockfd)
+{
+    if (!users[sockfd].write()) // 从socket对应内核写缓冲区中非阻塞写
+    {
+        close_client(users_timer, sockfd);
+        return;
+    }
+    refresh_timer(users_timer, sockfd);
+}
+
+// 执行请求处理完后的动作 epoll事件表、定时器链表和连接的关闭都只在事件循环中修改
+void apply_completion(http_conn *users, client_data *users_timer, int sockfd, completion_queue::action act)
+{
+    switch (act)
+    {
+    case completion_queue::WANT_READ: // 请求不完整 重置EPOLLONESHOT继续读
+        refresh_timer(users_timer, sockfd); // 解析后才知道是否已进入消息体
+        if (users[sockfd].read_pending() || users[sockfd].pipelined())
+        {
+            tls_reads.push_back(sockfd); // 保持独占 相当于已经收到一个可读事件
+            break;
+        }
+        modfd(epollfd, sockfd, EPOLLIN);
+        break;
+    case completion_queue::WANT_WRITE: // 刚构造好的响应多半能直接写进空的发送缓冲区 省去一次EPOLLOUT
+        deal_with_write(users, users_timer, sockfd);
+        break;
+    case completion_queue::CLOSE:
+        close_client(users_timer, sockfd);
+        break;
+    }
+}
+
+// 执行工作线程投递的完成项
+void deal_with_completions(completion_queue *completions, http_conn *users, client_data *users_timer)
+{
+    static std::vector<completion_queue::completion> done; // 复用 避免每批重新分配
+    completions->take(done);
+    for (size_t i = 0; i < done.size(); ++i)
+    {
+        // 投递之后该fd上的连接已经关闭并被新连接复用 这一项不属于当前连接
+        bool current = users[done[i].fd].generation() == done[i].generation;
+        if (!done[i].stream)
+        {
+            if (!current)
+            {
+                printf("stale completion for fd %d dropped\n", done[i].fd);
+                continue;
+            }
+            users[done[i].fd].set_in_flight(false);
+            apply_completion(users, users_timer, done[i].fd, done[i].act);
+        }
+        else if (h2_session::complete(done[i].stream, done[i].act)) // HTTP/2连接上的一个请求 响应随即写出 连接已关闭时只释放流
+        {
+            if (current)
+            {
+                refresh_timer(users_timer, done[i].fd);
+            }
+        }
+        else if (current)
+        {
+            close_client(users_timer, done[i].fd);
+        }
+    }
+}
+
+// 把请求交给线程池 能在事件循环中快速完成的就地完成，返回true并由act给出后续动作
+// HTTP/1.1连接和HTTP/2连接上的各个请求都经过这里
+bool dispatch_request(http_conn *conn, completion_queue::action &act)
+{
+    if (config.inline_requests && conn->process_inline(act)) // 不需要工作线程
+    {
+        return true;
+    }
+    // 往线程池的请求队列中添加任务:http_conn对象
+    // 在途请求已满时直接回503 否则该连接的EPOLLONESHOT不会被重置 连接就此挂起
+    // 单连接的在途请求数由EPOLLONESHOT保证至多为1
+    if (!request_pool->append(conn))
+    {
+        conn->shed();
+    }
+    return false;
+}
+
+// 读出请求并交给工作线程 能在事件循环中快速完成的就地完成；读出错时关闭连接
+void deal_with_read(http_conn *users, client_data *users_timer, int sockfd)
+{
+    // 根据读的结果决定是将任务添加到线程池还是关闭连接
+    if (users[sockfd].read()) // 从socket对应内核读缓冲区中非阻塞读到对应http_conn的应用缓冲区
+    {
+        // 读成功 定时器重置 并调整其在链表上的位置 内联处理可能随即关闭连接并删除定时器 所以先重置
+        refresh_timer(users_timer, sockfd);
+        bool keep;
+        if (config.http2 && h2_session::on_read(users + sockfd, keep)) // HTTP/2连接 读到的帧已处理完
+        {
+            if (!keep)
+            {
+                close_client(users_timer, sockfd);
+            }
+            return;
+        }
+        completion_queue::action act;
+        // 先置位再交出 工作线程开始处理后事件循环不能再读写这个连接对象
+        users[sockfd].set_in_flight(true);
+        if (dispatch_request(users + sockfd, act))
+        {
+            users[sockfd].set_in_flight(false);
+            apply_completion(users, users_timer, sockfd, act);
+        }
+        else
+        {
+            refresh_timer(users_timer, sockfd); // 处理期间不会到期 完成项执行时再按所处的阶段设置
+        }
+    }
+    else// 读错误 需要关闭连接
+    {
+        close_client(users_timer, sockfd);
+    }
+}
+
+// 健康检查
+http_conn::HTTP_CODE health_handler(http_conn *conn)
+{
+    return conn->respond(200, "200 OK", "ok\n");
+}
+
+// 运行指标 文本格式
+// 多进程模式下为所有工作进程的合计 其他工作进程的数值每个tick更新一次，另附各工作进程的分项
+http_conn::HTTP_CODE metrics_handler(http_conn *conn)
+{
+    worker_stats total;
+    if (!master::totals(total))
+    {
+        total.connections = http_conn::m_user_count;
+        total.requests = __atomic_load_n(&http_conn::m_request_count, __ATOMIC_RELAXED);
+        total.inline_requests = __atomic_load_n(&http_conn::m_inline_count, __ATOMIC_RELAXED);
+        total.offloaded_requests = __atomic_load_n(&http_conn::m_offload_count, __ATOMIC_RELAXED);
+        total.tls_handshakes = __atomic_load_n(&tls_context::m_handshakes, __ATOMIC_RELAXED);
+        total.tls_resumed = __atomic_load_n(&tls_context::m_resumed, __ATOMIC_RELAXED);
+        total.tls_ktls = __atomic_load_n(&tls_context::m_ktls, __ATOMIC_RELAXED);
+        total.h2_sessions = h2_session::m_session_count;
+        total.h2_streams = h2_session::m_stream_count;
+        total.rejected_connections = __atomic_load_n(&http_conn::m_client_limits.m_rejected_connections, __ATOMIC_RELAXED);
+        total.limited_requests = __atomic_load_n(&http_conn::m_client_limits.m_limited_requests, __ATOMIC_RELAXED);
+    }
+    char buf[768];
+    int len = snprintf(buf, sizeof(buf), "lwc_connections %d\nlwc_requests_total %lld\nlwc_inline_requests_total %lld\nlwc_offloaded_requests_total %lld\n",
+                       total.connections, total.requests, total.inline_requests, total.offloaded_requests);
+    if (http_conn::m_tls)
+    {
+        len += snprintf(buf + len, sizeof(buf) - len, "lwc_tls_handshakes_total %lld\nlwc_tls_resumed_total %lld\nlwc_tls_ktls_total %lld\n",
+                        total.tls_handshakes, total.tls_resumed, total.tls_ktls);
+    }
+    if (config.http2)
+    {
+        len += snprintf(buf + len, sizeof(buf) - len, "lwc_h2_sessions_total %lld\nlwc_h2_streams_total %lld\n",
+                        total.h2_sessions, total.h2_streams);
+    }
+    if (http_conn::m_client_limits.enabled())
+    {
+        snprintf(buf + len, sizeof(buf) - len, "lwc_client_rejected_connections_total %lld\nlwc_client_limited_requests_total %lld\n",
+                 total.rejected_connections, total.limited_requests);
+    }
+    return conn->respond(200, "200 OK", buf + master::metrics(), "Content-Type: text/plain; version=0.0.4\r\n");
+}
+
+// 接收上传 消息体已由默认的处理回调保存，这里只回复收到的字节数
+http_conn::HTTP_CODE upload_handler(http_conn *conn)
+{
+    std::string name = conn->param("name");
+    char buf[256];
+    snprintf(buf, sizeof(buf), "received %lld bytes%s%s\n", conn->body_length(),
+             name.empty() ? "" : " for ", name.c_str());
+    return conn->respond(200, "200 OK", buf);
+}
+
+// /stream/:size最多生成的字节数
+static const long long STREAM_MAX_SIZE = 256LL * 1024 * 1024;
+
+// 流式响应的生产者：生成/stream/:size指定字节数的文本 长度已由stream_handler检查
+int stream_producer(http_conn *conn, char *buf, int size)
+{
+    long long total = atoll(conn->param("size").c_str());
+    long long left = total - conn->stream_offset();
+    int n = left < size ? left : size;
+    for (int i = 0; i < n; ++i)
+    {
+        long long pos = conn->stream_offset() + i;
+        buf[i] = (pos % 64 == 63) ? '\n' : 'a' + pos % 26;
+    }
+    return n > 0 ? n : 0;
+}
+
+// 长度事先未知的响应 以chunked编码边生成边发送 可用于测试大响应和发送背压
+// size只能是不超过STREAM_MAX_SIZE的十进制数
+http_conn::HTTP_CODE stream_handler(http_conn *conn)
+{
+    std::string size = conn->param("size");
+    if (size.empty() || size.size() > 10 || size.find_first_not_of("0123456789") != std::string::npos ||
+        atoll(size.c_str()) > STREAM_MAX_SIZE)
+    {
+        return conn->respond(400, "400 Bad Request", "size must be a number of bytes up to 268435456\n");
+    }
+    return conn->stream(200, "200 OK", stream_producer, "Content-Type: text/plain\r\n");
+}
+
+// 注册内置的动态路由 其余GET请求访问doc_root下的静态文件
+void register_routes()
+{
+    routes.add(ROUTE_METHOD(GET), "/health", health_handler);
+    routes.add(ROUTE_METHOD(GET), "/metrics", metrics_handler);
+    if (config.test_routes) // 测试用 任何客户端都能借它们占用带宽和临时文件空间
+    {
+        routes.add(ROUTE_METHOD(GET), "/stream/:size", stream_handler);
+        routes.add(ROUTE_METHOD(POST) | ROUTE_METHOD(PUT), "/upload", upload_handler);
+        routes.add(ROUTE_METHOD(POST) | ROUTE_METHOD(PUT), "/upload/:name", upload_handler);
+    }
+    routes.compile();
+    http_conn::m_router = &routes;
+}
+
+// 按默认值、配置文件、命令行的顺序确定配置 后者覆盖前者
+bool load_config(server_config &cfg)
+{
+    if (config_file && !cfg.load_file(config_file))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < cli_settings.size(); ++i)
+    {
+        if (!cfg.set(cli_settings[i].first.c_str(), cli_settings[i].second.c_str()))
+        {
+            return false;
+        }
+    }
+    if (!cli_mime_types.empty())
+    {
+        cfg.mime_types += cfg.mime_types.empty() ? cli_mime_types : "," + cli_mime_types;
+    }
+    return cfg.validate();
+}
+
+// 根据配置和进程的fd上限确定事件循环的运行参数
+void apply_control()
+{
+    control.timeslot = config.timeslot;
+    control.max_accept_per_loop = config.max_accept_per_loop;
+    __atomic_store_n(&http_conn::m_keep_alive_timeout, config.keepalive_timeout, __ATOMIC_RELAXED);
+    __atomic_store_n(&http_conn::m_keep_alive_requests, config.keepalive_requests, __ATOMIC_RELAXED);
+    __atomic_store_n(&http_conn::m_header_timeout, config.header_timeout, __ATOMIC_RELAXED);
+    __atomic_store_n(&http_conn::m_body_timeout, config.body_timeout, __ATOMIC_RELAXED);
+    __atomic_store_n(&http_conn::m_send_timeout, config.send_timeout, __ATOMIC_RELAXED);
+    __atomic_store_n(&http_conn::m_send_min_rate, config.send_min_rate, __ATOMIC_RELAXED);
+    http_conn::m_client_limits.configure(config.client_max_connections, config.client_request_rate, config.client_request_burst);
+    // 暂停/恢复accept的水位
+    struct rlimit rl;
+    int fd_limit = config.max_fd;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && (int)rl.rlim_cur < fd_limit)
+    {
+        fd_limit = rl.rlim_cur;
+    }
+    control.high_watermark = fd_limit > 2 * config.fd_reserve ? fd_limit - config.fd_reserve : fd_limit / 2;
+    control.low_watermark = control.high_watermark * 9 / 10;
+}
+
+// 线程放置：事件循环(本线程)和线程池放在同一个NUMA节点上，连接对象和缓冲区也从这个节点分配
+// 在创建线程池和连接表之前调用；返回工作线程可以使用的CPU，为空表示不做任何绑定(由调度器决定)
+// 节点：numa_node指定；否则工作进程已被master绑定到一个CPU时取该CPU的节点；否则pin_threads时取当前所在CPU的节点
+std::vector<int> place_reactor(bool &pin_each)
+{
+    std::vector<int> current = cpu_topology::current_cpus();
+    bool pinned = master::worker_index() >= 0 && current.size() == 1; // master已绑定本工作进程
+    int node = config.numa_node;
+    if (node < 0 && pinned)
+    {
+        node = cpu_topology::node_of(current[0]);
+    }
+    else if (node < 0 && config.pin_threads)
+    {
+        node = cpu_topology::node_of(sched_getcpu());
+    }
+    if (node < 0 || cpu_topology::node_cpus(node).empty())
+    {
+        pin_each = false;
+        return std::vector<int>();
+    }
+
+    std::vector<int> cpus = cpu_topology::node_cpus(node);
+    int reactor = -1;
+    if (pinned && cpu_topology::node_of(current[0]) == node)
+    {
+        reactor = current[0];
+    }
+    else if (config.pin_threads)
+    {
+        reactor = cpus[0];
+        cpu_topology::pin_current_thread(reactor);
+    }
+    else
+    {
+        cpu_topology::pin_current_thread(cpus);
+    }
+    // 之后在本线程分配的users[]、各连接的读写缓冲区，以及线程池线程分配的内存都优先放在该节点上
+    cpu_topology::prefer_node(node);
+
+    // 工作线程尽量不与事件循环共用一个核 master只绑定了进程时，工作线程在整个节点上调度而不是挤在同一个核上
+    if (reactor >= 0 && cpus.size() > 1)
+    {
+        for (size_t i = 0; i < cpus.size(); ++i)
+        {
+            if (cpus[i] == reactor)
+            {
+                cpus.erase(cpus.begin() + i);
+                break;
+            }
+        }
+    }
+    pin_each = config.pin_threads;
+    printf("threads on numa node %d: event loop on %s%d, pool threads %s %d cpus\n", node,
+           reactor >= 0 ? "cpu " : "cpus of node ", reactor >= 0 ? reactor : node,
+           pin_each ? "pinned to" : "scheduled across", (int)cpus.size());
+    return cpus;
+}
+
+// SIGHUP：重新读取配置 只应用可以在运行中修改的参数，其余的提示需要升级(SIGUSR2)才能生效
+void reload_config()
+{
+    server_config next;
+    if (!load_config(next))
+    {
+        printf("reload failed, keeping current configuration\n");
+        return;
+    }
+    std::string fixed = config.restart_changes(next);
+    if (!fixed.empty())
+    {
+        printf("not reloaded, need upgrade to change: %s\n", fixed.c_str());
+    }
+    if (next.doc_root != config.doc_root && !http_conn::open_doc_root(next.doc_root.c_str()))
+    {
+        printf("cannot open doc_root %s: %s, keeping %s\n", next.doc_root.c_str(), strerror(errno), config.doc_root.c_str());
+        next.doc_root = config.doc_root;
+    }
+    // 格式已由validate检查过
+    if (next.mime_types != config.mime_types)
+    {
+        mime::set_overrides(next.mime_types);
+    }
+    config.apply_reloadable(next);
+    apply_control();
+    // 再次listen只修改监听队列长度
+    listen(listen_socket, config.backlog);
+    setsockopt(listen_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.defer_accept, sizeof(config.defer_accept));
+    printf("configuration reloaded\n");
+}
+
+// 开始排空：停止accept，之后的响应都带Connection: close，已有连接全部关闭或到截止时间后事件循环退出
+void begin_drain(server_control &ctl, const char *reason)
+{
+    printf("%s, draining %d connections\n", reason, http_conn::m_user_count);
+    ctl.draining = true;
+    ctl.drain_deadline = monotonic_ms() + config.drain_timeout * 1000LL;
+    __atomic_store_n(&http_conn::m_draining, true, __ATOMIC_RELAXED);
+}
+
+// 事件循环退出后 排空到截止时间仍未关闭的连接直接复位
+void abort_remaining(http_conn *users)
+{
+    for (int fd = 0; http_conn::m_user_count > 0 && fd < config.max_fd; ++fd)
+    {
+        users[fd].abort_conn();
+    }
+}
+
+// 每个定时器tick调用
+void on_control_tick(server_control &)
+{
+    master::publish();
+}
+
+// 事件循环在处理完一批事件后调用
+void on_control_signal(int sig, server_control &ctl)
+{
+    switch (sig)
+    {
+    case SIGTERM: // 终止进程 排空中再次收到时立即退出
+        if (ctl.draining)
+        {
+            ctl.drain_deadline = monotonic_ms();
+        }
+        else
+        {
+            begin_drain(ctl, "stopping");
+        }
+        break;
+    case SIGHUP: // 重新加载配置
+        reload_config();
+        break;
+    case SIGUSR2: // 升级：启动新的可执行文件并把监听socket交给它
+        if (master::worker_index() >= 0) // 多进程模式下由主进程升级 旧主进程再让工作进程排空
+        {
+            printf("send SIGUSR2 to the master process to upgrade\n");
+        }
+        else if (upgrade::running(upgrade_pid))
+        {
+            printf("upgrade already in progress (pid %d)\n", upgrade_pid);
+        }
+        else if (!ctl.draining)
+        {
+            upgrade_pid = upgrade::start(listen_socket);
+        }
+        break;
+    case SIGUSR1: // 新进程已就绪 停止accept 处理完已有连接后退出
+        if (upgrade::running(upgrade_pid) && !ctl.draining)
+        {
+            char reason[64];
+            snprintf(reason, sizeof(reason), "new process %d ready", upgrade_pid);
+            begin_drain(ctl, reason);
+        }
+        break;
+    }
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc <= 2)
+    upgrade::save_command(argc, argv);
+
+    // 长选项由配置参数表生成 "--键=值"与配置文件中的同名参数等价
+    std::vector<struct option> long_options;
+    for (int i = 0; i < server_config::option_count(); ++i)
     {
-        printf("usage: %s ip_address port_number\n", basename(argv[0]));
+        struct option o = {server_config::option_name(i), required_argument, NULL, 256 + i};
+        long_options.push_back(o);
+    }
+    struct option end_option = {NULL, 0, NULL, 0};
+    long_options.push_back(end_option);
+
+    // 命令行上的参数先记下来 读完配置文件后再应用，使命令行优先于配置文件
+    bool usage = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:e:t:c:", &long_options[0], NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            config_file = optarg;
+            break;
+        case 'e': // 事件后端 epoll:就绪通知 uring:io_uring异步I/O(不可用时回落到epoll) coro:C++20协程引擎
+            cli_settings.push_back(std::make_pair("engine", optarg));
+            break;
+        case 't': // 扩展名=MIME类型 覆盖内置表 可以重复
+            cli_mime_types += cli_mime_types.empty() ? "" : ",";
+            cli_mime_types += optarg;
+            break;
+        case 'c': // 文本类型的默认字符集 为空时不附加
+            cli_settings.push_back(std::make_pair("charset", optarg));
+            break;
+        default:
+            if (opt >= 256 && opt < 256 + server_config::option_count())
+            {
+                cli_settings.push_back(std::make_pair(server_config::option_name(opt - 256), optarg));
+            }
+            else
+            {
+                usage = true;
+            }
+            break;
+        }
+    }
+    // 位置参数 ip_address port_number [backlog] [defer_accept_secs] 兼容原来的用法
+    const char *positional[] = {"ip", "port", "backlog", "defer_accept"};
+    for (int i = 0; optind + i < argc; ++i)
+    {
+        if (i >= 4)
+        {
+            usage = true;
+            break;
+        }
+        cli_settings.push_back(std::make_pair(positional[i], argv[optind + i]));
+    }
+
+    bool valid = !usage && load_config(config);
+#ifndef LWC_COROUTINE
+    if (valid && config.engine == "coro")
+    {
+        printf("coroutine engine is not built in\n");
+        valid = false;
+    }
+#endif
+    if (!valid)
+    {
+        printf("usage: %s [-f config_file] [-e epoll|uring|coro] [-t ext=mime_type]... [-c charset] [--key=value]... "
+               "[ip_address port_number [backlog] [defer_accept_secs]]\n", basename(argv[0]));
+        server_config::print_options(stdout);
         return 1;
     }
-    const char *ip = argv[1];
-    int port = atoi(argv[2]);
+    const char *backend = config.engine.c_str();
+    mime::set_charset(config.charset.c_str());
+    mime::set_overrides(config.mime_types);
+    http_conn::m_read_buffer_size = config.read_buffer_size;
+    http_conn::m_write_buffer_size = config.write_buffer_size;
 
-    // 监听socket的触发模式
-    int listenfd_mode = 0;// 0:LT 1:ET
-    // 连接socket的触发模式
-    int connfd_mode = 1;// 0:LT 1:ET
+    // 监听socket的触发模式 0:LT 1:ET
+    int listenfd_mode = config.listenfd_mode;
+    // 连接socket的触发模式 0:LT 1:ET
+    int connfd_mode = config.connfd_mode;
     if (connfd_mode)
     {
         http_conn::m_et = true;
     }
-   
+
+    register_routes();
+    // 目标文件都相对网站根目录的fd打开
+    if (!http_conn::open_doc_root(config.doc_root.c_str()))
+    {
+        printf("cannot open doc_root %s: %s\n", config.doc_root.c_str(), strerror(errno));
+        return 1;
+    }
+
+    // HTTPS 在fork工作进程之前创建，各工作进程共用会话票据密钥
+    if (!config.tls_cert.empty())
+    {
+        try
+        {
+            http_conn::m_tls = new tls_context(config.tls_cert, config.tls_key, config.tls_session_cache,
+                                               config.tls_session_tickets, config.ktls, config.http2);
+        }
+        catch (...)
+        {
+            return 1;
+        }
+    }
+
+    // 定时器间隔、accept水位等事件循环的运行参数
+    apply_control();
+    control.draining = false;
+    control.on_signal = on_control_signal;
+    control.on_tick = on_control_tick;
+
+    int ret = 0;
+    // 由旧进程升级启动时直接使用它交过来的监听socket 不再bind
+    int listenfd = upgrade::inherit_listen_fd();
+    if (listenfd < 0)
+    {
+        // IPv4 TCP 0:默认协议 创建时直接设为非阻塞
+        listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        // 失败返回-1
+        assert(listenfd >= 0);
+
+        // l_onoff != 0 l_linger = 0
+        // close()立刻返回，但不会发送未发送完成的数据，而是通过一个REST包强制关闭(没有四次挥手)socket描述符，即强制退出。
+        // 这里{1,0}强制关闭使得客户读出错 errno=104
+        // struct linger tmp = { 0, 0 };
+        // 设置socket选项
+        // setsockopt( listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof( tmp ) );
+
+        // 强制使用被处于TIME_WAIT状态的连接占用的socket地址
+        int reuse = 1;
+        // 设置socket选项
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        // 专用socket地址IPv4
+        struct sockaddr_in address;
+        // 将字符串s的前n个字节置为0
+        bzero(&address, sizeof(address));
+        // 地址族设为IPv4
+        address.sin_family = AF_INET;
+        // 将字符串表示的IP地址（点分十进制）转换为网络字节序整数表示的IP地址
+        if (inet_pton(AF_INET, config.ip.c_str(), &address.sin_addr) != 1)
+        {
+            printf("invalid ip address %s\n", config.ip.c_str());
+            return 1;
+        }
+        // 将整型变量从主机字节顺序(小端)转变成网络字节顺序(大端)
+        address.sin_port = htons(config.port);
+
+        // 给socket命名
+        ret = bind(listenfd, (struct sockaddr *)&address, sizeof(address));
+        assert(ret >= 0);
+    }
+    listen_socket = listenfd;
+    // 连接上有数据到达后才唤醒accept，减少只建连不发请求的空唤醒
+    if (config.defer_accept > 0)
+    {
+        setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.defer_accept, sizeof(config.defer_accept));
+    }
+
+    // 监听socket 创建一个监听队列以存放待处理的客户连接 对继承的监听socket再次listen只修改队列长度
+    // 监听队列长度 高并发建连时过小的backlog会导致SYN/全连接队列溢出
+    ret = listen(listenfd, config.backlog);
+    assert(ret >= 0);
+
+    // 拓扑在master绑定工作进程之前读取 这时的亲和性才是整个进程可以使用的CPU
+    cpu_topology::discover();
+    if (config.pin_threads || config.numa_node >= 0)
+    {
+        printf("cpu topology: %s\n", cpu_topology::describe().c_str());
+    }
+    if (config.numa_node >= cpu_topology::node_count())
+    {
+        printf("numa_node %d out of range\n", config.numa_node);
+        close(listenfd);
+        return 1;
+    }
+
+    // 多进程模式：主进程在这里fork出工作进程并监控它们，只有工作进程继续往下初始化
+    // 线程池、连接表和定时器都在fork之后创建，每个工作进程各有一份
+    if (config.workers > 0)
+    {
+        int status = 0;
+        if (!master::start(listenfd, config.workers, config.pin_workers, status))
+        {
+            close(listenfd);
+            return status;
+        }
+    }
+
+    // 事件循环处理的信号改由signalfd读取 要在创建线程池之前屏蔽，之后创建的线程都继承这个屏蔽字
+    int sigfd = open_signalfd();
+    if (sigfd < 0)
+    {
+        printf("cannot create signalfd: %s\n", strerror(errno));
+        close(listenfd);
+        return 1;
+    }
+
+    // 事件循环线程先就位 之后创建的线程池和连接表都落在它所在的NUMA节点上
+    bool pin_each = false;
+    std::vector<int> pool_cpus = place_reactor(pin_each);
+
     // 创建线程池
     threadpool<http_conn> *pool = NULL;
+    threadpool<file_task> *file_pool = NULL;
     try
     {
         // 初始化线程池，子线程用信号量来同步任务的竞争
-        pool = new threadpool<http_conn>;
+        pool = new threadpool<http_conn>(config.threads, config.max_requests);
+        // 阻塞I/O线程池 工作线程解析完请求后把目标文件的stat/open/mmap交给它
+        file_pool = new threadpool<file_task>(config.file_io_threads);
+        // 工作线程可以逐个绑定 阻塞I/O线程大部分时间在等待磁盘，只限定在节点内
+        pool->set_affinity(pool_cpus, pin_each);
+        file_pool->set_affinity(pool_cpus, false);
     }
     catch (...)
     {
@@ -127,85 +931,119 @@ int main(int argc, char *argv[])
     }
 
     // 预先为每个可能的客户连接分配一个http_conn对象
-    http_conn *users = new http_conn[MAX_FD];
+    http_conn *users = new http_conn[config.max_fd];
     assert(users);
     int user_count = 0;
 
-    // IPv4 TCP 0:默认协议
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-    // 失败返回-1
-    assert(listenfd >= 0);
-
-    // l_onoff != 0 l_linger = 0
-    // close()立刻返回，但不会发送未发送完成的数据，而是通过一个REST包强制关闭(没有四次挥手)socket描述符，即强制退出。
-    // 这里{1,0}强制关闭使得客户读出错 errno=104
-    // struct linger tmp = { 0, 0 };
-    // 设置socket选项
-    // setsockopt( listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof( tmp ) );
 
-    // 强制使用被处于TIME_WAIT状态的连接占用的socket地址
-    int reuse = 1;
-    // 设置socket选项
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    // SIG_IGN表示忽略SIGPIPE信号
+    // SIGTERM(终止进程，kill命令默认信号)、SIGHUP(重新加载配置)、SIGUSR2(升级)、SIGUSR1(新进程就绪)已经屏蔽，
+    // 由事件循环从signalfd读出，处理完一批事件后交给on_control_signal
+    addsig(SIGPIPE, SIG_IGN);
 
-    int ret = 0;
-    // 专用socket地址IPv4
-    struct sockaddr_in address;
-    // 将字符串s的前n个字节置为0
-    bzero(&address, sizeof(address));
-    // 地址族设为IPv4
-    address.sin_family = AF_INET;
-    // 将字符串表示的IP地址（点分十进制）转换为网络字节序整数表示的IP地址
-    inet_pton(AF_INET, ip, &address.sin_addr);
-    // 将整型变量从主机字节顺序(小端)转变成网络字节顺序(大端)
-    address.sin_port = htons(port);
-
-    // 给socket命名
-    ret = bind(listenfd, (struct sockaddr *)&address, sizeof(address));
-    assert(ret >= 0);
+    if (strcmp(backend, "uring") == 0)
+    {
+        uring_server *server = NULL;
+        try
+        {
+            server = new uring_server(listenfd, sigfd, users, config.max_fd, control);
+        }
+        catch (...)
+        {
+            printf("io_uring unavailable, falling back to epoll\n");
+        }
+        if (server)
+        {
+            // io_uring后端在事件循环线程上解析请求 不需要线程池
+            upgrade::notify_ready();
+            ret = server->run();
+            delete server;
+            close(listenfd);
+            close(sigfd);
+            abort_remaining(users);
+            delete[] users;
+            delete pool;
+            delete file_pool;
+            return ret == 0 ? 0 : 1;
+        }
+    }
 
-    // 监听socket 创建一个监听队列以存放待处理的客户连接
-    ret = listen(listenfd, 5);
-    assert(ret >= 0);
+#ifdef LWC_COROUTINE
+    if (strcmp(backend, "coro") == 0)
+    {
+        // 协程引擎有自己的事件循环和阻塞I/O线程池
+        upgrade::notify_ready();
+        ret = coro_server_run(listenfd, sigfd, users, config.max_fd, config.file_io_threads, control);
+        close(listenfd);
+        close(sigfd);
+        abort_remaining(users);
+        delete[] users;
+        delete pool;
+        delete file_pool;
+        return ret;
+    }
+#endif
 
     // 指定事件
-    epoll_event events[MAX_EVENT_NUMBER];
+    std::vector<epoll_event> events(config.max_events);
     // 文件描述符指示内核事件表(提示大小)
     epollfd = epoll_create(5);
     assert(epollfd != -1);
     // 将文件描述符listenfd上的某个事件注册到epollfd指示的内核事件表 指定是否对fd启用ET模式
-    addfd(epollfd, listenfd, false, listenfd_mode);
+    add_listenfd(listenfd, listenfd_mode);
     // 所有socket上的事件都被注册到同一个epoll内核事件表中，所以设置为静态的
     http_conn::m_epollfd = epollfd;
-
-    // 创建信号处理函数与主线程通信的管道
-    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
-    assert(ret != -1);
-    // 写端非阻塞
-    setnonblocking(pipefd[1]);
-    // 注册管道读端的可读事件 默认LT
-    addfd(epollfd, pipefd[0], false, 0);
-
-    //设置信号处理函数
-    // 闹钟超时引起
-    addsig(SIGALRM, sig_handler, false);
-    // 终止进程，kill命令默认信号
-    addsig(SIGTERM, sig_handler, false);
-    // SIG_IGN表示忽略SIGPIPE信号
-    addsig(SIGPIPE, SIG_IGN);
+    // 注册signalfd和timerfd的可读事件 默认LT
+    addfd(epollfd, sigfd, false, 0);
+    timerfd = open_timerfd();
+    if (timerfd < 0)
+    {
+        printf("cannot create timerfd: %s\n", strerror(errno));
+        return 1;
+    }
+    addfd(epollfd, timerfd, false, 0);
+    http_conn::m_file_pool = file_pool;
+    // 工作线程处理完请求后通过完成队列通知事件循环 它的eventfd同样以LT注册
+    completion_queue *completions = NULL;
+    try
+    {
+        completions = new completion_queue;
+    }
+    catch (...)
+    {
+        printf("cannot create eventfd\n");
+        return 1;
+    }
+    addfd(epollfd, completions->fd(), false, 0);
+    http_conn::m_completions = completions;
+    connections = users;
+    request_pool = pool;
+    // HTTP/2连接上的请求与HTTP/1.1的请求走同一条内联/线程池路径
+    h2_session::m_dispatch = dispatch_request;
+    h2_session::m_max_streams = config.h2_max_streams;
 
     // 预先为每个客户连接分配的,包含connfd,socket远程地址,指向http_conn对应的定时器节点的指针等
-    client_data *users_timer = new client_data[MAX_FD];
+    client_data *users_timer = new client_data[config.max_fd];
 
     bool stop_server = false;
     bool timeout = false;
-    // TIMESLOT秒后将信号SIGALARM发到当前进程
-    alarm(TIMESLOT);
+    // ET模式下单轮accept达到上限时置位，下一轮不阻塞等待并继续取监听队列
+    bool accept_pending = false;
+    // 第一次tick在timeslot秒后 之后每处理完一批事件按最早的截止时间重设timerfd
+    next_tick = monotonic_ms() + control.timeslot * 1000LL;
+    rearm_timer();
+    // 等待本批事件处理完后交给on_control_signal的信号
+    unsigned pending_signals = 0;
+    bool drain_started = false; // 已停止accept并关闭了空闲连接
+    // 初始化完成 由旧进程升级启动时通知它开始排空
+    upgrade::notify_ready();
 
     while (!stop_server)
     {
         // epoll_wait返回就绪的文件描述符的个数
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        // 定时任务和排空的截止时间都由timerfd唤醒 不需要超时
+        // 信号不再有处理函数 只有进程被暂停后继续(SIGSTOP/SIGCONT)时epoll_wait才会返回EINTR
+        int number = epoll_wait(epollfd, &events[0], config.max_events, accept_pending ? 0 : -1);
         if ((number < 0) && (errno != EINTR))
         {
             printf("epoll failure\n");
@@ -219,198 +1057,116 @@ int main(int argc, char *argv[])
             if (sockfd == listenfd) // 新的连接请求
             {
                 printf("incoming socket\n");
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                
-                if (listenfd_mode == 0)
-                {
-                    // 接受连接，获取被接受的远程socket地址
-                    int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlength);
-                    if (connfd < 0)
-                    {
-                        printf("errno is: %d\n", errno);
-                        continue;
-                    }
-                    if (http_conn::m_user_count >= MAX_FD)
-                    {
-                        show_error(connfd, "Internal server busy");
-                        continue;
-                    }
-                    // 用socket值来做http_conn对象的索引 并初始化http_conn,添加connfd到内核事件表
-                    users[connfd].init(connfd, client_address, connfd_mode);
-                    // 初始化client_data
-                    users_timer[connfd].address = client_address;
-                    users_timer[connfd].sockfd = connfd;
-                    // 该连接的定时器 升序定时器链表的节点
-                    util_timer *timer = new util_timer;
-                    timer->user_data = &users_timer[connfd];
-                    timer->cb_func = cb_func;
-                    time_t cur = time(NULL);
-                    timer->expire = cur + 3 * TIMESLOT;
-                    users_timer[connfd].timer = timer;
-                    // 将timer插入到升序定时器链表
-                    timer_lst.add_timer(timer);
-                }
-                else
-                {
-                    // 边沿触发 必须立即全部读完 后续epoll_wait不再通知
-                    while (1)
-                    {
-                        // 接受连接，获取被接受的远程socket地址
-                        int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlength);
-                        if (connfd < 0)
-                        {
-                            printf("errno is: %d\n", errno);
-                            break;//!!!!!!!!!!!!!!!!!!
-                        }
-                        if (http_conn::m_user_count >= MAX_FD)
-                        {
-                            show_error(connfd, "Internal server busy");
-                            break;//!!!!!!!!!!!!!!!!!!!
-                        }
-                        // 用socket值来做http_conn对象的索引 并初始化http_conn
-                        users[connfd].init(connfd, client_address, connfd_mode);
-                        // 初始化client_data
-                        users_timer[connfd].address = client_address;
-                        users_timer[connfd].sockfd = connfd;
-                        // 该连接的定时器 升序定时器链表的节点
-                        util_timer *timer = new util_timer;
-                        timer->user_data = &users_timer[connfd];
-                        timer->cb_func = cb_func;
-                        time_t cur = time(NULL);
-                        timer->expire = cur + 3 * TIMESLOT;
-                        users_timer[connfd].timer = timer;
-                        // 将timer插入到升序定时器链表
-                        timer_lst.add_timer(timer);
-                    }
-                    continue;//!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-                }
+                // LT模式下没取完的连接下一轮epoll_wait还会通知
+                // ET模式下不会再通知 只能记下来在本轮事件处理完之后继续取
+                bool more = deal_with_accept(listenfd, users, users_timer, connfd_mode);
+                accept_pending = more && (listenfd_mode == 1);
             }
             else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) // 连接socket的事件:挂起、被对方关闭、错误
             {
                 printf("被关闭/挂起/错误\n");
-                // users[sockfd].close_conn();
-                // 获取连接对应的timer
-                util_timer *timer = users_timer[sockfd].timer;
-                // 关闭连接
-                timer->cb_func(&users_timer[sockfd]);
-                // 移除对应定时器
-                if (timer)
-                {
-                    timer_lst.del_timer(timer);
-                }                
+                close_client(users_timer, sockfd); // 关闭连接并移除对应定时器
             }
-            else if ((sockfd == pipefd[0]) && (events[i].events & EPOLLIN))// 管道读就绪
+            else if ((sockfd == sigfd) && (events[i].events & EPOLLIN)) // 有信号到达
             {
                 printf("incoming signals\n");
-                int sig;
-                char signals[1024];
-                ret = recv(pipefd[0], signals, sizeof(signals), 0);
-                if (ret == -1)// 读管道出错
-                {
-                    continue;
-                }
-                else if (ret == 0)// 管道被对方关闭？
-                {
-                    continue;
-                }
-                else// 处理信号
-                {
-                    for (int i = 0; i < ret; ++i)
-                    {
-                        switch (signals[i])
-                        {
-                            case SIGALRM:// 定时器超时
-                            {
-                                timeout = true;
-                                break;
-                            }
-                            case SIGTERM:// 终止进程
-                            {
-                                stop_server = true;
-                            }
-                        }
-                    }
-                }                
+                // SIGTERM等 本批事件处理完后交给on_control_signal
+                read_signals(sigfd, pending_signals);
+            }
+            else if ((sockfd == timerfd) && (events[i].events & EPOLLIN)) // 定时器到期
+            {
+                uint64_t expirations;
+                ret = read(timerfd, &expirations, sizeof(expirations));
+                timer_armed = 0;
+                timeout = true;
+            }
+            else if (sockfd == completions->fd()) // 工作线程处理完了一些请求
+            {
+                deal_with_completions(completions, users, users_timer);
             }
             else if (events[i].events & EPOLLIN) // 读就绪 内核缓冲区有数据可读
             {
                 printf("socket读就绪\n");
-                // 获取连接对应timer
-                util_timer *timer = users_timer[sockfd].timer;
-                // 根据读的结果决定是将任务添加到线程池还是关闭连接
-                if (users[sockfd].read()) // 从socket对应内核读缓冲区中非阻塞读到对应http_conn的应用缓冲区
-                {
-                    pool->append(users + sockfd); // 往线程池的请求队列中添加任务:http_conn对象
-                    // 读成功 定时器重置 并调整其在链表上的位置
-                    if (timer)
-                    {
-                        printf("定时器重置\n");
-                        time_t cur = time(NULL);
-                        timer->expire = cur + 3 * TIMESLOT;
-                        timer_lst.adjust_timer(timer);
-                    }
-                }
-                else// 读错误 需要关闭连接
-                {
-                    // 关闭连接
-                    timer->cb_func(&users_timer[sockfd]);
-                    // 移除对应定时器
-                    if (timer)
-                    {
-                        timer_lst.del_timer(timer);   
-                    }         
-                }
+                deal_with_read(users, users_timer, sockfd);
             }
             else if (events[i].events & EPOLLOUT) // 写就绪 内核缓冲区有空间可写
             {
                 printf("socket写就绪\n");
-                // 获取连接对应timer
-                util_timer *timer = users_timer[sockfd].timer;
                 // 根据写的结果决定是否关闭连接
-                if (users[sockfd].write()) // 从socket对应内核写缓冲区中非阻塞写
-                {
-                    // 写成功 定时器重置 并调整其在链表上的位置
-                    if (timer)
-                    {
-                        printf("定时器重置\n");
-                        time_t cur = time(NULL);
-                        timer->expire = cur + 3 * TIMESLOT;
-                        timer_lst.adjust_timer(timer);
-                    }
-                }
-                else// 写错误/connection:close 需要关闭连接
-                {
-                    // 关闭连接
-                    timer->cb_func(&users_timer[sockfd]);
-                    // 移除对应定时器
-                    if (timer)
-                    {
-                        timer_lst.del_timer(timer);   
-                    }         
-                }
+                deal_with_write(users, users_timer, sockfd);
             }
             else
             {
                 printf("error:unknown event\n");
             }
         }
-        // 最后处理定时事件，应为I/O事件有着更高的优先级
-        // 同时也导致定时任务不能精确的按照预期时间执行
+        // TLS连接中已解密、还没读出的数据 处理过程中可能又有新的
+        while (!tls_reads.empty())
+        {
+            std::vector<int> ready;
+            ready.swap(tls_reads);
+            for (size_t i = 0; i < ready.size(); ++i)
+            {
+                deal_with_read(users, users_timer, ready[i]);
+            }
+        }
+        // 本批事件都已处理 应用信号带来的参数变化
+        if (pending_signals)
+        {
+            dispatch_signals(pending_signals, control);
+        }
+        if (control.draining && !drain_started) // 开始排空：停止accept 关闭正在等待下一个请求的连接
+        {
+            drain_started = true;
+            pause_accept(listenfd, false);
+            accept_pending = false;
+            timer_lst.expire_if([users](client_data *user_data)
+                                { return !users[user_data->sockfd].in_flight() && users[user_data->sockfd].idle(); });
+        }
+        if (drain_finished(control, http_conn::m_user_count))
+        {
+            if (http_conn::m_user_count > 0)
+            {
+                printf("drain deadline reached, closing %d connections\n", http_conn::m_user_count);
+            }
+            stop_server = true;
+        }
+        // ET模式下上一批没取完的连接 和已就绪的I/O事件轮流处理
+        if (accept_pending)
+        {
+            accept_pending = deal_with_accept(listenfd, users, users_timer, connfd_mode);
+        }
+        // 连接数回落到低水位以下 恢复accept
+        if (accept_paused && !accept_emfile && http_conn::m_user_count < control.low_watermark)
+        {
+            resume_accept(listenfd, listenfd_mode);
+        }
+        // 最后处理定时事件，因为I/O事件有着更高的优先级
+        // timerfd在截止时间准时到期，定时任务最多推迟一批事件的处理时间
         if (timeout)
         {
-            timer_handler();
             timeout = false;
+            // fd耗尽导致的暂停 每个timeslot重试一次
+            if (timer_handler() && accept_paused && accept_emfile)
+            {
+                resume_accept(listenfd, listenfd_mode);
+            }
         }
-        
+        rearm_timer();
+
     }
 
+    // 先等工作线程处理完手上的请求并退出 之后才能释放它们访问的连接对象
+    delete pool;     // 释放线程池
+    delete file_pool;
+    delete completions; // 工作线程都已退出 不会再投递
     close(epollfd);  // 关闭内核事件表的文件描述符
     close(listenfd); // 关闭监听socket的文件描述符
-    close(pipefd[0]); // 关闭管道
-    close(pipefd[1]);
+    close(sigfd);     // 关闭signalfd和timerfd
+    close(timerfd);
+    abort_remaining(users);
     delete[] users;  // 释放http_conn对象数组
+    delete http_conn::m_tls; // 各连接的TLS状态已随连接对象释放
     delete[] users_timer;  // 释放client_data对象数组
-    delete pool;     // 释放线程池
     return 0;
 }
@@ -0,0 +1,299 @@
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "master.h"
+#include "http_conn.h"
+#include "upgrade.h"
+#include "tls.h"
+#include "h2.h"
+
+// 启动后不到这么久就退出的工作进程 隔这么久再重启，避免配置错误等导致反复fork
+static const int RESTART_DELAY_SECS = 1;
+
+worker_stats *master::s_stats = NULL;
+int master::s_count = 0;
+int master::s_index = -1;
+
+bool master::start(int listenfd, int workers, bool pin_cpu, int &status)
+{
+    void *mem = mmap(NULL, sizeof(worker_stats) * workers, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        printf("cannot map worker statistics: %s\n", strerror(errno));
+        status = 1;
+        return false;
+    }
+    s_stats = (worker_stats *)mem;
+    memset(s_stats, 0, sizeof(worker_stats) * workers);
+    s_count = workers;
+
+    // 主进程不运行事件循环 同步地等待这些信号；工作进程fork后恢复原来的信号屏蔽字
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &set, &old);
+
+    // 由旧主进程升级启动时 监听socket已经就绪，在fork之前通知旧主进程开始排空，工作进程不会再通知一次
+    upgrade::notify_ready();
+
+    std::vector<time_t> started(workers, 0);    // 各工作进程的启动时间
+    std::vector<time_t> restart_at(workers, 0); // 退出的工作进程在这之后重启
+    int alive = 0;
+    for (int i = 0; i < workers; ++i)
+    {
+        pid_t pid = spawn(i, pin_cpu);
+        if (pid == 0)
+        {
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            return true;
+        }
+        if (pid > 0)
+        {
+            started[i] = time(NULL);
+            ++alive;
+        }
+    }
+
+    bool stopping = false;
+    pid_t upgrade_pid = -1;
+    while (!stopping || alive > 0)
+    {
+        struct timespec wait = {1, 0}; // 至少每秒醒来一次 检查需要延迟重启的工作进程
+        int sig = sigtimedwait(&set, NULL, &wait);
+        switch (sig)
+        {
+        case SIGTERM: // 工作进程排空后退出 再次收到时工作进程立即退出
+        case SIGINT:
+            printf(stopping ? "stopping workers now\n" : "stopping %d workers\n", alive);
+            stopping = true;
+            signal_workers(SIGTERM);
+            break;
+        case SIGHUP: // 各工作进程自己重新加载配置
+            signal_workers(SIGHUP);
+            break;
+        case SIGUSR2: // 升级：启动新的主进程 它就绪后发来SIGUSR1
+            if (upgrade::running(upgrade_pid))
+            {
+                printf("upgrade already in progress (pid %d)\n", upgrade_pid);
+            }
+            else if (!stopping)
+            {
+                upgrade_pid = upgrade::start(listenfd);
+            }
+            break;
+        case SIGUSR1:
+            if (!stopping && upgrade::running(upgrade_pid))
+            {
+                printf("new master %d ready, stopping %d workers\n", upgrade_pid, alive);
+                stopping = true;
+                signal_workers(SIGTERM);
+            }
+            break;
+        }
+
+        // 回收退出的子进程 多个SIGCHLD可能合并为一个，每轮都取完
+        int wstatus;
+        pid_t pid;
+        while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0)
+        {
+            if (pid == upgrade_pid)
+            {
+                printf("new process %d exited before it was ready, upgrade failed\n", pid);
+                upgrade_pid = -1;
+                continue;
+            }
+            for (int i = 0; i < workers; ++i)
+            {
+                if (s_stats[i].pid != pid)
+                {
+                    continue;
+                }
+                s_stats[i].pid = 0;
+                --alive;
+                if (stopping)
+                {
+                    break;
+                }
+                if (WIFSIGNALED(wstatus))
+                {
+                    printf("worker %d (pid %d) killed by signal %d, restarting\n", i, pid, WTERMSIG(wstatus));
+                }
+                else
+                {
+                    printf("worker %d (pid %d) exited with status %d, restarting\n", i, pid, WEXITSTATUS(wstatus));
+                }
+                ++s_stats[i].restarts;
+                restart_at[i] = time(NULL) - started[i] < RESTART_DELAY_SECS ? time(NULL) + RESTART_DELAY_SECS : 0;
+                break;
+            }
+        }
+
+        for (int i = 0; !stopping && i < workers; ++i)
+        {
+            if (s_stats[i].pid != 0 || time(NULL) < restart_at[i])
+            {
+                continue;
+            }
+            pid = spawn(i, pin_cpu);
+            if (pid == 0)
+            {
+                sigprocmask(SIG_SETMASK, &old, NULL);
+                return true;
+            }
+            if (pid > 0)
+            {
+                started[i] = time(NULL);
+                ++alive;
+            }
+            else
+            {
+                restart_at[i] = time(NULL) + RESTART_DELAY_SECS;
+            }
+        }
+    }
+    printf("all workers exited\n");
+    status = 0;
+    return false;
+}
+
+pid_t master::spawn(int index, bool pin_cpu)
+{
+    pid_t parent = getpid();
+    fflush(stdout); // 否则缓冲区中尚未输出的内容会被子进程再输出一遍
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        printf("cannot start worker %d: %s\n", index, strerror(errno));
+        return pid;
+    }
+    if (pid > 0)
+    {
+        s_stats[index].pid = pid;
+        printf("started worker %d (pid %d)\n", index, pid);
+        return pid;
+    }
+
+    s_index = index;
+    // 主进程意外退出时工作进程随之排空退出 不会留下无人监控的进程
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent)
+    {
+        _exit(0);
+    }
+    // 按编号依次绑定到本进程允许使用的CPU上
+    cpu_set_t allowed;
+    if (pin_cpu && sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        int nth = index % CPU_COUNT(&allowed);
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &allowed) && nth-- == 0)
+            {
+                cpu_set_t one;
+                CPU_ZERO(&one);
+                CPU_SET(cpu, &one);
+                if (sched_setaffinity(0, sizeof(one), &one) == 0)
+                {
+                    printf("worker %d pinned to cpu %d\n", index, cpu);
+                }
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+void master::signal_workers(int sig)
+{
+    for (int i = 0; i < s_count; ++i)
+    {
+        if (s_stats[i].pid > 0)
+        {
+            kill(s_stats[i].pid, sig);
+        }
+    }
+}
+
+void master::publish()
+{
+    if (s_index < 0)
+    {
+        return;
+    }
+    worker_stats &s = s_stats[s_index];
+    __atomic_store_n(&s.connections, http_conn::m_user_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&s.requests, __atomic_load_n(&http_conn::m_request_count, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&s.inline_requests, __atomic_load_n(&http_conn::m_inline_count, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&s.offloaded_requests, __atomic_load_n(&http_conn::m_offload_count, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&s.tls_handshakes, __atomic_load_n(&tls_context::m_handshakes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&s.tls_resumed, __atomic_load_n(&tls_context::m_resumed, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&s.tls_ktls, __atomic_load_n(&tls_context::m_ktls, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&s.h2_sessions, h2_session::m_session_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&s.h2_streams, h2_session::m_stream_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&s.rejected_connections, __atomic_load_n(&http_conn::m_client_limits.m_rejected_connections, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&s.limited_requests, __atomic_load_n(&http_conn::m_client_limits.m_limited_requests, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+bool master::totals(worker_stats &sum)
+{
+    if (s_index < 0)
+    {
+        return false;
+    }
+    publish();
+    memset(&sum, 0, sizeof(sum));
+    for (int i = 0; i < s_count; ++i)
+    {
+        const worker_stats &s = s_stats[i];
+        sum.restarts += __atomic_load_n(&s.restarts, __ATOMIC_RELAXED);
+        sum.connections += __atomic_load_n(&s.connections, __ATOMIC_RELAXED);
+        sum.requests += __atomic_load_n(&s.requests, __ATOMIC_RELAXED);
+        sum.inline_requests += __atomic_load_n(&s.inline_requests, __ATOMIC_RELAXED);
+        sum.offloaded_requests += __atomic_load_n(&s.offloaded_requests, __ATOMIC_RELAXED);
+        sum.tls_handshakes += __atomic_load_n(&s.tls_handshakes, __ATOMIC_RELAXED);
+        sum.tls_resumed += __atomic_load_n(&s.tls_resumed, __ATOMIC_RELAXED);
+        sum.tls_ktls += __atomic_load_n(&s.tls_ktls, __ATOMIC_RELAXED);
+        sum.h2_sessions += __atomic_load_n(&s.h2_sessions, __ATOMIC_RELAXED);
+        sum.h2_streams += __atomic_load_n(&s.h2_streams, __ATOMIC_RELAXED);
+        sum.rejected_connections += __atomic_load_n(&s.rejected_connections, __ATOMIC_RELAXED);
+        sum.limited_requests += __atomic_load_n(&s.limited_requests, __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+std::string master::metrics()
+{
+    std::string out;
+    if (s_index < 0)
+    {
+        return out;
+    }
+    char line[128];
+    for (int i = 0; i < s_count; ++i)
+    {
+        const worker_stats &s = s_stats[i];
+        snprintf(line, sizeof(line), "lwc_worker_connections{worker=\"%d\"} %d\n", i,
+                 __atomic_load_n(&s.connections, __ATOMIC_RELAXED));
+        out += line;
+        snprintf(line, sizeof(line), "lwc_worker_requests_total{worker=\"%d\"} %lld\n", i,
+                 __atomic_load_n(&s.requests, __ATOMIC_RELAXED));
+        out += line;
+        snprintf(line, sizeof(line), "lwc_worker_restarts_total{worker=\"%d\"} %d\n", i,
+                 __atomic_load_n(&s.restarts, __ATOMIC_RELAXED));
+        out += line;
+    }
+    return out;
+}
@@ -0,0 +1,56 @@
+#ifndef MASTER_H
+#define MASTER_H
+
+#include <sys/types.h>
+#include <string>
+
+// 每个工作进程在共享内存中的统计 各占一个缓存行，工作进程只写自己的一项，互不争用
+struct worker_stats
+{
+    pid_t pid;                   // 为0时该工作进程正在重启
+    int restarts;                // 该槽位上的工作进程异常退出后被重启的次数 由主进程维护
+    int connections;             // 以下由工作进程在每个定时器tick时发布
+    long long requests;
+    long long inline_requests;
+    long long offloaded_requests;
+    long long tls_handshakes;
+    long long tls_resumed;
+    long long tls_ktls;
+    long long h2_sessions;
+    long long h2_streams;
+    long long rejected_connections;
+    long long limited_requests;
+} __attribute__((aligned(64)));
+
+// 多进程模式(类似nginx的master/worker)
+// 主进程bind监听socket后fork出N个工作进程，每个工作进程有自己的事件循环、连接表、定时器和线程池，
+// 可以绑定到一个CPU核上；它们在同一个监听socket上accept。主进程不处理请求，只负责：
+// 工作进程异常退出时重启；SIGTERM/SIGINT停止、SIGHUP重新加载时转发给工作进程；SIGUSR2升级时启动新的主进程
+class master
+{
+public:
+    // 启动workers个工作进程并监控它们
+    // 在工作进程中返回true，调用者继续初始化并运行事件循环；
+    // 主进程一直运行到所有工作进程退出，返回false，status为进程的退出码
+    static bool start(int listenfd, int workers, bool pin_cpu, int &status);
+
+    // 工作进程的编号 单进程模式和主进程中为-1
+    static int worker_index() { return s_index; }
+    // 工作进程：把本进程的计数发布到共享内存 每个定时器tick调用
+    static void publish();
+    // 所有工作进程的合计 单进程模式下返回false
+    static bool totals(worker_stats &sum);
+    // 各工作进程的统计 文本格式的指标 单进程模式下为空
+    static std::string metrics();
+
+private:
+    static pid_t spawn(int index, bool pin_cpu);
+    static void signal_workers(int sig);
+
+private:
+    static worker_stats *s_stats; // 共享内存 每个工作进程一项
+    static int s_count;           // 工作进程数
+    static int s_index;           // 本进程的编号
+};
+
+#endif
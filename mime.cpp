@@ -0,0 +1,148 @@
+#include <string.h>
+#include <ctype.h>
+#include "mime.h"
+
+mime::override_table *mime::s_overrides = NULL;
+const char *mime::s_charset = "utf-8";
+
+unsigned long long mime::pack(const char *ext, int len)
+{
+    if (len <= 0 || len > 8)
+    {
+        return 0;
+    }
+    unsigned long long key = 0;
+    for (int i = 0; i < len; ++i)
+    {
+        unsigned char c = tolower((unsigned char)ext[i]);
+        if (!(isalnum(c) || c == '_' || c == '-' || c == '+'))
+        {
+            return 0;
+        }
+        key |= (unsigned long long)c << (8 * i);
+    }
+    return key;
+}
+
+const char *mime::lookup(const char *path, bool &textual)
+{
+    textual = false;
+    // 最后一个'/'之后的最后一个'.'
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    unsigned long long key = (dot && dot > slash) ? pack(dot + 1, strlen(dot + 1)) : 0;
+    if (key)
+    {
+        const override_table *table = __atomic_load_n(&s_overrides, __ATOMIC_ACQUIRE);
+        for (int i = 0; table && i < table->count; ++i)
+        {
+            if (table->entries[i].key == key)
+            {
+                textual = table->entries[i].textual;
+                return table->entries[i].type.c_str();
+            }
+        }
+        int slot = mime_table::slot(key);
+        if (mime_table::keys[slot] == key)
+        {
+            textual = mime_table::textual[slot];
+            return mime_table::types[slot];
+        }
+    }
+    return "application/octet-stream";
+}
+
+// 去掉首尾空白
+static std::string trim(const std::string &s)
+{
+    size_t b = 0, e = s.size();
+    while (b < e && isspace((unsigned char)s[b]))
+    {
+        ++b;
+    }
+    while (e > b && isspace((unsigned char)s[e - 1]))
+    {
+        --e;
+    }
+    return s.substr(b, e - b);
+}
+
+mime::override_table *mime::parse(const std::string &list)
+{
+    override_table *table = new override_table;
+    table->count = 0;
+    size_t pos = 0;
+    while (pos <= list.size())
+    {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos)
+        {
+            comma = list.size();
+        }
+        std::string item = trim(list.substr(pos, comma - pos));
+        pos = comma + 1;
+        if (item.empty())
+        {
+            continue;
+        }
+        size_t eq = item.find('=');
+        std::string ext = eq == std::string::npos ? "" : trim(item.substr(0, eq));
+        std::string type = eq == std::string::npos ? "" : trim(item.substr(eq + 1));
+        if (!ext.empty() && ext[0] == '.')
+        {
+            ext.erase(0, 1);
+        }
+        unsigned long long key = pack(ext.c_str(), ext.size());
+        if (!key || type.empty())
+        {
+            delete table;
+            return NULL;
+        }
+        // 同一扩展名出现多次时后面的生效
+        int i = 0;
+        while (i < table->count && table->entries[i].key != key)
+        {
+            ++i;
+        }
+        if (i == MAX_OVERRIDES)
+        {
+            delete table;
+            return NULL;
+        }
+        override_entry &entry = table->entries[i];
+        entry.key = key;
+        entry.type = type;
+        // 与内置表相同的规则：text/*和*json、*xml是文本类型
+        size_t n = type.size();
+        bool text = type.compare(0, 5, "text/") == 0 || (n >= 4 && type.compare(n - 4, 4, "json") == 0) ||
+                    (n >= 3 && type.compare(n - 3, 3, "xml") == 0);
+        entry.textual = text && type.find("charset") == std::string::npos;
+        if (i == table->count)
+        {
+            ++table->count;
+        }
+    }
+    return table;
+}
+
+bool mime::valid_overrides(const std::string &list)
+{
+    override_table *table = parse(list);
+    if (!table)
+    {
+        return false;
+    }
+    delete table;
+    return true;
+}
+
+bool mime::set_overrides(const std::string &list)
+{
+    override_table *table = parse(list);
+    if (!table)
+    {
+        return false;
+    }
+    __atomic_store_n(&s_overrides, table, __ATOMIC_RELEASE);
+    return true;
+}
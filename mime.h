@@ -0,0 +1,52 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <string>
+#include "mime_table.h"
+
+// 根据扩展名确定响应的Content-Type
+// 内置的映射表在构建时由mime/mime.types生成(mime_table.h)，查找不分配内存、不比较字符串
+// 覆盖项来自配置mime_types(-t)，每次设置都生成新的只读表再整体替换，重新加载时工作线程可以同时查找
+// 字符集只在启动时设置
+class mime
+{
+public:
+    static const int MAX_OVERRIDES = 32; // 覆盖项的最大数量
+
+    // 扩展名(不区分大小写，最长8个字符)按字节打包成64位整数 不能打包时返回0
+    static unsigned long long pack(const char *ext, int len);
+
+    // 查找路径path的扩展名对应的类型 未知类型返回application/octet-stream
+    // textual为true时类型后面应附带默认字符集
+    static const char *lookup(const char *path, bool &textual);
+
+    // 用list("扩展名=类型"逗号分隔，可以为空)替换全部覆盖项 优先于内置表 type中已带charset参数时不再附加默认字符集
+    // 格式错误或超过MAX_OVERRIDES项时返回false，原来的覆盖项不变
+    static bool set_overrides(const std::string &list);
+    // 只检查list的格式 用于校验配置
+    static bool valid_overrides(const std::string &list);
+
+    static void set_charset(const char *charset) { s_charset = charset; }
+    static const char *charset() { return s_charset; }
+
+private:
+    struct override_entry
+    {
+        unsigned long long key;
+        std::string type;
+        bool textual;
+    };
+    struct override_table
+    {
+        override_entry entries[MAX_OVERRIDES];
+        int count;
+    };
+
+    static override_table *parse(const std::string &list);
+
+    // 替换下来的表不释放：其他线程可能还在查找，返回的类型也可能还在使用 只有配置变化时才会替换
+    static override_table *s_overrides;
+    static const char *s_charset;
+};
+
+#endif
@@ -0,0 +1,178 @@
+// 构建时运行的生成器：读入mime.types，为其中的扩展名找一个完美哈希，输出mime_table.h
+// 扩展名(小写，不超过8个字符)按字节打包成64位整数作为键，哈希为 (key * SEED) >> SHIFT
+// 生成的表里每个槽最多一个键，查找只需一次乘法、一次移位和一次整数比较
+// 用法：gen_mime_table mime.types mime_table.h
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+
+struct entry
+{
+    unsigned long long key;
+    std::string ext;
+    std::string type;
+    bool textual;
+};
+
+// 与mime::pack一致 不能打包(过长或含非法字符)时返回0
+static unsigned long long pack(const char *ext)
+{
+    unsigned long long key = 0;
+    int i = 0;
+    for (; ext[i]; ++i)
+    {
+        unsigned char c = tolower((unsigned char)ext[i]);
+        if (i >= 8 || !(isalnum(c) || c == '_' || c == '-' || c == '+'))
+        {
+            return 0;
+        }
+        key |= (unsigned long long)c << (8 * i);
+    }
+    return key;
+}
+
+// 文本类型附带字符集
+static bool is_textual(const std::string &type)
+{
+    size_t n = type.size();
+    return type.compare(0, 5, "text/") == 0 ||
+           (n >= 4 && type.compare(n - 4, 4, "json") == 0) ||
+           (n >= 3 && type.compare(n - 3, 3, "xml") == 0);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s mime.types mime_table.h\n", argv[0]);
+        return 1;
+    }
+    FILE *in = fopen(argv[1], "r");
+    if (!in)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    std::vector<entry> entries;
+    char line[1024];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), in))
+    {
+        ++lineno;
+        char *hash = strchr(line, '#');
+        if (hash)
+        {
+            *hash = '\0';
+        }
+        char *save = NULL;
+        char *type = strtok_r(line, " \t\r\n", &save);
+        if (!type)
+        {
+            continue;
+        }
+        for (char *ext = strtok_r(NULL, " \t\r\n", &save); ext; ext = strtok_r(NULL, " \t\r\n", &save))
+        {
+            entry e;
+            e.key = pack(ext);
+            if (e.key == 0)
+            {
+                fprintf(stderr, "%s:%d: bad extension '%s'\n", argv[1], lineno, ext);
+                return 1;
+            }
+            for (size_t i = 0; i < entries.size(); ++i)
+            {
+                if (entries[i].key == e.key)
+                {
+                    fprintf(stderr, "%s:%d: duplicate extension '%s'\n", argv[1], lineno, ext);
+                    return 1;
+                }
+            }
+            e.ext = ext;
+            e.type = type;
+            e.textual = is_textual(e.type);
+            entries.push_back(e);
+        }
+    }
+    fclose(in);
+
+    // 从2倍键数开始 找不到无冲突的乘数就把表扩大一倍
+    int bits = 1;
+    while ((1u << bits) < 2 * entries.size())
+    {
+        ++bits;
+    }
+    unsigned long long seed = 0;
+    std::vector<int> slots;
+    for (bool found = false; !found; ++bits)
+    {
+        unsigned long long x = 0x9e3779b97f4a7c15ULL;
+        for (int attempt = 0; attempt < 1000000 && !found; ++attempt)
+        {
+            // xorshift产生候选乘数 必须是奇数
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            seed = x | 1;
+            slots.assign(1u << bits, -1);
+            found = true;
+            for (size_t i = 0; i < entries.size() && found; ++i)
+            {
+                unsigned slot = (entries[i].key * seed) >> (64 - bits);
+                if (slots[slot] >= 0)
+                {
+                    found = false;
+                }
+                slots[slot] = i;
+            }
+        }
+        if (found)
+        {
+            break;
+        }
+    }
+
+    FILE *out = fopen(argv[2], "w");
+    if (!out)
+    {
+        perror(argv[2]);
+        return 1;
+    }
+    int size = 1 << bits;
+    fprintf(out, "// 由gen_mime_table根据mime/mime.types生成 不要手工修改\n");
+    fprintf(out, "#ifndef MIME_TABLE_H\n#define MIME_TABLE_H\n\n");
+    fprintf(out, "namespace mime_table\n{\n");
+    fprintf(out, "constexpr unsigned long long SEED = 0x%llxULL;\n", seed);
+    fprintf(out, "constexpr int SHIFT = %d;\n", 64 - bits);
+    fprintf(out, "constexpr int SIZE = %d;\n\n", size);
+    fprintf(out, "constexpr unsigned long long keys[SIZE] = {\n");
+    for (int i = 0; i < size; ++i)
+    {
+        if (slots[i] >= 0)
+        {
+            fprintf(out, "    0x%llxULL, // %s\n", entries[slots[i]].key, entries[slots[i]].ext.c_str());
+        }
+        else
+        {
+            fprintf(out, "    0,\n");
+        }
+    }
+    fprintf(out, "};\n\nconstexpr const char *types[SIZE] = {\n");
+    for (int i = 0; i < size; ++i)
+    {
+        fprintf(out, "    %s%s%s,\n", slots[i] >= 0 ? "\"" : "", slots[i] >= 0 ? entries[slots[i]].type.c_str() : "nullptr",
+                slots[i] >= 0 ? "\"" : "");
+    }
+    fprintf(out, "};\n\nconstexpr bool textual[SIZE] = {\n");
+    for (int i = 0; i < size; ++i)
+    {
+        fprintf(out, "    %s,\n", slots[i] >= 0 && entries[slots[i]].textual ? "true" : "false");
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "constexpr int slot(unsigned long long key) { return (int)((key * SEED) >> SHIFT); }\n");
+    fprintf(out, "}\n\n#endif\n");
+    fclose(out);
+    return 0;
+}
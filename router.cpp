@@ -0,0 +1,259 @@
+#include "router.h"
+
+bool router::add(int methods, const char *pattern, route_handler handler, http_conn::body_handler body)
+{
+    if (m_compiled || !pattern || pattern[0] != '/' || !handler)
+    {
+        return false;
+    }
+    if (m_build.empty())
+    {
+        m_build.push_back(build_node()); // 根节点
+    }
+
+    int cur = 0;
+    int param_count = 0;
+    bool wildcard = false;
+    for (const char *p = pattern; *p;)
+    {
+        bool seg_start = p > pattern && p[-1] == '/';
+        if (seg_start && *p == ':') // 参数段
+        {
+            const char *name = p + 1;
+            const char *seg_end = strchr(name, '/');
+            int len = seg_end ? seg_end - name : strlen(name);
+            if (len == 0 || ++param_count > route_params::MAX_PARAMS)
+            {
+                return false;
+            }
+            std::string param_name(name, len);
+            if (m_build[cur].param < 0)
+            {
+                m_build[cur].param = m_build.size();
+                m_build[cur].param_name = param_name;
+                m_build.push_back(build_node());
+            }
+            else if (m_build[cur].param_name != param_name) // 同一位置的参数段必须同名
+            {
+                return false;
+            }
+            cur = m_build[cur].param;
+            p = name + len;
+        }
+        else if (seg_start && *p == '*' && p[1] == '\0') // 匹配剩余的全部路径
+        {
+            if (++param_count > route_params::MAX_PARAMS)
+            {
+                return false;
+            }
+            wildcard = true;
+            break;
+        }
+        else
+        {
+            std::map<char, int>::iterator it = m_build[cur].next.find(*p);
+            if (it == m_build[cur].next.end())
+            {
+                int child = m_build.size();
+                m_build[cur].next[*p] = child;
+                m_build.push_back(build_node());
+                cur = child;
+            }
+            else
+            {
+                cur = it->second;
+            }
+            ++p;
+        }
+    }
+
+    route r;
+    r.methods = methods;
+    r.handler = handler;
+    r.body = body;
+    m_routes.push_back(r);
+    (wildcard ? m_build[cur].wild_routes : m_build[cur].routes).push_back(m_routes.size() - 1);
+    return true;
+}
+
+void router::compile()
+{
+    if (m_compiled)
+    {
+        return;
+    }
+    m_compiled = true;
+    if (m_build.empty())
+    {
+        return;
+    }
+    m_nodes.push_back(node());
+    compile_node(0, 0, std::string(), -1);
+    // 构建阶段的前缀树不再需要
+    std::vector<build_node>().swap(m_build);
+}
+
+// 把构建节点b编译到m_nodes[slot] label为到达它的压缩边 param_name为参数名偏移(不是参数段时为-1)
+void router::compile_node(int slot, int b, const std::string &label, int param_name)
+{
+    const build_node &bn = m_build[b];
+    node n;
+    n.label = m_labels.size();
+    n.label_len = label.size();
+    m_labels += label;
+    n.param_name = param_name;
+
+    n.first_route = m_route_index.size();
+    n.route_count = bn.routes.size();
+    m_route_index.insert(m_route_index.end(), bn.routes.begin(), bn.routes.end());
+    n.first_wild = m_route_index.size();
+    n.wild_count = bn.wild_routes.size();
+    m_route_index.insert(m_route_index.end(), bn.wild_routes.begin(), bn.wild_routes.end());
+
+    // 沿只有一个字面子节点、自身不是路由终点的节点一直走下去，把经过的字符合并为一条边
+    std::vector<std::pair<std::string, int> > children;
+    for (std::map<char, int>::const_iterator it = bn.next.begin(); it != bn.next.end(); ++it)
+    {
+        std::string edge(1, it->first);
+        int cur = it->second;
+        while (m_build[cur].next.size() == 1 && m_build[cur].param < 0 &&
+               m_build[cur].routes.empty() && m_build[cur].wild_routes.empty())
+        {
+            edge += m_build[cur].next.begin()->first;
+            cur = m_build[cur].next.begin()->second;
+        }
+        children.push_back(std::make_pair(edge, cur));
+    }
+
+    // 子节点连续存放 std::map保证了它们按首字符有序
+    n.first_child = m_nodes.size();
+    n.child_count = children.size();
+    m_nodes.resize(m_nodes.size() + children.size());
+    n.param_child = -1;
+    if (bn.param >= 0)
+    {
+        n.param_child = m_nodes.size();
+        m_nodes.push_back(node());
+    }
+    m_nodes[slot] = n;
+
+    for (size_t i = 0; i < children.size(); ++i)
+    {
+        compile_node(n.first_child + i, children[i].second, children[i].first, -1);
+    }
+    if (bn.param >= 0)
+    {
+        int name = m_labels.size();
+        m_labels += bn.param_name;
+        m_labels += '\0';
+        compile_node(n.param_child, bn.param, std::string(), name);
+    }
+}
+
+const route *router::match(int method, const char *path, route_params &params, int &allowed) const
+{
+    params.count = 0;
+    allowed = 0;
+    if (!m_compiled || m_nodes.empty() || !path)
+    {
+        return NULL;
+    }
+    const char *end = path + strcspn(path, "?");
+    return match_node(0, path, end, method, params, allowed);
+}
+
+// 在m_route_index[first, first+count)中找允许method的路由 其他方法记入allowed
+const route *router::find_route(int first, int count, int method, int &allowed) const
+{
+    for (int i = first; i < first + count; ++i)
+    {
+        const route &r = m_routes[m_route_index[i]];
+        if (r.methods & (1 << method))
+        {
+            return &r;
+        }
+        allowed |= r.methods;
+    }
+    return NULL;
+}
+
+// p指向路径中已匹配到节点ni之后的位置 字面子节点失败时回退尝试参数段和"*"
+const route *router::match_node(int ni, const char *p, const char *end, int method,
+                                route_params &params, int &allowed) const
+{
+    const node &n = m_nodes[ni];
+    const route *r = NULL;
+    if (p == end)
+    {
+        r = find_route(n.first_route, n.route_count, method, allowed);
+        if (r)
+        {
+            return r;
+        }
+    }
+    else
+    {
+        // 按首字符二分查找字面子节点
+        int lo = n.first_child, hi = n.first_child + n.child_count;
+        while (lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            char c = m_labels[m_nodes[mid].label];
+            if (c < *p)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        if (lo < n.first_child + n.child_count)
+        {
+            const node &c = m_nodes[lo];
+            if (end - p >= c.label_len && memcmp(m_labels.data() + c.label, p, c.label_len) == 0)
+            {
+                r = match_node(lo, p + c.label_len, end, method, params, allowed);
+                if (r)
+                {
+                    return r;
+                }
+            }
+        }
+
+        if (n.param_child >= 0 && params.count < route_params::MAX_PARAMS)
+        {
+            const char *seg_end = p;
+            while (seg_end < end && *seg_end != '/')
+            {
+                ++seg_end;
+            }
+            if (seg_end > p)
+            {
+                int i = params.count++;
+                params.name[i] = m_labels.c_str() + m_nodes[n.param_child].param_name;
+                params.value[i] = p;
+                params.len[i] = seg_end - p;
+                r = match_node(n.param_child, seg_end, end, method, params, allowed);
+                if (r)
+                {
+                    return r;
+                }
+                params.count = i;
+            }
+        }
+    }
+
+    if (n.wild_count && params.count < route_params::MAX_PARAMS)
+    {
+        r = find_route(n.first_wild, n.wild_count, method, allowed);
+        if (r)
+        {
+            int i = params.count++;
+            params.name[i] = "*";
+            params.value[i] = p;
+            params.len[i] = end - p;
+        }
+    }
+    return r;
+}
@@ -0,0 +1,80 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "http_conn.h"
+
+// 动态请求的处理函数 在请求(含消息体)完整接收后调用，通过conn->respond()给出响应
+// 路径参数通过conn->param()获取
+typedef http_conn::HTTP_CODE (*route_handler)(http_conn *conn);
+
+#define ROUTE_METHOD(m) (1 << http_conn::m) // 路由允许的请求方法掩码
+
+// 一条注册的路由
+struct route
+{
+    int methods;                    // 允许的请求方法 ROUTE_METHOD的组合
+    route_handler handler;
+    http_conn::body_handler body;   // 消息体的处理回调 为NULL时POST/PUT使用默认的转存
+};
+
+// 路由表：启动时注册路由，compile()把它们编译成只读的基数树，之后可被多个线程同时查找
+// 路径模式由'/'分隔的段组成：普通段按字面匹配，":name"段匹配任意一个非空段，
+// 最后一段为"*"时匹配剩余的全部路径(可以为空)；字面段优先于参数段，参数段优先于"*"
+// 查找只沿树向下比较路径中的字符，不分配内存
+class router
+{
+public:
+    router() : m_compiled(false) {}
+
+    // 注册路由 必须在compile之前调用 模式不合法时返回false
+    bool add(int methods, const char *pattern, route_handler handler, http_conn::body_handler body = NULL);
+    void compile();
+
+    // 查找路径path(遇到'?'或字符串结尾为止)上允许method的路由
+    // 找不到时返回NULL，此时allowed为该路径上其他方法的掩码，路径本身没有路由时为0
+    const route *match(int method, const char *path, route_params &params, int &allowed) const;
+
+private:
+    // 构建阶段的节点：按字符展开的前缀树
+    struct build_node
+    {
+        build_node() : param(-1) {}
+        std::map<char, int> next;    // 字面字符的子节点
+        int param;                   // 参数段的子节点
+        std::string param_name;      // 参数段子节点的参数名
+        std::vector<int> routes;     // 在此结束的路由
+        std::vector<int> wild_routes; // 在此以"*"结束的路由
+    };
+
+    // 编译后的节点：单子节点的字符链压缩为一条边，子节点连续存放并按首字符排序
+    struct node
+    {
+        int label;        // 边上的字符串在m_labels中的偏移
+        int label_len;
+        int first_child;  // 字面子节点在m_nodes中的起始下标
+        int child_count;
+        int param_child;  // 参数段子节点 没有为-1
+        int param_name;   // 参数名在m_labels中的偏移(以'\0'结尾)
+        int first_route;  // 在此结束的路由在m_route_index中的起始下标
+        int route_count;
+        int first_wild;   // 在此以"*"结束的路由
+        int wild_count;
+    };
+
+    void compile_node(int slot, int b, const std::string &label, int param_name);
+    const route *find_route(int first, int count, int method, int &allowed) const;
+    const route *match_node(int ni, const char *p, const char *end, int method, route_params &params, int &allowed) const;
+
+private:
+    bool m_compiled;
+    std::vector<route> m_routes;
+    std::vector<build_node> m_build;
+    std::vector<node> m_nodes;
+    std::vector<int> m_route_index;
+    std::string m_labels;
+};
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef SERVER_CONTROL_H
+#define SERVER_CONTROL_H
+
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include "admission.h"
+
+// 事件循环运行中可以调整的参数 由主程序创建并在各事件后端之间共享
+// 事件循环从signalfd读到信号(SIGTERM停止、SIGHUP重新加载配置、SIGUSR2升级等)时先记下，
+// 在处理完一批事件之后(此时没有解析到一半的请求)调用on_signal，由它修改这些参数，事件循环随即按新值运行
+// 排空：停止accept，关闭空闲的保持连接，其余连接在响应后关闭(Connection: close)，
+// 全部关闭或到达截止时间后事件循环退出
+struct server_control
+{
+    int timeslot;            // 周期性tick的间隔(秒) 用于发布统计、fd耗尽后重试accept；各连接的超时按各自的截止时间触发
+    int max_accept_per_loop; // 每轮事件循环最多accept的连接数
+    int high_watermark;      // 连接数达到该值时暂停accept
+    int low_watermark;       // 连接数回落到该值以下时恢复accept
+    bool draining;           // 不再accept新连接 已有连接全部关闭后事件循环退出
+    long long drain_deadline; // 排空的截止时间(monotonic_ms()的毫秒数) 到时仍未关闭的连接随事件循环退出被强制关闭
+    void (*on_signal)(int sig, server_control &ctl); // 为NULL时忽略这些信号
+    void (*on_tick)(server_control &ctl);            // 每个tick调用 可以为NULL
+};
+
+// 从signalfd读到的信号先按位记下 一批事件处理完后再交给on_signal
+inline void record_signal(unsigned &pending, int sig)
+{
+    if (sig > 0 && sig < 32)
+    {
+        pending |= 1u << sig;
+    }
+}
+
+inline void dispatch_signals(unsigned &pending, server_control &ctl)
+{
+    for (int sig = 1; pending && sig < 32; ++sig)
+    {
+        if (pending & (1u << sig))
+        {
+            pending &= ~(1u << sig);
+            if (ctl.on_signal)
+            {
+                ctl.on_signal(sig, ctl);
+            }
+        }
+    }
+}
+
+// 排空已经结束 事件循环应当退出
+inline bool drain_finished(const server_control &ctl, int user_count)
+{
+    return ctl.draining && (user_count == 0 || monotonic_ms() >= ctl.drain_deadline);
+}
+
+// 屏蔽事件循环处理的信号，改由返回的signalfd读取 不再有信号处理函数打断系统调用
+// 必须在创建任何线程之前调用：线程继承创建者的信号屏蔽字，没有屏蔽的线程会按默认动作处理这些信号
+// SIGINT保持默认动作(立即终止) 失败返回-1
+inline int open_signalfd()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    if (sigprocmask(SIG_BLOCK, &set, NULL) != 0)
+    {
+        return -1;
+    }
+    return signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+// 读出signalfd上所有已到达的信号并记下
+inline void read_signals(int sigfd, unsigned &pending)
+{
+    struct signalfd_siginfo info[16];
+    ssize_t n;
+    while ((n = read(sigfd, info, sizeof(info))) > 0)
+    {
+        for (size_t i = 0; i < n / sizeof(info[0]); ++i)
+        {
+            record_signal(pending, info[i].ssi_signo);
+        }
+    }
+}
+
+// 事件循环下一次需要醒来的时刻(monotonic_ms()的毫秒数)：最早的连接定时器、下一个tick和排空的截止时间中最早的一个
+// expire为0表示没有连接定时器
+inline long long next_wakeup(const server_control &ctl, long long next_tick, long long expire)
+{
+    long long next = next_tick;
+    if (expire > 0 && expire < next)
+    {
+        next = expire;
+    }
+    if (ctl.draining && ctl.drain_deadline < next)
+    {
+        next = ctl.drain_deadline;
+    }
+    return next;
+}
+
+// 按CLOCK_MONOTONIC计时的timerfd 系统时间被调整(NTP、settimeofday)时各截止时间既不会一起到期也不会停滞
+inline int open_timerfd()
+{
+    return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+// 让open_timerfd创建的timerfd在when(monotonic_ms()的毫秒数)准时到期 已经过去的时刻会立即到期
+inline void arm_timerfd(int timerfd, long long when)
+{
+    struct itimerspec its = {};
+    its.it_value.tv_sec = when / 1000;
+    its.it_value.tv_nsec = when % 1000 * 1000000;
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) // it_value为0表示停止定时器
+    {
+        its.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef STAT_CACHE_H
+#define STAT_CACHE_H
+
+#include <string.h>
+#include <sys/stat.h>
+#include "locker.h"
+#include "admission.h"
+
+// 目标文件元数据(stat结果)缓存 HEAD请求命中时不需要任何文件系统调用
+// 也用作不存在的路径的负缓存(只关心是否命中)，对同一路径的重复404不再访问文件系统
+// 路径按哈希直接映射到固定数量的槽，冲突时新的覆盖旧的，内存占用固定，不需要淘汰算法
+// 缓存项在TTL_US后过期，文件被修改后最多这么久响应头就会反映新的元数据
+// 槽按下标分段加锁，多个工作线程可以同时访问不同的段
+class stat_cache
+{
+public:
+    static const int SLOTS = 4096;        // 槽数 必须是2的幂
+    static const int LOCKS = 64;          // 锁的段数
+    static const int PATH_LEN = 200;      // 可缓存的路径的最大长度 与http_conn::FILENAME_LEN一致
+    static const long long TTL_US = 1000000;
+
+    explicit stat_cache(long long ttl_us = TTL_US) : m_ttl_us(ttl_us), m_slots(new slot[SLOTS])
+    {
+        memset(m_slots, 0, sizeof(slot) * SLOTS);
+    }
+    ~stat_cache()
+    {
+        delete[] m_slots;
+    }
+
+    // 命中且未过期时把元数据复制到st并返回true
+    bool lookup(const char *path, struct stat &st)
+    {
+        unsigned idx = hash(path) & (SLOTS - 1);
+        slot &s = m_slots[idx];
+        bool hit = false;
+        m_locks[idx % LOCKS].lock();
+        if (s.expire_us > monotonic_us() && strcmp(s.path, path) == 0)
+        {
+            st = s.st;
+            hit = true;
+        }
+        m_locks[idx % LOCKS].unlock();
+        return hit;
+    }
+
+    void insert(const char *path, const struct stat &st)
+    {
+        if (strlen(path) >= PATH_LEN)
+        {
+            return;
+        }
+        unsigned idx = hash(path) & (SLOTS - 1);
+        slot &s = m_slots[idx];
+        m_locks[idx % LOCKS].lock();
+        strcpy(s.path, path);
+        s.st = st;
+        s.expire_us = monotonic_us() + m_ttl_us;
+        m_locks[idx % LOCKS].unlock();
+    }
+
+    // 清空所有槽 doc_root被更换时调用
+    void clear()
+    {
+        for (int i = 0; i < SLOTS; ++i)
+        {
+            m_locks[i % LOCKS].lock();
+            m_slots[i].expire_us = 0;
+            m_locks[i % LOCKS].unlock();
+        }
+    }
+
+private:
+    struct slot
+    {
+        char path[PATH_LEN];
+        struct stat st;
+        long long expire_us; // 为0表示空槽
+    };
+
+    // FNV-1a
+    static unsigned hash(const char *path)
+    {
+        unsigned h = 2166136261u;
+        for (; *path; ++path)
+        {
+            h = (h ^ (unsigned char)*path) * 16777619u;
+        }
+        return h;
+    }
+
+private:
+    long long m_ttl_us; // 缓存项的有效期
+    slot *m_slots;
+    locker m_locks[LOCKS];
+};
+
+#endif
@@ -0,0 +1,156 @@
+// 流水线请求的回归测试：客户端一次写入的多个请求都要得到响应，保持连接时不能丢弃已读入的后续请求
+// 用法: pipeline_test <lwcWebServer路径> 依次用epoll、uring、coro后端在临时doc_root上启动服务器
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+
+static int port = 0;
+
+static int connect_server()
+{
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    // 服务器丢弃后续请求时连接会一直空闲 不能等到保持连接超时
+    struct timeval tv = {2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+// 统计响应中的状态行
+static int count_responses(const std::string &resp)
+{
+    int count = 0;
+    for (size_t pos = 0; (pos = resp.find("HTTP/1.1 ", pos)) != std::string::npos; ++pos)
+    {
+        ++count;
+    }
+    return count;
+}
+
+// 把parts依次写入同一个连接(每两次写之间停一下) 读到want个响应、连接关闭或超时为止
+static int exchange(const char *const *parts, int n, int want)
+{
+    int fd = connect_server();
+    if (fd < 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < n; ++i)
+    {
+        if (i > 0)
+        {
+            usleep(100000);
+        }
+        send(fd, parts[i], strlen(parts[i]), 0);
+    }
+    std::string resp;
+    char buf[4096];
+    ssize_t len;
+    while (count_responses(resp) < want && (len = recv(fd, buf, sizeof(buf), 0)) > 0)
+    {
+        resp.append(buf, len);
+    }
+    close(fd);
+    return count_responses(resp);
+}
+
+static int failures = 0;
+
+static void expect_responses(const char *engine, const char *name, const char *const *parts, int n, int want)
+{
+    int got = exchange(parts, n, want);
+    bool ok = got == want;
+    printf("%s %s %s: %d responses (want %d)\n", ok ? "ok  " : "FAIL", engine, name, got, want);
+    failures += ok ? 0 : 1;
+}
+
+static void run_engine(const char *server, const std::string &root, const char *engine)
+{
+    std::string port_arg = "--port=" + std::to_string(port);
+    std::string root_arg = "--doc_root=" + root;
+    fflush(stdout); // 否则子进程会再输出一遍缓冲中的测试结果
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // 服务器的输出丢弃
+        freopen("/dev/null", "w", stdout);
+        execl(server, server, "-e", engine, port_arg.c_str(), root_arg.c_str(), "--threads=1", (char *)NULL);
+        _exit(127);
+    }
+
+    // 等服务器开始监听
+    for (int i = 0; i < 100; ++i)
+    {
+        int fd = connect_server();
+        if (fd >= 0)
+        {
+            close(fd);
+            break;
+        }
+        usleep(50000);
+    }
+
+    const char *two[] = {"GET /a.html HTTP/1.1\r\nHost: test\r\n\r\nGET /a.html HTTP/1.1\r\nHost: test\r\n\r\n"};
+    expect_responses(engine, "two requests in one write", two, 1, 2);
+    const char *bare[] = {"GET / HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\n\r\n"};
+    expect_responses(engine, "two bare requests", bare, 1, 2);
+    const char *split[] = {"GET /a.html HTTP/1.1\r\nHost: test\r\n\r\nGET /a.html HTTP/1.1\r\nHo", "st: test\r\n\r\n"};
+    expect_responses(engine, "second request split", split, 2, 2);
+    const char *body[] = {"GET /a.html HTTP/1.1\r\nHost: test\r\nContent-Length: 3\r\n\r\nabcHEAD /a.html HTTP/1.1\r\nHost: test\r\n\r\n"};
+    expect_responses(engine, "request after a body", body, 1, 2);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        printf("usage: %s lwcWebServer\n", argv[0]);
+        return 2;
+    }
+    char root[] = "/tmp/lwc_pipeline_XXXXXX";
+    if (!mkdtemp(root))
+    {
+        perror("mkdtemp");
+        return 2;
+    }
+    std::string dir = root;
+    std::string file = dir + "/a.html";
+    int fd = open(file.c_str(), O_WRONLY | O_CREAT, 0644);
+    write(fd, "hello\n", 6);
+    close(fd);
+
+    // 不支持io_uring的内核上uring后端回落到epoll 测试照样进行
+    // 每个后端用不同的端口：io_uring实例在进程退出后异步销毁，其间监听socket还没有关闭
+    const char *engines[] = {"epoll", "uring", "coro"};
+    for (int i = 0; i < 3; ++i)
+    {
+        port = 20000 + (getpid() * 3 + i) % 20000;
+        run_engine(argv[1], dir, engines[i]);
+    }
+
+    unlink(file.c_str());
+    rmdir(dir.c_str());
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,119 @@
+// 目录重定向的回归测试：Location必须由规范化后的路径构造，不能把原始URL回显给客户端
+// 用法: redirect_test <lwcWebServer路径> 在临时doc_root上启动服务器，逐个发送请求并检查响应
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+
+static int port = 0;
+
+// 发送一个请求并读完响应 连接失败时返回空串
+static std::string request(const std::string &req)
+{
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return std::string();
+    }
+    send(fd, req.data(), req.size(), 0);
+    std::string resp;
+    char buf[4096];
+    ssize_t n;
+    // 响应带Connection: close 服务器发完后关闭连接
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+    {
+        resp.append(buf, n);
+    }
+    close(fd);
+    return resp;
+}
+
+// 取出响应中某个头部的值 没有时返回"(none)"
+static std::string header(const std::string &resp, const char *name)
+{
+    std::string key = std::string("\r\n") + name + ": ";
+    size_t pos = resp.find(key);
+    if (pos == std::string::npos)
+    {
+        return "(none)";
+    }
+    pos += key.size();
+    return resp.substr(pos, resp.find("\r\n", pos) - pos);
+}
+
+static int failures = 0;
+
+static void expect_redirect(const char *target, const char *location)
+{
+    std::string resp = request(std::string("GET ") + target + " HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n");
+    std::string got = header(resp, "Location");
+    bool ok = resp.compare(0, 12, "HTTP/1.1 301") == 0 && got == location;
+    printf("%s %s -> %s (want %s)\n", ok ? "ok  " : "FAIL", target, got.c_str(), location);
+    failures += ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        printf("usage: %s lwcWebServer\n", argv[0]);
+        return 2;
+    }
+    char root[] = "/tmp/lwc_redirect_XXXXXX";
+    if (!mkdtemp(root))
+    {
+        perror("mkdtemp");
+        return 2;
+    }
+    std::string dir = root;
+    mkdir((dir + "/sub").c_str(), 0755);
+    mkdir((dir + "/\\host").c_str(), 0755);
+    mkdir((dir + "/a b").c_str(), 0755);
+
+    port = 20000 + getpid() % 20000;
+    std::string port_arg = "--port=" + std::to_string(port);
+    std::string root_arg = "--doc_root=" + dir;
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // 服务器的输出丢弃
+        freopen("/dev/null", "w", stdout);
+        execl(argv[1], argv[1], port_arg.c_str(), root_arg.c_str(), "--threads=1", (char *)NULL);
+        _exit(127);
+    }
+
+    // 等服务器开始监听
+    for (int i = 0; i < 100 && request("HEAD / HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n").empty(); ++i)
+    {
+        usleep(50000);
+    }
+
+    expect_redirect("//evil.com/..", "/");
+    expect_redirect("//evil.com/../sub", "/sub/");
+    expect_redirect("/\\host", "/%5Chost/");
+    expect_redirect("/%5Chost", "/%5Chost/");
+    expect_redirect("/a%20b", "/a%20b/");
+    expect_redirect("/sub?x=1#frag", "/sub/?x=1");
+    expect_redirect("/./sub", "/sub/");
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    rmdir((dir + "/sub").c_str());
+    rmdir((dir + "/\\host").c_str());
+    rmdir((dir + "/a b").c_str());
+    rmdir(dir.c_str());
+    return failures == 0 ? 0 : 1;
+}
@@ -2,10 +2,13 @@
 #define THREADPOOL_H
 
 #include <list>
+#include <vector>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
+#include <sched.h>
 #include "locker.h"
+#include "admission.h"
 
 template <typename T>
 class threadpool
@@ -14,24 +17,37 @@ public:
     threadpool(int thread_number = 8, int max_requests = 10000);
     ~threadpool();
     bool append(T *request);
+    int inflight() { return m_inflight; }
+    // 绑定线程 each为true时第i个线程只在cpus[i % cpus.size()]上运行，否则每个线程都可以在cpus中任意一个上运行
+    void set_affinity(const std::vector<int> &cpus, bool each);
 
 private:
     static void *worker(void *arg);
     void run();
+    void stop(int started);
 
 private:
+    // 请求队列的元素 记录入队时刻用于计算排队时延
+    struct work_item
+    {
+        T *request;
+        long long enqueue_us;
+    };
+
     int m_thread_number;        // 线程池中的线程数
-    int m_max_requests;         // 请求队列中允许的最大的等待请求数
+    int m_max_requests;         // 允许同时在途(排队+正在处理)的最大请求数
     pthread_t *m_threads;       // 线程标识符的数组，其大小为m_thread_number
    
-    std::list<T *> m_workqueue; // 请求队列
-    locker m_queuelocker;       // 保护请求队列的互斥锁
+    std::list<work_item> m_workqueue; // 请求队列
+    locker m_queuelocker;       // 保护请求队列、m_inflight和m_codel的互斥锁
     sem m_queuestat;            // 是否有任务需要处理
-    bool m_stop;                // 是否结束线程
+    bool m_stop;                // 是否结束线程 由m_queuelocker保护
+    int m_inflight;             // 在途请求数
+    codel m_codel;              // 按排队时延决定是否丢弃请求
 };
 
 template <typename T>
-threadpool<T>::threadpool(int thread_number, int max_requests) : m_thread_number(thread_number), m_max_requests(max_requests), m_stop(false), m_threads(NULL)
+threadpool<T>::threadpool(int thread_number, int max_requests) : m_thread_number(thread_number), m_max_requests(max_requests), m_stop(false), m_threads(NULL), m_inflight(0)
 {
     if ((thread_number <= 0) || (max_requests <= 0))
     {
@@ -44,41 +60,82 @@ threadpool<T>::threadpool(int thread_number, int max_requests) : m_thread_number
         throw std::exception();
     }
 
-    // 创建thread_number个线程，并都设置为脱离线程
+    // 创建thread_number个线程 不脱离，析构时逐个join，保证之后不再有线程访问请求对象
     for (int i = 0; i < thread_number; ++i)
     {
         printf("create the %dth thread\n", i);
         // (新线程的标识符,新线程的属性,新线程将运行的函数,新线程将运行的函数的参数)
         if (pthread_create(m_threads + i, NULL, worker, this) != 0)
         {
-            delete[] m_threads;
-            throw std::exception();
-        }
-        if (pthread_detach(m_threads[i]))
-        {
-            delete[] m_threads;
+            stop(i);
             throw std::exception();
         }
     }
 }
 
+// 等正在处理的请求完成后结束线程 还在队列里的请求不再处理
 template <typename T>
 threadpool<T>::~threadpool()
 {
-    delete[] m_threads;
+    stop(m_thread_number);
+}
+
+// 通知并join已创建的前started个线程
+template <typename T>
+void threadpool<T>::stop(int started)
+{
+    m_queuelocker.lock();
     m_stop = true;
+    m_queuelocker.unlock();
+    for (int i = 0; i < started; ++i)
+    {
+        m_queuestat.post(); // 每个线程都要被唤醒一次才能看到m_stop
+    }
+    for (int i = 0; i < started; ++i)
+    {
+        pthread_join(m_threads[i], NULL);
+    }
+    delete[] m_threads;
+    m_threads = NULL;
+}
+
+template <typename T>
+void threadpool<T>::set_affinity(const std::vector<int> &cpus, bool each)
+{
+    if (cpus.empty())
+    {
+        return;
+    }
+    cpu_set_t all;
+    CPU_ZERO(&all);
+    for (size_t i = 0; i < cpus.size(); ++i)
+    {
+        CPU_SET(cpus[i], &all);
+    }
+    for (int i = 0; i < m_thread_number; ++i)
+    {
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpus[i % cpus.size()], &one);
+        pthread_setaffinity_np(m_threads[i], sizeof(cpu_set_t), each ? &one : &all);
+    }
 }
 
+// 返回false表示在途请求已达上限 调用方应当拒绝该请求(T::shed)而不是丢下不管
 template <typename T>
 bool threadpool<T>::append(T *request)
 {
     m_queuelocker.lock();
-    if (m_workqueue.size() > m_max_requests)
+    if (m_inflight >= m_max_requests)
     {
         m_queuelocker.unlock();
         return false;
     }
-    m_workqueue.push_back(request); // 往线程池的请求队列中添加任务
+    work_item item;
+    item.request = request;
+    item.enqueue_us = monotonic_us();
+    m_workqueue.push_back(item); // 往线程池的请求队列中添加任务
+    ++m_inflight;
 
     static int max_size = 0;
     max_size = m_workqueue.size() > max_size ? m_workqueue.size() : max_size;
@@ -100,24 +157,42 @@ void *threadpool<T>::worker(void *arg)
 template <typename T>
 void threadpool<T>::run()
 {
-    while (!m_stop)
+    while (true)
     {
         m_queuestat.wait();   // 阻塞等待任务 允许多个线程进入临界区 再争抢锁
         m_queuelocker.lock(); // 线程竞争 给请求队列加锁
+        if (m_stop)
+        {
+            m_queuelocker.unlock();
+            break;
+        }
         // 应对惊群效应
         if (m_workqueue.empty())
         {
             m_queuelocker.unlock();
             continue;
         }
-        T *request = m_workqueue.front(); // 获取队头的请求：http_conn对象
+        work_item item = m_workqueue.front(); // 获取队头的请求：http_conn对象
         m_workqueue.pop_front();
+        long long now = monotonic_us();
+        // 排队太久的请求等处理完客户端多半已经超时 不如快速回503让其稍后重试
+        bool drop = m_codel.should_drop(now, now - item.enqueue_us);
         m_queuelocker.unlock();
-        if (!request)
+        T *request = item.request;
+        if (request)
         {
-            continue;
+            if (drop)
+            {
+                request->shed(); // 快速拒绝
+            }
+            else
+            {
+                request->process(); // request = users + sockfd
+            }
         }
-        request->process(); // request = users + sockfd
+        m_queuelocker.lock();
+        --m_inflight;
+        m_queuelocker.unlock();
     }
 }
 
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <exception>
+#include "tls.h"
+
+#ifdef LWC_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+long long tls_context::m_handshakes = 0;
+long long tls_context::m_resumed = 0;
+long long tls_context::m_ktls = 0;
+
+#ifdef LWC_TLS
+
+// 打印OpenSSL错误队列中的原因
+static void print_errors(const char *what)
+{
+    unsigned long err = ERR_get_error();
+    char reason[256];
+    ERR_error_string_n(err, reason, sizeof(reason));
+    printf("%s: %s\n", what, err ? reason : "unknown error");
+    ERR_clear_error();
+}
+
+// ALPN：arg为本端支持的协议列表 按本端的顺序选择，客户端一个都不支持时不协商ALPN
+static const unsigned char alpn_h2[] = "\x02h2\x08http/1.1";
+static const unsigned char alpn_http11[] = "\x08http/1.1";
+
+static int select_alpn(SSL *, const unsigned char **out, unsigned char *outlen,
+                       const unsigned char *in, unsigned int inlen, void *arg)
+{
+    const unsigned char *protos = (const unsigned char *)arg;
+    unsigned char *selected;
+    if (SSL_select_next_proto(&selected, outlen, protos, strlen((const char *)protos), in, inlen) != OPENSSL_NPN_NEGOTIATED)
+    {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+tls_context::tls_context(const std::string &cert, const std::string &key, int session_cache, bool tickets, bool ktls, bool http2)
+{
+    m_ctx = SSL_CTX_new(TLS_server_method());
+    if (!m_ctx)
+    {
+        print_errors("cannot create TLS context");
+        throw std::exception();
+    }
+    const std::string &key_file = key.empty() ? cert : key;
+    if (SSL_CTX_use_certificate_chain_file(m_ctx, cert.c_str()) != 1)
+    {
+        print_errors(("cannot load certificate " + cert).c_str());
+        SSL_CTX_free(m_ctx);
+        throw std::exception();
+    }
+    if (SSL_CTX_use_PrivateKey_file(m_ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(m_ctx) != 1)
+    {
+        print_errors(("cannot load private key " + key_file).c_str());
+        SSL_CTX_free(m_ctx);
+        throw std::exception();
+    }
+    SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+    // 与writev一样允许只写出一部分 重试时iovec已经前移，缓冲区地址随之变化
+    // 空闲的长连接不保留读写记录用的缓冲区
+    SSL_CTX_set_mode(m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    // 会话复用 缓存在本进程内；票据由客户端保存，多进程模式下任一工作进程都能解开
+    static const unsigned char sid_ctx[] = "lwc";
+    SSL_CTX_set_session_id_context(m_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    if (session_cache > 0)
+    {
+        SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(m_ctx, session_cache);
+    }
+    else
+    {
+        SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_OFF);
+    }
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // 客户端不发close_notify直接断开很常见 当作正常关闭
+    SSL_CTX_set_options(m_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    if (!tickets)
+    {
+        SSL_CTX_set_options(m_ctx, SSL_OP_NO_TICKET);
+    }
+#ifdef SSL_OP_ENABLE_KTLS
+    if (ktls)
+    {
+        SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS);
+    }
+#else
+    if (ktls)
+    {
+        printf("kTLS is not supported by this OpenSSL\n");
+    }
+#endif
+    SSL_CTX_set_alpn_select_cb(m_ctx, select_alpn, (void *)(http2 ? alpn_h2 : alpn_http11));
+}
+
+tls_context::~tls_context()
+{
+    SSL_CTX_free(m_ctx);
+}
+
+SSL *tls_context::accept(int fd)
+{
+    SSL *ssl = SSL_new(m_ctx);
+    if (!ssl)
+    {
+        print_errors("cannot create TLS connection");
+        return NULL;
+    }
+    if (SSL_set_fd(ssl, fd) != 1)
+    {
+        print_errors("cannot attach TLS connection");
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+// 把SSL_read/SSL_write的失败换成recv/writev的约定
+static ssize_t fail(SSL *ssl, int ret)
+{
+    switch (SSL_get_error(ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN: // 对方发来close_notify
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (errno == 0) // 对方未发close_notify就断开 当作关闭
+        {
+            ERR_clear_error();
+            return 0;
+        }
+        ERR_clear_error();
+        return -1;
+    default: // 握手失败、记录校验失败等
+        print_errors("TLS error");
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+ssize_t tls_context::recv(SSL *ssl, void *buf, size_t len)
+{
+    bool handshaking = !SSL_is_init_finished(ssl);
+    size_t n = 0;
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_read_ex(ssl, buf, len, &n);
+    if (handshaking && SSL_is_init_finished(ssl))
+    {
+        handshake_done(ssl);
+    }
+    return ret == 1 ? (ssize_t)n : fail(ssl, ret);
+}
+
+ssize_t tls_context::writev(SSL *ssl, const struct iovec *iov, int iovcnt)
+{
+    // 内核接管了加密 没有留在OpenSSL中的记录，可以直接写socket
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+    {
+        return ::writev(SSL_get_fd(ssl), iov, iovcnt);
+    }
+    // 每块各自成为若干记录 某块没有写完就返回已写出的字节数
+    // 返回EAGAIN时OpenSSL可能已经接收了这一块的一部分，下次从同一块(同样的长度)开始重试，与它的约定一致
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; ++i)
+    {
+        if (iov[i].iov_len == 0)
+        {
+            continue;
+        }
+        size_t n = 0;
+        ERR_clear_error();
+        errno = 0;
+        int ret = SSL_write_ex(ssl, iov[i].iov_base, iov[i].iov_len, &n);
+        if (ret != 1)
+        {
+            if (total > 0)
+            {
+                ERR_clear_error();
+                return total;
+            }
+            ssize_t r = fail(ssl, ret);
+            if (r == 0) // 写时对方已关闭
+            {
+                errno = EPIPE;
+                r = -1;
+            }
+            return r;
+        }
+        total += n;
+        if (n < iov[i].iov_len)
+        {
+            break;
+        }
+    }
+    return total;
+}
+
+bool tls_context::pending(SSL *ssl)
+{
+    return SSL_pending(ssl) > 0;
+}
+
+bool tls_context::offloaded(SSL *ssl)
+{
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+void tls_context::shutdown(SSL *ssl)
+{
+    if (SSL_is_init_finished(ssl))
+    {
+        ERR_clear_error();
+        SSL_shutdown(ssl);
+        ERR_clear_error();
+    }
+}
+
+void tls_context::release(SSL *ssl)
+{
+    SSL_free(ssl);
+}
+
+void tls_context::handshake_done(SSL *ssl)
+{
+    __atomic_add_fetch(&m_handshakes, 1, __ATOMIC_RELAXED);
+    if (SSL_session_reused(ssl))
+    {
+        __atomic_add_fetch(&m_resumed, 1, __ATOMIC_RELAXED);
+    }
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+    {
+        __atomic_add_fetch(&m_ktls, 1, __ATOMIC_RELAXED);
+    }
+}
+
+#else
+
+tls_context::tls_context(const std::string &, const std::string &, int, bool, bool, bool) : m_ctx(NULL)
+{
+    printf("TLS support is not built in\n");
+    throw std::exception();
+}
+
+tls_context::~tls_context()
+{
+}
+
+SSL *tls_context::accept(int)
+{
+    return NULL;
+}
+
+ssize_t tls_context::recv(SSL *, void *, size_t)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t tls_context::writev(SSL *, const struct iovec *, int)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+bool tls_context::pending(SSL *)
+{
+    return false;
+}
+
+bool tls_context::offloaded(SSL *)
+{
+    return false;
+}
+
+void tls_context::shutdown(SSL *)
+{
+}
+
+void tls_context::release(SSL *)
+{
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <string>
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+
+// HTTPS(OpenSSL) 配置了tls_cert时每个连接在accept后先进行非阻塞握手，之后的请求和响应都经过TLS
+// 会话复用：服务端会话缓存和会话票据；多进程模式下在fork之前创建，各工作进程共用同一组票据密钥
+// kTLS：握手完成后如果内核接管了记录加密，响应(包括mmap的文件内容)直接writev到socket，不再经过用户态加密和复制
+// ALPN：http2为true时优先协商h2，否则只提供http/1.1
+// 构建时没有OpenSSL(LWC_TLS未定义)时构造函数打印原因后抛出异常
+class tls_context
+{
+public:
+    tls_context(const std::string &cert, const std::string &key, int session_cache, bool tickets, bool ktls, bool http2);
+    ~tls_context();
+
+    // 为新连接创建服务端的TLS状态 失败返回NULL
+    SSL *accept(int fd);
+
+    // 以下与recv/writev的约定相同：握手未完成或数据不足一个记录时返回-1且errno为EAGAIN，对方关闭返回0
+    // 同一连接同一时刻只能有一个线程调用
+    static ssize_t recv(SSL *ssl, void *buf, size_t len);
+    static ssize_t writev(SSL *ssl, const struct iovec *iov, int iovcnt);
+    // 已解密但还未取走的数据 epoll不会为它们再通知可读
+    static bool pending(SSL *ssl);
+    // 由内核加密发送 writev不经过OpenSSL，写入的块不会各自成为记录
+    static bool offloaded(SSL *ssl);
+    // 主动关闭前发送close_notify 不等待对方回应
+    static void shutdown(SSL *ssl);
+    static void release(SSL *ssl);
+
+public:
+    static long long m_handshakes; // 完成的握手数
+    static long long m_resumed;    // 其中复用了会话的
+    static long long m_ktls;       // 其中由内核加密发送的
+
+private:
+    static void handshake_done(SSL *ssl);
+
+private:
+    SSL_CTX *m_ctx;
+};
+
+#endif
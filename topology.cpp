@@ -0,0 +1,206 @@
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "topology.h"
+
+// 节点编号上限 sysfs中通常是连续的0..N-1，中间缺号的节点视为空节点
+static const int MAX_NODES = 1024;
+
+std::vector<std::vector<int> > cpu_topology::s_nodes;
+
+// 解析"0-3,8-11"格式的CPU列表 只保留allowed中的CPU
+static std::vector<int> parse_cpulist(const char *s, const cpu_set_t &allowed)
+{
+    std::vector<int> cpus;
+    while (*s)
+    {
+        char *end;
+        long first = strtol(s, &end, 10);
+        if (end == s)
+        {
+            break;
+        }
+        long last = first;
+        s = end;
+        if (*s == '-')
+        {
+            last = strtol(s + 1, &end, 10);
+            s = end;
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+        if (*s != ',')
+        {
+            break;
+        }
+        ++s;
+    }
+    return cpus;
+}
+
+// 把升序的CPU编号压缩为"0-3,8-11"
+static std::string format_cpulist(const std::vector<int> &cpus)
+{
+    std::string out;
+    char buf[32];
+    for (size_t i = 0; i < cpus.size();)
+    {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+        {
+            ++j;
+        }
+        if (j == i)
+        {
+            snprintf(buf, sizeof(buf), "%s%d", out.empty() ? "" : ",", cpus[i]);
+        }
+        else
+        {
+            snprintf(buf, sizeof(buf), "%s%d-%d", out.empty() ? "" : ",", cpus[i], cpus[j]);
+        }
+        out += buf;
+        i = j + 1;
+    }
+    return out;
+}
+
+void cpu_topology::discover()
+{
+    s_nodes.clear();
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        CPU_ZERO(&allowed);
+        for (int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; ++cpu)
+        {
+            CPU_SET(cpu, &allowed);
+        }
+    }
+
+    int found = 0; // 已读到的节点数 遇到连续多个不存在的编号后停止
+    for (int node = 0; node < MAX_NODES && node - found < 64; ++node)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *in = fopen(path, "r");
+        if (!in)
+        {
+            continue;
+        }
+        char line[4096];
+        if (fgets(line, sizeof(line), in))
+        {
+            s_nodes.resize(node + 1);
+            s_nodes[node] = parse_cpulist(line, allowed);
+            found = node + 1;
+        }
+        fclose(in);
+    }
+    // 末尾没有可用CPU的节点去掉 节点编号在中间仍保持与内核一致
+    while (!s_nodes.empty() && s_nodes.back().empty())
+    {
+        s_nodes.pop_back();
+    }
+
+    if (s_nodes.empty())
+    {
+        s_nodes.resize(1);
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+            {
+                s_nodes[0].push_back(cpu);
+            }
+        }
+    }
+}
+
+int cpu_topology::node_of(int cpu)
+{
+    for (size_t node = 0; node < s_nodes.size(); ++node)
+    {
+        for (size_t i = 0; i < s_nodes[node].size(); ++i)
+        {
+            if (s_nodes[node][i] == cpu)
+            {
+                return node;
+            }
+        }
+    }
+    return -1;
+}
+
+bool cpu_topology::pin_current_thread(int cpu)
+{
+    return pin_current_thread(std::vector<int>(1, cpu));
+}
+
+bool cpu_topology::pin_current_thread(const std::vector<int> &cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); ++i)
+    {
+        CPU_SET(cpus[i], &set);
+    }
+    return !cpus.empty() && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+std::vector<int> cpu_topology::current_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+bool cpu_topology::prefer_node(int node)
+{
+    if (s_nodes.size() <= 1)
+    {
+        return true;
+    }
+    const int bits = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> mask(MAX_NODES / bits, 0);
+    mask[node / bits] |= 1UL << (node % bits);
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask[0], (unsigned long)MAX_NODES) != 0)
+    {
+        printf("cannot prefer memory on node %d: %s\n", node, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+std::string cpu_topology::describe()
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%d node%s:", (int)s_nodes.size(), s_nodes.size() == 1 ? "" : "s");
+    std::string out = buf;
+    for (size_t node = 0; node < s_nodes.size(); ++node)
+    {
+        snprintf(buf, sizeof(buf), " node%d ", (int)node);
+        out += buf;
+        out += s_nodes[node].empty() ? "-" : format_cpulist(s_nodes[node]);
+    }
+    return out;
+}
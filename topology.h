@@ -0,0 +1,40 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <string>
+#include <vector>
+
+// CPU和NUMA拓扑
+// 从/sys/devices/system/node读出每个NUMA节点的CPU列表，与启动时本进程允许使用的CPU取交集；
+// 没有NUMA信息(非NUMA内核、容器中没有挂载sysfs等)时把允许使用的CPU都当作节点0
+// 不依赖libnuma：绑定线程用sched/pthread的亲和性接口，内存策略直接调用set_mempolicy系统调用
+class cpu_topology
+{
+public:
+    // 读取拓扑 必须在任何绑定(包括master给工作进程绑定CPU)之前调用，此时的亲和性才是整个进程可用的CPU
+    static void discover();
+
+    static int node_count() { return s_nodes.size(); }
+    // 节点node上本进程允许使用的CPU 按编号升序
+    static const std::vector<int> &node_cpus(int node) { return s_nodes[node]; }
+    // cpu所在的节点 不在任何节点上时返回-1
+    static int node_of(int cpu);
+
+    // 把调用线程绑定到一个CPU/一组CPU上 失败返回false
+    static bool pin_current_thread(int cpu);
+    static bool pin_current_thread(const std::vector<int> &cpus);
+    // 调用线程当前允许使用的CPU
+    static std::vector<int> current_cpus();
+
+    // 调用线程之后分配的内存优先放在节点node上 调用之后创建的线程继承这一策略
+    // 只有一个节点时什么也不做；内核不支持或没有权限时返回false，内存仍按默认的首次访问策略分配
+    static bool prefer_node(int node);
+
+    // 用于启动日志 如"2 nodes: node0 0-3,8-11 node1 4-7,12-15"
+    static std::string describe();
+
+private:
+    static std::vector<std::vector<int> > s_nodes;
+};
+
+#endif
@@ -0,0 +1,182 @@
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include "upgrade.h"
+
+extern char **environ;
+
+// 新进程从这个环境变量得到与旧进程通信的socket
+static const char *UPGRADE_ENV = "LWC_UPGRADE_FD";
+
+std::string upgrade::s_exe;
+std::vector<std::string> upgrade::s_args;
+pid_t upgrade::s_parent = 0;
+
+void upgrade::save_command(int argc, char *argv[])
+{
+    // /proc/self/exe在启动时解析 可执行文件之后被替换(rename)时该路径指向新文件
+    char path[4096];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len > 0)
+    {
+        path[len] = '\0';
+        s_exe = path;
+    }
+    else
+    {
+        s_exe = argv[0];
+    }
+    // 复制一份 getopt会重排argv 解析时也可能原地修改参数
+    s_args.assign(argv, argv + argc);
+}
+
+int upgrade::inherit_listen_fd()
+{
+    const char *env = getenv(UPGRADE_ENV);
+    if (!env)
+    {
+        return -1;
+    }
+    int sock = atoi(env);
+    unsetenv(UPGRADE_ENV);
+    int fd = recv_fd(sock);
+    close(sock);
+    if (fd < 0)
+    {
+        printf("cannot receive listen socket: %s\n", strerror(errno));
+        return -1;
+    }
+    s_parent = getppid();
+    printf("inherited listen socket %d from %d\n", fd, s_parent);
+    return fd;
+}
+
+void upgrade::notify_ready()
+{
+    if (s_parent > 1)
+    {
+        kill(s_parent, SIGUSR1);
+        s_parent = 0;
+    }
+}
+
+pid_t upgrade::start(int listenfd)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+    {
+        return -1;
+    }
+
+    // fork之后的子进程中只能调用异步信号安全的函数 参数和环境变量都在fork之前准备好
+    std::vector<char *> argv;
+    for (size_t i = 0; i < s_args.size(); ++i)
+    {
+        argv.push_back(const_cast<char *>(s_args[i].c_str()));
+    }
+    argv.push_back(NULL);
+    char env_fd[64];
+    snprintf(env_fd, sizeof(env_fd), "%s=%d", UPGRADE_ENV, sv[1]);
+    std::vector<char *> envp;
+    for (char **e = environ; *e; ++e)
+    {
+        if (strncmp(*e, UPGRADE_ENV, strlen(UPGRADE_ENV)) != 0)
+        {
+            envp.push_back(*e);
+        }
+    }
+    envp.push_back(env_fd);
+    envp.push_back(NULL);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        fcntl(sv[1], F_SETFD, 0); // 这一端要跨过exec
+        // 信号屏蔽字会跨过exec保留 多进程模式的主进程屏蔽了SIGTERM等信号，新进程不能继承
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execve(s_exe.c_str(), &argv[0], &envp[0]);
+        _exit(127);
+    }
+
+    close(sv[1]);
+    // 新进程启动后再读 消息在socket缓冲区中等待
+    bool sent = send_fd(sv[0], listenfd);
+    close(sv[0]);
+    if (!sent)
+    {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    printf("started new process %d (%s)\n", pid, s_exe.c_str());
+    return pid;
+}
+
+bool upgrade::running(pid_t pid)
+{
+    return pid > 0 && waitpid(pid, NULL, WNOHANG) == 0;
+}
+
+bool upgrade::send_fd(int sock, int fd)
+{
+    char data = 'L';
+    struct iovec iov;
+    iov.iov_base = &data;
+    iov.iov_len = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
+
+int upgrade::recv_fd(int sock)
+{
+    char data;
+    struct iovec iov;
+    iov.iov_base = &data;
+    iov.iov_len = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+    {
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
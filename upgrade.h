@@ -0,0 +1,38 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+// 不中断服务的可执行文件升级
+// 旧进程收到SIGUSR2后fork并exec(可能已被替换的)可执行文件，通过UNIX域socket以SCM_RIGHTS把监听socket交给新进程；
+// 新进程不再bind，直接在继承的监听socket上accept，初始化完成后向旧进程发SIGUSR1；
+// 旧进程收到后停止accept，把已有连接处理完再退出。两个进程共用同一个监听队列，升级期间不会拒绝连接
+class upgrade
+{
+public:
+    // 启动时调用 记下重新exec所需的可执行文件路径和命令行参数
+    static void save_command(int argc, char *argv[]);
+
+    // 新进程启动时调用：由旧进程启动时返回继承的监听socket，否则返回-1
+    static int inherit_listen_fd();
+    // 新进程初始化完成 通知旧进程开始排空
+    static void notify_ready();
+
+    // 旧进程：启动新进程并把listenfd交给它 成功返回子进程pid 失败返回-1
+    static pid_t start(int listenfd);
+    // 上一次启动的新进程是否还在运行(未就绪前退出说明升级失败)
+    static bool running(pid_t pid);
+
+private:
+    static bool send_fd(int sock, int fd);
+    static int recv_fd(int sock);
+
+private:
+    static std::string s_exe;               // 可执行文件路径
+    static std::vector<std::string> s_args; // 原始命令行参数
+    static pid_t s_parent;                  // 由旧进程启动时为旧进程的pid
+};
+
+#endif
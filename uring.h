@@ -0,0 +1,187 @@
+#ifndef URING_H
+#define URING_H
+
+#include <exception>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// io_uring的最小封装：直接使用io_uring_setup/io_uring_enter系统调用和共享内存环，不依赖liburing
+// 提交队列(SQ)和完成队列(CQ)都只由事件循环所在的线程访问
+class uring
+{
+public:
+    // entries:提交队列长度 完成队列为其4倍，避免大量连接同时完成时溢出
+    explicit uring(unsigned entries) : m_fd(-1), m_sq_ptr(MAP_FAILED), m_cq_ptr(MAP_FAILED), m_sqes((io_uring_sqe *)MAP_FAILED)
+    {
+        memset(&m_params, 0, sizeof(m_params));
+        m_params.flags = IORING_SETUP_CQSIZE;
+        m_params.cq_entries = entries * 4;
+        m_fd = syscall(__NR_io_uring_setup, entries, &m_params);
+        if (m_fd < 0) // 内核不支持或被seccomp禁用
+        {
+            throw std::exception();
+        }
+
+        m_sq_size = m_params.sq_off.array + m_params.sq_entries * sizeof(unsigned);
+        m_cq_size = m_params.cq_off.cqes + m_params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = m_params.features & IORING_FEAT_SINGLE_MMAP; // SQ和CQ环可以一次映射
+        if (single_mmap)
+        {
+            m_sq_size = m_cq_size = (m_sq_size > m_cq_size) ? m_sq_size : m_cq_size;
+        }
+        m_sq_ptr = mmap(0, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (m_sq_ptr == MAP_FAILED)
+        {
+            release();
+            throw std::exception();
+        }
+        m_cq_ptr = single_mmap ? m_sq_ptr : mmap(0, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        m_sqes = (io_uring_sqe *)mmap(0, m_params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (m_cq_ptr == MAP_FAILED || m_sqes == MAP_FAILED)
+        {
+            release();
+            throw std::exception();
+        }
+
+        char *sq = (char *)m_sq_ptr;
+        m_sq_head = (unsigned *)(sq + m_params.sq_off.head);
+        m_sq_tail = (unsigned *)(sq + m_params.sq_off.tail);
+        m_sq_mask = *(unsigned *)(sq + m_params.sq_off.ring_mask);
+        unsigned *sq_array = (unsigned *)(sq + m_params.sq_off.array);
+        // SQ环中第i项固定指向第i个sqe，之后只需移动tail
+        for (unsigned i = 0; i < m_params.sq_entries; ++i)
+        {
+            sq_array[i] = i;
+        }
+        m_sqe_tail = *m_sq_tail;
+
+        char *cq = (char *)m_cq_ptr;
+        m_cq_head = (unsigned *)(cq + m_params.cq_off.head);
+        m_cq_tail = (unsigned *)(cq + m_params.cq_off.tail);
+        m_cq_mask = *(unsigned *)(cq + m_params.cq_off.ring_mask);
+        m_cqes = (io_uring_cqe *)(cq + m_params.cq_off.cqes);
+    }
+
+    ~uring()
+    {
+        release();
+    }
+
+    // 取一个空闲的sqe 提交队列已满时返回NULL 调用方应先submit
+    io_uring_sqe *get_sqe()
+    {
+        unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (m_sqe_tail - head >= m_params.sq_entries)
+        {
+            return NULL;
+        }
+        io_uring_sqe *sqe = &m_sqes[m_sqe_tail & m_sq_mask];
+        ++m_sqe_tail;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // 提交队列中剩余的空闲sqe个数 链接在一起的请求必须在同一批中提交
+    unsigned sq_space()
+    {
+        return m_params.sq_entries - (m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE));
+    }
+
+    // 提交所有已填好的sqe，并至少等待wait_nr个完成事件 失败返回-1并设置errno
+    int submit(unsigned wait_nr = 0)
+    {
+        unsigned to_submit = m_sqe_tail - *m_sq_tail;
+        // 内核看到新的tail之前，sqe的内容必须已经写好
+        __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+        if (to_submit == 0 && wait_nr == 0)
+        {
+            return 0;
+        }
+        unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+        return syscall(__NR_io_uring_enter, m_fd, to_submit, wait_nr, flags, NULL, 0);
+    }
+
+    // 查看下一个完成事件 没有则返回NULL 处理完后调用cqe_seen归还
+    io_uring_cqe *peek_cqe()
+    {
+        unsigned head = *m_cq_head;
+        unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {
+            return NULL;
+        }
+        return &m_cqes[head & m_cq_mask];
+    }
+
+    void cqe_seen()
+    {
+        __atomic_store_n(m_cq_head, *m_cq_head + 1, __ATOMIC_RELEASE);
+    }
+
+    // 内核是否支持某个操作码
+    bool probe(int op)
+    {
+        size_t len = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+        io_uring_probe *p = (io_uring_probe *)calloc(1, len);
+        if (!p)
+        {
+            return false;
+        }
+        bool ok = false;
+        if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, p, 256) == 0 && op <= p->last_op)
+        {
+            ok = p->ops[op].flags & IO_URING_OP_SUPPORTED;
+        }
+        free(p);
+        return ok;
+    }
+
+private:
+    void release()
+    {
+        if (m_sqes != MAP_FAILED)
+        {
+            munmap(m_sqes, m_params.sq_entries * sizeof(io_uring_sqe));
+        }
+        if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr)
+        {
+            munmap(m_cq_ptr, m_cq_size);
+        }
+        if (m_sq_ptr != MAP_FAILED)
+        {
+            munmap(m_sq_ptr, m_sq_size);
+        }
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+        m_fd = -1;
+        m_sq_ptr = m_cq_ptr = MAP_FAILED;
+        m_sqes = (io_uring_sqe *)MAP_FAILED;
+    }
+
+private:
+    int m_fd;                 // io_uring实例的文件描述符
+    io_uring_params m_params; // 内核返回的环参数
+    void *m_sq_ptr;           // 映射的提交队列环
+    void *m_cq_ptr;           // 映射的完成队列环
+    size_t m_sq_size;
+    size_t m_cq_size;
+    io_uring_sqe *m_sqes;     // sqe数组
+
+    unsigned *m_sq_head;      // 内核消费到的位置
+    unsigned *m_sq_tail;      // 已发布给内核的位置
+    unsigned m_sq_mask;
+    unsigned m_sqe_tail;      // 本地已填好但可能尚未发布的位置
+
+    unsigned *m_cq_head;      // 已处理到的完成事件
+    unsigned *m_cq_tail;      // 内核写到的位置
+    unsigned m_cq_mask;
+    io_uring_cqe *m_cqes;     // 完成事件数组
+};
+
+#endif
@@ -0,0 +1,692 @@
+#include "uring_server.h"
+
+extern void show_error(int connfd, const char *info);
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22 // Linux 5.14
+#endif
+
+// user_data的编码：高位是连接的fd 低8位是请求类型
+static inline __u64 make_data(int op, int fd)
+{
+    return ((__u64)(unsigned)fd << 8) | op;
+}
+
+uring_server::uring_server(int listenfd, int sigfd, http_conn *users, int max_fd, server_control &ctl)
+    : m_ring(RING_ENTRIES), m_listenfd(listenfd), m_sigfd(sigfd), m_users(users), m_max_fd(max_fd), m_ctl(ctl),
+      m_conns(NULL), m_users_timer(NULL), m_buffers(NULL), m_pending_signals(0), m_timerfd(-1), m_timer_armed(0), m_next_tick(0),
+      m_drain_started(false), m_multishot_accept(true), m_accept_armed(false), m_accept_paused(false), m_accept_emfile(false),
+      m_stop(false), m_openat2(false)
+{
+    // 缺少任何一个所需的操作都回落到epoll
+    m_openat2 = m_ring.probe(IORING_OP_OPENAT2); // 不支持时用openat+O_NOFOLLOW
+    static const int required_ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_CLOSE,
+                                       IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_PROVIDE_BUFFERS,
+                                       IORING_OP_READ, IORING_OP_MADVISE, IORING_OP_ASYNC_CANCEL};
+    for (unsigned i = 0; i < sizeof(required_ops) / sizeof(required_ops[0]); ++i)
+    {
+        if (!m_ring.probe(required_ops[i]))
+        {
+            printf("io_uring op %d not supported\n", required_ops[i]);
+            throw std::exception();
+        }
+    }
+
+    m_timerfd = open_timerfd();
+    if (m_timerfd < 0)
+    {
+        printf("cannot create timerfd: %s\n", strerror(errno));
+        throw std::exception();
+    }
+
+    m_conns = new conn_state[max_fd];
+    m_users_timer = new client_data[max_fd];
+    m_buffers = new char[BUFFER_COUNT * http_conn::m_read_buffer_size];
+}
+
+uring_server::~uring_server()
+{
+    close(m_timerfd);
+    delete[] m_conns;
+    delete[] m_users_timer;
+    delete[] m_buffers;
+}
+
+// 取一个空闲的sqe 提交队列满了就先把已有的请求提交给内核
+io_uring_sqe *uring_server::get_sqe()
+{
+    io_uring_sqe *sqe = m_ring.get_sqe();
+    while (!sqe)
+    {
+        m_ring.submit();
+        sqe = m_ring.get_sqe();
+    }
+    return sqe;
+}
+
+// multishot accept：提交一次 之后每接受一个连接产生一个完成事件
+void uring_server::arm_accept()
+{
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (m_multishot_accept)
+    {
+        sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->user_data = make_data(OP_ACCEPT, 0);
+    m_accept_armed = true;
+}
+
+// 从内核提供的缓冲区组中取缓冲区接收数据 空闲连接不占用接收缓冲区
+void uring_server::arm_recv(int fd)
+{
+    http_conn &conn = m_users[fd];
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = 0;
+    sqe->len = http_conn::m_read_buffer_size - conn.m_read_idx; // 不能超过应用读缓冲区的剩余空间
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = make_data(OP_RECV, fd);
+}
+
+// 读signalfd 没有信号时内核等它可读后再读
+void uring_server::arm_signal()
+{
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m_sigfd;
+    sqe->addr = (__u64)(unsigned long)m_signals;
+    sqe->len = sizeof(m_signals);
+    sqe->off = (__u64)-1; // 不可定位的文件 从当前位置读
+    sqe->user_data = make_data(OP_SIGNAL, 0);
+}
+
+// 读timerfd 到期时完成
+void uring_server::arm_tick()
+{
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m_timerfd;
+    sqe->addr = (__u64)(unsigned long)&m_expirations;
+    sqe->len = sizeof(m_expirations);
+    sqe->off = (__u64)-1;
+    sqe->user_data = make_data(OP_TICK, 0);
+}
+
+// 按最早的截止时间设置timerfd 截止时间推后时不必重设，提前到期的那次没有可处理的定时器
+void uring_server::rearm_timer()
+{
+    long long next = next_wakeup(m_ctl, m_next_tick, m_timer_lst.next_expire());
+    if (m_timer_armed == 0 || next < m_timer_armed)
+    {
+        arm_timerfd(m_timerfd, next);
+        m_timer_armed = next;
+    }
+}
+
+// 把从bid开始的count个接收缓冲区交给内核
+void uring_server::provide_buffer(int bid, int count)
+{
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (__u64)(unsigned long)(m_buffers + bid * http_conn::m_read_buffer_size);
+    sqe->len = http_conn::m_read_buffer_size;
+    sqe->off = bid;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = make_data(OP_PROVIDE_BUFFERS, 0);
+}
+
+void uring_server::on_accept(int res, unsigned flags)
+{
+    if (!(flags & IORING_CQE_F_MORE)) // multishot accept已终止 需要重新提交
+    {
+        m_accept_armed = false;
+    }
+    if (res >= 0)
+    {
+        add_client(res);
+    }
+    else if (res == -EINVAL && m_multishot_accept) // 内核不支持multishot accept 改为每次提交一个accept
+    {
+        printf("multishot accept not supported\n");
+        m_multishot_accept = false;
+    }
+    else if (res == -EMFILE || res == -ENFILE)
+    {
+        pause_accept(true);
+    }
+    else if (res != -ECANCELED)
+    {
+        printf("accept errno is: %d\n", -res);
+    }
+    if (!m_accept_armed && !m_accept_paused)
+    {
+        arm_accept();
+    }
+}
+
+void uring_server::add_client(int connfd)
+{
+    if (connfd >= m_max_fd) // 数组以fd为下标 不能越界
+    {
+        show_error(connfd, "Internal server busy");
+        return;
+    }
+    // multishot accept共用一个地址缓冲区 所以另行获取对端地址
+    struct sockaddr_in client_address;
+    socklen_t client_addrlength = sizeof(client_address);
+    getpeername(connfd, (struct sockaddr *)&client_address, &client_addrlength);
+    bool counted;
+    if (!http_conn::m_client_limits.connect(client_address.sin_addr.s_addr, counted)) // 该IP的连接数已达上限
+    {
+        close(connfd);
+        return;
+    }
+    m_users[connfd].init(connfd, client_address, 0);
+    m_conns[connfd].closing = false;
+
+    m_users_timer[connfd].address = client_address;
+    m_users_timer[connfd].sockfd = connfd;
+    m_users_timer[connfd].counted = counted;
+    util_timer *timer = new util_timer;
+    timer->user_data = &m_users_timer[connfd];
+    timer->cb_func = cb_func;
+    timer->expire = m_users[connfd].deadline(monotonic_ms());
+    m_users_timer[connfd].timer = timer;
+    m_timer_lst.add_timer(timer);
+
+    arm_recv(connfd);
+    if (http_conn::m_user_count >= m_ctl.high_watermark)
+    {
+        pause_accept(false);
+    }
+}
+
+void uring_server::on_recv(int fd, int res, unsigned flags)
+{
+    if (res == -ENOBUFS) // 接收缓冲区暂时用完 它们会在本轮被归还
+    {
+        arm_recv(fd);
+        return;
+    }
+    if (res <= 0) // 0:被关闭 <0:出错
+    {
+        close_conn(fd);
+        return;
+    }
+
+    http_conn &conn = m_users[fd];
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+        // 拷贝到应用读缓冲区后立即归还 解析器需要在连续的缓冲区上原地工作
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        memcpy(conn.m_read_buf + conn.m_read_idx, m_buffers + bid * http_conn::m_read_buffer_size, res);
+        conn.m_read_idx += res;
+        provide_buffer(bid, 1);
+    }
+    adjust_timer(fd);
+    process_request(fd);
+}
+
+// 解析读缓冲区中的数据 请求完整时开始处理
+void uring_server::process_request(int fd)
+{
+    http_conn &conn = m_users[fd];
+    http_conn::HTTP_CODE ret = conn.process_read();
+    if (ret == http_conn::NO_REQUEST) // 请求不完整 继续读
+    {
+        if (conn.m_read_idx >= http_conn::m_read_buffer_size)
+        {
+            close_conn(fd);
+            return;
+        }
+        arm_recv(fd);
+        return;
+    }
+    if (ret != http_conn::GET_REQUEST)
+    {
+        respond(fd, ret);
+        return;
+    }
+
+    // 已知不存在的路径和HEAD请求的元数据缓存命中时直接响应 否则lookup_cache已定位好目标文件
+    ret = conn.lookup_cache();
+    if (ret != http_conn::NO_REQUEST)
+    {
+        respond(fd, ret);
+        return;
+    }
+    submit_open(fd);
+}
+
+// 请求完整 在doc_root下异步打开目标文件
+void uring_server::submit_open(int fd)
+{
+    http_conn &conn = m_users[fd];
+    conn_state &state = m_conns[fd];
+    conn.fill_open_how(state.how);
+    state.root_fd = http_conn::acquire_root(); // 重新加载配置时可能被更换 打开完成前不能关闭
+    io_uring_sqe *sqe = get_sqe();
+    sqe->fd = state.root_fd;
+    sqe->addr = (__u64)(unsigned long)(conn.m_real_file[0] ? conn.m_real_file : ".");
+    if (m_openat2)
+    {
+        sqe->opcode = IORING_OP_OPENAT2;
+        sqe->len = sizeof(state.how);
+        sqe->off = (__u64)(unsigned long)&state.how;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->open_flags = state.how.flags;
+    }
+    sqe->user_data = make_data(OP_OPENAT, fd);
+}
+
+// 目标文件已打开 异步取得它的元数据 不再按路径解析
+void uring_server::on_openat(int fd, int res)
+{
+    http_conn::release_root(m_conns[fd].root_fd);
+    if (res < 0)
+    {
+        respond(fd, m_users[fd].open_failed(-res));
+        return;
+    }
+    m_conns[fd].file_fd = res;
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = res;
+    sqe->addr = (__u64)(unsigned long)"";
+    sqe->statx_flags = AT_EMPTY_PATH;
+    sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE;
+    sqe->off = (__u64)(unsigned long)&m_conns[fd].stx;
+    sqe->user_data = make_data(OP_STATX, fd);
+}
+
+void uring_server::on_statx(int fd, int res)
+{
+    http_conn &conn = m_users[fd];
+    conn_state &state = m_conns[fd];
+    http_conn::HTTP_CODE ret = http_conn::INTERNAL_ERROR;
+    if (res >= 0)
+    {
+        memset(&conn.m_file_stat, 0, sizeof(conn.m_file_stat));
+        conn.m_file_stat.st_mode = state.stx.stx_mode;
+        conn.m_file_stat.st_size = state.stx.stx_size;
+        http_conn::m_stat_cache.insert(conn.m_real_file, conn.m_file_stat);
+        if (S_ISDIR(conn.m_file_stat.st_mode) && !conn.m_index) // 目录 关闭后改为打开其中的索引文件
+        {
+            ret = conn.resolve_index();
+        }
+        else
+        {
+            ret = conn.check_file();
+        }
+        if (ret == http_conn::FILE_REQUEST && conn.m_method != http_conn::HEAD) // HEAD不映射文件
+        {
+            ret = conn.map_file(state.file_fd, false);
+        }
+    }
+    // 有页面不在page cache中：sendmsg在提交时就会同步缺页读盘，阻塞整个环上的连接
+    // 先由内核的异步工作线程用MADV_POPULATE_READ读入并建立映射，完成后再发送
+    bool populate = ret == http_conn::FILE_REQUEST && !conn.resident();
+    if (populate)
+    {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_MADVISE;
+        sqe->addr = (__u64)(unsigned long)conn.m_file_address;
+        sqe->len = conn.m_file_stat.st_size;
+        sqe->fadvise_advice = MADV_POPULATE_READ;
+        sqe->user_data = make_data(OP_POPULATE, fd);
+    }
+    // 映射完成后文件fd也异步关闭
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = state.file_fd;
+    sqe->user_data = make_data(OP_FILE_CLOSE, fd);
+    state.file_fd = -1;
+    if (ret == http_conn::NO_REQUEST)
+    {
+        submit_open(fd);
+        return;
+    }
+    if (!populate)
+    {
+        respond(fd, ret);
+    }
+}
+
+// 映射的页面已经读入 内核不支持MADV_POPULATE_READ等失败时照常发送，缺页仍在提交时处理
+void uring_server::on_populate(int fd, int res)
+{
+    if (res < 0 && res != -EINVAL)
+    {
+        printf("populate errno is: %d\n", -res);
+    }
+    respond(fd, http_conn::FILE_REQUEST);
+}
+
+// 构造响应并发送
+void uring_server::respond(int fd, http_conn::HTTP_CODE ret)
+{
+    http_conn &conn = m_users[fd];
+    // 流式响应的第一块和头部一起发出
+    if (!conn.process_write(ret) || (conn.stream_pending() && !conn.next_chunk())) // 构造响应出错
+    {
+        close_conn(fd);
+        return;
+    }
+    submit_send(fd);
+}
+
+// 用sendmsg发送m_iv中的响应 不保持连接时在后面链接一个close 发完即关闭，不必再回到用户态
+void uring_server::submit_send(int fd)
+{
+    http_conn &conn = m_users[fd];
+    conn_state &state = m_conns[fd];
+    memset(&state.msg, 0, sizeof(state.msg));
+    state.msg.msg_iov = conn.m_iv;
+    state.msg.msg_iovlen = conn.m_iv_count;
+
+    bool close_after = !conn.keep_alive() && !conn.stream_pending(); // 流式响应只在最后一块后面链接close
+    if (close_after && m_ring.sq_space() < 2) // 链接的两个请求必须在同一批提交
+    {
+        m_ring.submit();
+    }
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (__u64)(unsigned long)&state.msg;
+    sqe->len = 1;
+    // MSG_WAITALL：没发完时内核会继续等待可写，最终仍没发完则视为失败并取消链接在后面的close
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = make_data(OP_SEND, fd);
+    if (close_after)
+    {
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = get_sqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fd;
+        sqe->user_data = make_data(OP_CLOSE, fd);
+        state.closing = true;
+    }
+}
+
+void uring_server::on_send(int fd, int res)
+{
+    http_conn &conn = m_users[fd];
+    conn_state &state = m_conns[fd];
+    if (res < 0) // 发送出错 链接的close(如果有)已被取消
+    {
+        close_conn(fd);
+        return;
+    }
+
+    if (res < conn.iov_pending()) // 只发送了一部分 跳过已发送的部分继续发
+    {
+        conn.iov_advance(res);
+        state.closing = false;
+        adjust_timer(fd);
+        submit_send(fd);
+        return;
+    }
+    conn.iov_advance(res);
+
+    // 流式响应 上一块已全部发出后才让生产者生成下一块
+    if (conn.stream_pending())
+    {
+        if (!conn.next_chunk())
+        {
+            close_conn(fd);
+            return;
+        }
+        adjust_timer(fd);
+        submit_send(fd);
+        return;
+    }
+
+    if (state.closing) // 链接的close会完成剩下的工作
+    {
+        return;
+    }
+    if (!conn.keep_alive()) // 提交发送之后才开始排空
+    {
+        close_conn(fd);
+        return;
+    }
+    // 保持连接 重置http_conn状态 已读入的下一个请求直接解析，否则等待它到达
+    conn.unmap();
+    bool pipelined = conn.next_request();
+    adjust_timer(fd);
+    if (pipelined)
+    {
+        process_request(fd);
+        return;
+    }
+    arm_recv(fd);
+}
+
+// 单独提交close
+void uring_server::close_conn(int fd)
+{
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = make_data(OP_CLOSE, fd);
+    m_conns[fd].closing = true;
+}
+
+void uring_server::on_close(int fd, int res)
+{
+    if (res == -ECANCELED) // 链接在失败的send后面而被取消 send的完成事件会另行关闭
+    {
+        return;
+    }
+    printf("close fd %d\n", fd);
+    http_conn &conn = m_users[fd];
+    conn.unmap();
+    conn.m_sockfd = -1;
+    http_conn::m_user_count--;
+    if (m_users_timer[fd].counted)
+    {
+        http_conn::m_client_limits.disconnect(m_users_timer[fd].address.sin_addr.s_addr);
+        m_users_timer[fd].counted = false;
+    }
+    m_conns[fd].closing = false;
+    util_timer *timer = m_users_timer[fd].timer;
+    if (timer)
+    {
+        m_timer_lst.del_timer(timer);
+        m_users_timer[fd].timer = NULL;
+    }
+    // 连接数回落到低水位以下 恢复accept
+    if (m_accept_paused && !m_accept_emfile && http_conn::m_user_count < m_ctl.low_watermark)
+    {
+        resume_accept();
+    }
+}
+
+void uring_server::on_signal(int res)
+{
+    for (int i = 0; i < res / (int)sizeof(m_signals[0]); ++i)
+    {
+        record_signal(m_pending_signals, m_signals[i].ssi_signo);
+    }
+    if (res >= 0 || res == -EINTR || res == -EAGAIN)
+    {
+        arm_signal();
+    }
+}
+
+void uring_server::adjust_timer(int fd)
+{
+    util_timer *timer = m_users_timer[fd].timer;
+    if (timer)
+    {
+        timer->expire = m_users[fd].deadline(monotonic_ms()); // 按连接所处的阶段
+        m_timer_lst.adjust_timer(timer);
+    }
+}
+
+// 暂停accept：取消还在环中的accept请求
+void uring_server::pause_accept(bool emfile)
+{
+    if (!m_accept_paused)
+    {
+        printf("pause accept, user count:%d\n", http_conn::m_user_count);
+        if (m_accept_armed)
+        {
+            io_uring_sqe *sqe = get_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = make_data(OP_ACCEPT, 0);
+            sqe->user_data = make_data(OP_CANCEL, 0);
+        }
+        m_accept_paused = true;
+    }
+    m_accept_emfile = m_accept_emfile || emfile;
+}
+
+void uring_server::resume_accept()
+{
+    if (m_accept_paused && !m_ctl.draining) // 排空时不再恢复
+    {
+        printf("resume accept, user count:%d\n", http_conn::m_user_count);
+        m_accept_paused = false;
+        m_accept_emfile = false;
+        if (!m_accept_armed)
+        {
+            arm_accept();
+        }
+    }
+}
+
+// 开始排空：停止accept，关闭正在等待下一个请求的连接 截止时间由timerfd唤醒事件循环
+void uring_server::start_drain()
+{
+    m_drain_started = true;
+    pause_accept(false);
+    m_timer_lst.expire_if([this](client_data *user_data)
+                          { return m_users[user_data->sockfd].idle() && !m_conns[user_data->sockfd].closing; });
+}
+
+// 定时器回调：只关闭读写，让该连接上未完成的请求失败返回，再由完成事件走正常的关闭流程
+void uring_server::cb_func(client_data *user_data)
+{
+    user_data->timer = NULL; // tick随后会释放该定时器
+    shutdown(user_data->sockfd, SHUT_RDWR);
+}
+
+int uring_server::run()
+{
+    provide_buffer(0, BUFFER_COUNT);
+    arm_accept();
+    arm_signal();
+    arm_tick();
+    m_next_tick = monotonic_ms() + m_ctl.timeslot * 1000LL;
+    rearm_timer();
+
+    while (!m_stop)
+    {
+        // 一次系统调用：提交本轮产生的所有请求 并等待至少一个完成事件
+        // 信号不再有处理函数 只有进程被暂停后继续时才会返回EINTR
+        if (m_ring.submit(1) < 0 && errno != EINTR)
+        {
+            printf("io_uring failure\n");
+            return -1;
+        }
+
+        io_uring_cqe *cqe;
+        while ((cqe = m_ring.peek_cqe()) != NULL)
+        {
+            __u64 data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            m_ring.cqe_seen();
+
+            int fd = data >> 8;
+            switch (data & 0xff)
+            {
+            case OP_ACCEPT:
+                on_accept(res, flags);
+                break;
+            case OP_RECV:
+                on_recv(fd, res, flags);
+                break;
+            case OP_STATX:
+                on_statx(fd, res);
+                break;
+            case OP_OPENAT:
+                on_openat(fd, res);
+                break;
+            case OP_SEND:
+                on_send(fd, res);
+                break;
+            case OP_CLOSE:
+                on_close(fd, res);
+                break;
+            case OP_SIGNAL:
+                on_signal(res);
+                break;
+            case OP_POPULATE:
+                on_populate(fd, res);
+                break;
+            case OP_TICK: // timerfd到期
+            {
+                m_timer_armed = 0;
+                m_timer_lst.tick();
+                if (monotonic_ms() >= m_next_tick)
+                {
+                    printf("连接数量:%d\n", m_timer_lst.get_list_size());
+                    if (m_ctl.on_tick)
+                    {
+                        m_ctl.on_tick(m_ctl);
+                    }
+                    m_next_tick = monotonic_ms() + m_ctl.timeslot * 1000LL;
+                    // fd耗尽导致的暂停 每个tick重试一次
+                    if (m_accept_paused && m_accept_emfile)
+                    {
+                        resume_accept();
+                    }
+                }
+                arm_tick();
+                break;
+            }
+            case OP_PROVIDE_BUFFERS:
+            {
+                if (res < 0)
+                {
+                    printf("provide buffers errno is: %d\n", -res);
+                }
+                break;
+            }
+            default: // OP_FILE_CLOSE/OP_CANCEL 不需要处理
+                break;
+            }
+        }
+
+        // 本批完成事件都已处理 应用信号带来的参数变化 新的tick间隔在下一次tick之后生效
+        if (m_pending_signals)
+        {
+            dispatch_signals(m_pending_signals, m_ctl);
+        }
+        if (m_ctl.draining && !m_drain_started)
+        {
+            start_drain();
+        }
+        if (drain_finished(m_ctl, http_conn::m_user_count))
+        {
+            if (http_conn::m_user_count > 0)
+            {
+                printf("drain deadline reached, closing %d connections\n", http_conn::m_user_count);
+            }
+            m_stop = true;
+        }
+        rearm_timer();
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+#ifndef URING_SERVER_H
+#define URING_SERVER_H
+
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "uring.h"
+#include "http_conn.h"
+#include "lst_timer.h"
+#include "server_control.h"
+
+// io_uring事件后端
+// 与epoll后端的"就绪通知+同步系统调用"不同，这里accept/recv/send/close以及目标文件的openat2/statx都以异步请求提交到同一个环，
+// 一次io_uring_enter就能提交一批请求并收割一批完成事件
+// 请求解析在事件循环线程上直接进行(解析本身不阻塞)，阻塞的文件元数据查询和打开由内核异步完成，不再占用工作线程
+class uring_server
+{
+public:
+    // 请求类型 编码在user_data的低8位，高位是连接的fd
+    enum OP
+    {
+        OP_ACCEPT = 1,
+        OP_RECV,
+        OP_SEND,
+        OP_CLOSE,
+        OP_STATX,
+        OP_OPENAT,
+        OP_FILE_CLOSE,
+        OP_SIGNAL,
+        OP_TICK,
+        OP_PROVIDE_BUFFERS,
+        OP_CANCEL,
+        OP_POPULATE // 在内核的异步工作线程中读入映射的目标文件
+    };
+
+    static const unsigned RING_ENTRIES = 1024; // 提交队列长度
+    static const int BUFFER_COUNT = 1024;      // 提供给内核的接收缓冲区个数
+    static const int BUFFER_GROUP = 0;         // 接收缓冲区组号
+
+public:
+    // listenfd:监听socket sigfd:读取SIGTERM等信号的signalfd users/max_fd:预分配的http_conn数组 ctl:定时器间隔、accept水位等运行参数
+    // 内核不支持io_uring或缺少所需操作时抛出std::exception，由调用方回落到epoll
+    uring_server(int listenfd, int sigfd, http_conn *users, int max_fd, server_control &ctl);
+    ~uring_server();
+
+    // 运行事件循环 直到收到SIGTERM或排空结束
+    int run();
+
+private:
+    // 每个连接在io_uring后端中的额外状态，以fd为下标
+    struct conn_state
+    {
+        struct open_how how; // 在doc_root下打开目标文件的方式
+        int root_fd;         // 提交打开时取得的doc_root 打开完成后归还
+        int file_fd;         // 已打开的目标文件
+        struct statx stx;    // statx的结果
+        struct msghdr msg;  // sendmsg的消息头 指向http_conn的m_iv
+        bool closing;       // 已提交close 等待其完成
+    };
+
+    io_uring_sqe *get_sqe();
+    void arm_accept();
+    void arm_recv(int fd);
+    void arm_signal();
+    void arm_tick();
+    void rearm_timer();
+    void provide_buffer(int bid, int count);
+
+    void on_accept(int res, unsigned flags);
+    void on_recv(int fd, int res, unsigned flags);
+    void process_request(int fd);
+    void on_statx(int fd, int res);
+    void on_openat(int fd, int res);
+    void submit_open(int fd);
+    void on_send(int fd, int res);
+    void on_close(int fd, int res);
+    void on_populate(int fd, int res);
+    void on_signal(int res);
+
+    void add_client(int connfd);
+    void respond(int fd, http_conn::HTTP_CODE ret);
+    void submit_send(int fd);
+    void close_conn(int fd);
+    void adjust_timer(int fd);
+    void pause_accept(bool emfile);
+    void resume_accept();
+    void start_drain();
+
+    static void cb_func(client_data *user_data);
+
+private:
+    uring m_ring;
+    int m_listenfd;
+    int m_sigfd;
+    http_conn *m_users;
+    int m_max_fd;
+    server_control &m_ctl;
+
+    conn_state *m_conns;        // 与m_users一一对应
+    client_data *m_users_timer; // 定时器相关的用户数据
+    sort_timer_lst m_timer_lst; // 升序链表定时器
+
+    char *m_buffers;            // 提供给内核的接收缓冲区 BUFFER_COUNT * m_read_buffer_size
+    struct signalfd_siginfo m_signals[16]; // signalfd的读缓冲
+    unsigned m_pending_signals; // 等待本批完成事件处理完后交给m_ctl.on_signal的信号
+    int m_timerfd;              // 在最早的截止时间到期 对它的读请求完成即定时器超时
+    uint64_t m_expirations;     // timerfd的读缓冲
+    long long m_timer_armed;    // timerfd当前设置的到期时刻(monotonic_ms()的毫秒数) 0表示没有设置或已经到期
+    long long m_next_tick;      // 下一次调用m_ctl.on_tick的时刻(毫秒)
+    bool m_drain_started;       // 已停止accept并关闭了空闲连接
+
+    bool m_multishot_accept;    // 内核是否支持multishot accept
+    bool m_accept_armed;        // accept请求是否在环中
+    bool m_accept_paused;
+    bool m_accept_emfile;       // 因fd耗尽而暂停 只在定时器tick时重试
+    bool m_stop;
+    bool m_openat2;          // 内核支持IORING_OP_OPENAT2
+};
+
+#endif
@@ -0,0 +1,27 @@
+#!/bin/bash
+# 对比不同请求引擎的吞吐量：依次以各个引擎启动服务器，用webbench压测同一个页面
+# 用法: ./bench_engines.sh <lwcWebServer路径> [并发数] [秒数] [url路径] [引擎列表]
+# 例如: ./bench_engines.sh ../build/lwcWebServer 500 10 /home.html "epoll coro uring"
+
+SERVER=${1:?usage: $0 <lwcWebServer> [clients] [seconds] [path] [engines]}
+CLIENTS=${2:-500}
+SECONDS_PER_RUN=${3:-10}
+URL_PATH=${4:-/home.html}
+ENGINES=${5:-"epoll coro uring"}
+PORT=9190
+WB="$(cd "$(dirname "$0")" && pwd)/wb"
+
+# 服务器以相对路径../doc_root查找网站根目录 需要在其所在目录下启动
+cd "$(dirname "$SERVER")" || exit 1
+SERVER=./$(basename "$SERVER")
+
+for engine in $ENGINES; do
+    "$SERVER" -e "$engine" 127.0.0.1 $PORT > /dev/null 2>&1 &
+    pid=$!
+    sleep 1
+    result=$("$WB" -2 --get -c "$CLIENTS" -t "$SECONDS_PER_RUN" "http://127.0.0.1:$PORT$URL_PATH" 2>&1 | grep -E "Speed=")
+    echo "$engine: $result"
+    kill -TERM $pid
+    wait $pid 2>/dev/null
+    PORT=$((PORT + 1)) # 避免上一轮的TIME_WAIT影响bind
+done